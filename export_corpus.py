@@ -1,12 +1,18 @@
 import sys
 import os
 import re
+import struct
 from pymongo import MongoClient
 from bs4 import BeautifulSoup
 import yaml
 
 CONFIG_PATH = os.path.join(os.path.dirname(__file__), 'config.yaml')
 
+# Binary corpus format, see include/corpus.hpp.
+CORPUS_MAGIC = 0x53505243
+CORPUS_VERSION = 1
+RECORD_HEADER = struct.Struct('<IIQIII')
+
 def load_config(path):
     with open(path, 'r') as f:
         return yaml.safe_load(f)
@@ -25,7 +31,38 @@ def clean_text(html):
     
     return text
 
-def export_data():
+class CorpusWriter:
+    def __init__(self, path):
+        self.f = open(path, 'wb')
+        self.f.write(struct.pack('<II', CORPUS_MAGIC, CORPUS_VERSION))
+        self.count = 0
+
+    def add(self, crawled, url, source, text):
+        url, source, text = (s.encode('utf-8') for s in (url, source, text))
+        size = RECORD_HEADER.size - 4 + len(url) + len(source) + len(text)
+        self.f.write(RECORD_HEADER.pack(size, self.count, crawled, len(url), len(source), len(text)))
+        self.f.write(url)
+        self.f.write(source)
+        self.f.write(text)
+        self.count += 1
+
+    def close(self):
+        self.f.close()
+
+class TextWriter:
+    def __init__(self, text_path, urls_path):
+        self.f_text = open(text_path, 'w', encoding='utf-8')
+        self.f_urls = open(urls_path, 'w', encoding='utf-8')
+
+    def add(self, crawled, url, source, text):
+        self.f_text.write(text.replace('\n', ' ').replace('\r', ' ') + "\n")
+        self.f_urls.write(url + "\n")
+
+    def close(self):
+        self.f_text.close()
+        self.f_urls.close()
+
+def export_data(text_format=False):
     config = load_config(CONFIG_PATH)
     db_conf = config['db']
     
@@ -33,32 +70,32 @@ def export_data():
     db = client[db_conf['name']]
     collection = db[db_conf['collection']]
     
-    output_file = os.path.join(os.path.dirname(__file__), 'data/corpus.txt')
-    urls_file = os.path.join(os.path.dirname(__file__), 'data/urls.txt')
-    
-    
-    print(f"Exporting articles to {output_file} and {urls_file}...")
+    data_dir = os.path.join(os.path.dirname(__file__), 'data')
+    if text_format:
+        output_file = os.path.join(data_dir, 'corpus.txt')
+        urls_file = os.path.join(data_dir, 'urls.txt')
+        print(f"Exporting articles to {output_file} and {urls_file}...")
+        writer = TextWriter(output_file, urls_file)
+    else:
+        output_file = os.path.join(data_dir, 'corpus.bin')
+        print(f"Exporting articles to {output_file}...")
+        writer = CorpusWriter(output_file)
     
     count = 0
-    with open(output_file, 'w', encoding='utf-8') as f_text, \
-         open(urls_file, 'w', encoding='utf-8') as f_urls:
-        cursor = collection.find({"type": "article"})
-        total = collection.count_documents({"type": "article"})
-        
-        for doc in cursor:
-            if 'html' in doc and 'url' in doc:
-                text = clean_text(doc['html'])
-
-                text = text.replace('\n', ' ').replace('\r', ' ')
-                
-                f_text.write(text + "\n")
-                f_urls.write(doc['url'] + "\n")
-                
-                count += 1
-                if count % 100 == 0:
-                    print(f"Processed {count}/{total}", end='\r')
+    cursor = collection.find({"type": "article"})
+    total = collection.count_documents({"type": "article"})
+    
+    for doc in cursor:
+        if 'html' in doc and 'url' in doc:
+            text = clean_text(doc['html'])
+            writer.add(int(doc.get('crawled_at', 0)), doc['url'], doc.get('source', ''), text)
+            
+            count += 1
+            if count % 100 == 0:
+                print(f"Processed {count}/{total}", end='\r')
+    writer.close()
                     
     print(f"\nDone! Exported {count} documents.")
 
 if __name__ == "__main__":
-    export_data()
+    export_data(text_format='--text' in sys.argv[1:])
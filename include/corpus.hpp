@@ -0,0 +1,164 @@
+#ifndef CORPUS_HPP
+#define CORPUS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include "mapped_file.hpp"
+
+// Binary corpus (little-endian), written by export_corpus.py or by
+// `cli convert` from a corpus.txt/urls.txt pair:
+//
+//   CorpusHeader
+//   record*    u32 size        bytes of the record after this field
+//              u32 id          position of the record in the file
+//              u64 crawled     fetch time, unix seconds; 0 if unknown
+//              u32 url_length
+//              u32 source_length
+//              u32 text_length
+//              url, source and text bytes (UTF-8)
+//
+// Every record carries its own length, so text with newlines or a missing
+// URL cannot shift the documents after it.
+
+const uint32_t CORPUS_MAGIC = 0x53505243; // "CRPS"
+const uint32_t CORPUS_VERSION = 1;
+// Fixed part of a record, size field included.
+const size_t CORPUS_RECORD_HEADER = 28;
+
+struct CorpusHeader {
+    uint32_t magic;
+    uint32_t version;
+};
+
+// Views into the mapped corpus, valid while its reader is open.
+struct CorpusRecord {
+    uint32_t id;
+    uint64_t crawled;
+    std::string_view url;
+    std::string_view source;
+    std::string_view text;
+};
+
+inline bool is_binary_corpus(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    CorpusHeader header;
+    in.read((char*)&header, sizeof(header));
+    return in && header.magic == CORPUS_MAGIC;
+}
+
+class CorpusReader {
+    MappedFile file;
+    size_t pos;
+    uint32_t count;
+    std::string message;
+
+    uint32_t u32(size_t at) const {
+        uint32_t v;
+        std::memcpy(&v, file.data() + at, sizeof(v));
+        return v;
+    }
+
+    bool fail(const std::string& what) {
+        message = "corrupt corpus record " + std::to_string(count) + ": " + what;
+        pos = file.size();
+        return false;
+    }
+
+public:
+    CorpusReader() : pos(0), count(0) {}
+
+    bool open(const std::string& path, std::string& error) {
+        pos = 0;
+        count = 0;
+        message.clear();
+        if (!file.open(path)) {
+            error = "cannot open " + path;
+            return false;
+        }
+        CorpusHeader header;
+        if (file.size() < sizeof(header)) {
+            error = path + " is not a binary corpus";
+            return false;
+        }
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (header.magic != CORPUS_MAGIC) {
+            error = path + " is not a binary corpus";
+            return false;
+        }
+        if (header.version != CORPUS_VERSION) {
+            error = "unsupported corpus version " + std::to_string(header.version);
+            return false;
+        }
+        file.advise_sequential();
+        pos = sizeof(header);
+        return true;
+    }
+
+    // Reads the next record; false at the end of the corpus or at a
+    // malformed record, which error() then describes.
+    bool next(CorpusRecord& record) {
+        size_t left = file.size() - pos;
+        if (left == 0) return false;
+        if (left < CORPUS_RECORD_HEADER) return fail("truncated header");
+        uint32_t size = u32(pos);
+        if (size < CORPUS_RECORD_HEADER - 4 || size > left - 4) return fail("bad size");
+        record.id = u32(pos + 4);
+        std::memcpy(&record.crawled, file.data() + pos + 8, sizeof(record.crawled));
+        uint64_t url_length = u32(pos + 16), source_length = u32(pos + 20), text_length = u32(pos + 24);
+        if (CORPUS_RECORD_HEADER - 4 + url_length + source_length + text_length != size) return fail("bad field lengths");
+        if (record.id != count) return fail("out of order");
+        const char* p = file.data() + pos + CORPUS_RECORD_HEADER;
+        record.url = std::string_view(p, url_length);
+        record.source = std::string_view(p + url_length, source_length);
+        record.text = std::string_view(p + url_length + source_length, text_length);
+        pos += 4 + size;
+        count++;
+        return true;
+    }
+
+    const std::string& error() const { return message; }
+};
+
+class CorpusWriter {
+    std::ofstream out;
+    uint32_t count;
+
+    void put_u32(uint32_t v) { out.write((const char*)&v, sizeof(v)); }
+
+public:
+    CorpusWriter() : count(0) {}
+
+    bool open(const std::string& path) {
+        count = 0;
+        out.open(path, std::ios::binary | std::ios::trunc);
+        CorpusHeader header;
+        header.magic = CORPUS_MAGIC;
+        header.version = CORPUS_VERSION;
+        out.write((const char*)&header, sizeof(header));
+        return (bool)out;
+    }
+
+    void add(uint64_t crawled, std::string_view url, std::string_view source, std::string_view text) {
+        put_u32((uint32_t)(CORPUS_RECORD_HEADER - 4 + url.size() + source.size() + text.size()));
+        put_u32(count++);
+        out.write((const char*)&crawled, sizeof(crawled));
+        put_u32((uint32_t)url.size());
+        put_u32((uint32_t)source.size());
+        put_u32((uint32_t)text.size());
+        out.write(url.data(), url.size());
+        out.write(source.data(), source.size());
+        out.write(text.data(), text.size());
+    }
+
+    uint32_t size() const { return count; }
+
+    bool close() {
+        out.close();
+        return !out.fail();
+    }
+};
+
+#endif
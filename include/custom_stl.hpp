@@ -2,7 +2,11 @@
 #define CUSTOM_STL_HPP
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <string_view>
+#include <utility>
 
 
 template<typename T>
@@ -21,6 +25,11 @@ public:
         data = new T[capacity];
         for(size_t i=0; i<sz; ++i) data[i] = other.data[i];
     }
+    Vector(Vector&& other) : data(other.data), capacity(other.capacity), sz(other.sz) {
+        other.data = nullptr;
+        other.capacity = 0;
+        other.sz = 0;
+    }
     Vector& operator=(const Vector& other) {
         if(this != &other) {
             delete[] data;
@@ -31,18 +40,38 @@ public:
         }
         return *this;
     }
+    Vector& operator=(Vector&& other) {
+        if(this != &other) {
+            delete[] data;
+            data = other.data;
+            capacity = other.capacity;
+            sz = other.sz;
+            other.data = nullptr;
+            other.capacity = 0;
+            other.sz = 0;
+        }
+        return *this;
+    }
     ~Vector() { delete[] data; }
     
+    void reserve(size_t n) {
+        if(n <= capacity) return;
+        T* newData = new T[n];
+        for(size_t i=0; i<sz; ++i) newData[i] = std::move(data[i]);
+        delete[] data;
+        data = newData;
+        capacity = n;
+    }
+
     void push_back(const T& val) {
-        if(sz == capacity) {
-            capacity = (capacity == 0) ? 8 : capacity * 2;
-            T* newData = new T[capacity];
-            for(size_t i=0; i<sz; ++i) newData[i] = data[i];
-            delete[] data;
-            data = newData;
-        }
+        if(sz == capacity) reserve((capacity == 0) ? 8 : capacity * 2);
         data[sz++] = val;
     }
+
+    void push_back(T&& val) {
+        if(sz == capacity) reserve((capacity == 0) ? 8 : capacity * 2);
+        data[sz++] = std::move(val);
+    }
     
     T& operator[](size_t i) { return data[i]; }
     const T& operator[](size_t i) const { return data[i]; }
@@ -63,74 +92,197 @@ struct Pair {
     Pair(K k, V v) : first(k), second(v) {}
 };
 
+inline uint64_t hash_int(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// Multiply-mix hash over 8-byte words (in the spirit of wyhash).
+inline uint64_t hash_bytes(const void* data, size_t n) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+    while (n >= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = hash_mix(h ^ w, 0xa0761d6478bd642fULL);
+        p += 8;
+        n -= 8;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p, n);
+    return hash_mix(h ^ tail, 0xe7037ed1a0b428dbULL);
+}
+
+// Bump allocator for strings that live as long as their owner.
+class Arena {
+    Vector<char*> blocks;
+    char* cur;
+    size_t left;
+    static const size_t BLOCK = 64 * 1024;
+
+public:
+    Arena() : cur(nullptr), left(0) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { clear(); }
+
+    std::string_view copy(std::string_view s) {
+        if (s.size() > left) {
+            size_t n = s.size() > BLOCK ? s.size() : BLOCK;
+            cur = new char[n];
+            left = n;
+            blocks.push_back(cur);
+        }
+        char* p = cur;
+        std::memcpy(p, s.data(), s.size());
+        cur += s.size();
+        left -= s.size();
+        return std::string_view(p, s.size());
+    }
+
+    void clear() {
+        for (size_t i = 0; i < blocks.size(); ++i) delete[] blocks[i];
+        blocks.clear();
+        cur = nullptr;
+        left = 0;
+    }
+};
+
+template<typename K>
+struct HashKey {
+    typedef K Stored;
+    typedef const K& Lookup;
+    static uint64_t hash(Lookup k) { return hash_int((uint64_t)k); }
+    static Stored store(Lookup k, Arena&) { return k; }
+    static const K& view(const Stored& k) { return k; }
+};
+
+// String keys are copied into the map's arena and can be looked up by any
+// string_view without building a std::string.
+template<>
+struct HashKey<std::string> {
+    typedef std::string_view Stored;
+    typedef std::string_view Lookup;
+    static uint64_t hash(Lookup k) { return hash_bytes(k.data(), k.size()); }
+    static Stored store(Lookup k, Arena& arena) { return arena.copy(k); }
+    static std::string_view view(const Stored& k) { return k; }
+};
+
+// Open-addressing hash map with linear probing. The table doubles once it
+// is 3/4 full; references returned by operator[] and find() are invalidated
+// by the next insertion.
 template<typename K, typename V>
 class HashMap {
-    struct Node {
-        K key;
-        V value;
-        Node* next;
-        Node(K k, V v) : key(k), value(v), next(nullptr) {}
-    };
-    Node** buckets;
-    size_t bucket_count;
+    typedef HashKey<K> Key;
+    typedef typename Key::Stored Stored;
+    typedef typename Key::Lookup Lookup;
+
+    uint64_t* hashes;
+    Stored* keys;
+    V* values;
+    size_t capacity;
     size_t sz;
+    Arena arena;
 
-    size_t hash(int k) const { return k % bucket_count; }
-    size_t hash(const std::string& k) const {
-        size_t h = 0;
-        for(unsigned char c : k) h = 31 * h + c;
-        return h % bucket_count;
+    static uint64_t key_hash(Lookup key) {
+        uint64_t h = Key::hash(key);
+        return h ? h : 1;
     }
 
-public:
-    HashMap(size_t buckets = 50021) : bucket_count(buckets), sz(0) {
-        this->buckets = new Node*[bucket_count];
-        for(size_t i=0; i<bucket_count; ++i) this->buckets[i] = nullptr;
-    }
-    ~HashMap() {
-        for(size_t i=0; i<bucket_count; ++i) {
-            Node* curr = buckets[i];
-            while(curr) {
-                Node* next = curr->next;
-                delete curr;
-                curr = next;
-            }
+    size_t slot(Lookup key, uint64_t h) const {
+        size_t mask = capacity - 1;
+        size_t i = (size_t)h & mask;
+        while (hashes[i] != 0) {
+            if (hashes[i] == h && keys[i] == key) return i;
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void allocate(size_t n) {
+        capacity = n;
+        hashes = new uint64_t[n];
+        keys = new Stored[n];
+        values = new V[n]();
+        for (size_t i = 0; i < n; ++i) hashes[i] = 0;
+    }
+
+    void release() {
+        delete[] hashes;
+        delete[] keys;
+        delete[] values;
+    }
+
+    void grow() {
+        uint64_t* old_hashes = hashes;
+        Stored* old_keys = keys;
+        V* old_values = values;
+        size_t old_capacity = capacity;
+        allocate(capacity * 2);
+        size_t mask = capacity - 1;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_hashes[i] == 0) continue;
+            size_t j = (size_t)old_hashes[i] & mask;
+            while (hashes[j] != 0) j = (j + 1) & mask;
+            hashes[j] = old_hashes[i];
+            keys[j] = old_keys[i];
+            values[j] = std::move(old_values[i]);
         }
-        delete[] buckets;
+        delete[] old_hashes;
+        delete[] old_keys;
+        delete[] old_values;
+    }
+
+public:
+    HashMap(size_t expected = 0) : sz(0) {
+        size_t n = 16;
+        while (n * 3 < expected * 4) n *= 2;
+        allocate(n);
+    }
+    HashMap(const HashMap&) = delete;
+    HashMap& operator=(const HashMap&) = delete;
+    ~HashMap() { release(); }
+
+    void clear() {
+        release();
+        arena.clear();
+        allocate(16);
+        sz = 0;
     }
     
-    V& operator[](const K& key) {
-        size_t h = hash(key);
-        Node* curr = buckets[h];
-        while(curr) {
-            if(curr->key == key) return curr->value;
-            curr = curr->next;
+    V& operator[](Lookup key) {
+        uint64_t h = key_hash(key);
+        size_t i = slot(key, h);
+        if (hashes[i] != 0) return values[i];
+        if ((sz + 1) * 4 > capacity * 3) {
+            grow();
+            i = slot(key, h);
         }
-        Node* newNode = new Node(key, V());
-        newNode->next = buckets[h];
-        buckets[h] = newNode;
+        hashes[i] = h;
+        keys[i] = Key::store(key, arena);
         sz++;
-        return newNode->value;
+        return values[i];
     }
     
-    V* find(const K& key) const {
-        size_t h = hash(key);
-        Node* curr = buckets[h];
-        while(curr) {
-            if(curr->key == key) return &curr->value;
-            curr = curr->next;
-        }
-        return nullptr;
+    V* find(Lookup key) const {
+        uint64_t h = key_hash(key);
+        size_t i = slot(key, h);
+        return hashes[i] != 0 ? &values[i] : nullptr;
     }
 
     template<typename Func>
     void forEach(Func f) const {
-        for(size_t i=0; i<bucket_count; ++i) {
-            Node* curr = buckets[i];
-            while(curr) {
-                f(curr->key, curr->value);
-                curr = curr->next;
-            }
+        for (size_t i = 0; i < capacity; ++i) {
+            if (hashes[i] != 0) f(Key::view(keys[i]), values[i]);
         }
     }
     
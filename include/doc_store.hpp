@@ -0,0 +1,254 @@
+#ifndef DOC_STORE_HPP
+#define DOC_STORE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include "custom_stl.hpp"
+#include "mapped_file.hpp"
+
+// Per-document metadata of one index segment, in <segment>.docs and
+// indexed by the segment's own doc ids (little-endian):
+//
+//   DocStoreHeader
+//   url_offsets  u64[num_docs + 1], offsets of the URLs in the URL blob
+//   crawled      u64[num_docs], fetch time in unix seconds; 0 if unknown
+//   lengths      u32[num_docs], document length in tokens
+//   sources      u8[num_docs], index into the source names
+//   names        source names, each followed by a NUL; name 0 is ""
+//   urls         concatenated URL bytes
+//
+// A document's URL is two reads of url_offsets and a view of the blob.
+
+const uint32_t DOC_STORE_MAGIC = 0x53434f44; // "DOCS"
+const uint32_t DOC_STORE_VERSION = 1;
+const size_t DOC_STORE_MAX_SOURCES = 256;
+
+struct DocStoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_docs;
+    uint64_t num_sources;
+    uint64_t offsets_offset;
+    uint64_t crawled_offset;
+    uint64_t lengths_offset;
+    uint64_t sources_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t urls_offset;
+    uint64_t urls_size;
+};
+
+inline std::string doc_store_path(const std::string& segment_file) { return segment_file + ".docs"; }
+
+class DocStore {
+    MappedFile file;
+    const DocStoreHeader* header;
+    const uint64_t* offsets;
+    const uint64_t* crawled_at;
+    const uint32_t* lengths;
+    const uint8_t* sources;
+    const char* urls;
+    Vector<std::string_view> names;
+
+    bool fail(std::string& error, const std::string& message) {
+        error = message;
+        file.close();
+        header = nullptr;
+        return false;
+    }
+
+public:
+    DocStore() : header(nullptr), offsets(nullptr), crawled_at(nullptr), lengths(nullptr), sources(nullptr), urls(nullptr) {}
+    DocStore(const DocStore&) = delete;
+    DocStore& operator=(const DocStore&) = delete;
+
+    bool open(const std::string& filename, std::string& error) {
+        names.clear();
+        if (!file.open(filename)) return fail(error, "cannot open " + filename);
+        if (file.size() < sizeof(DocStoreHeader)) return fail(error, "truncated doc store " + filename);
+        header = (const DocStoreHeader*)file.data();
+        if (header->magic != DOC_STORE_MAGIC) return fail(error, filename + " is not a doc store");
+        if (header->version != DOC_STORE_VERSION) {
+            return fail(error, "unsupported doc store version " + std::to_string(header->version));
+        }
+        uint64_t n = header->num_docs;
+        if (header->offsets_offset + (n + 1) * 8 > file.size() || header->crawled_offset + n * 8 > file.size() ||
+            header->lengths_offset + n * 4 > file.size() || header->sources_offset + n > file.size() ||
+            header->names_offset + header->names_size > file.size() ||
+            header->urls_offset + header->urls_size > file.size()) {
+            return fail(error, "truncated doc store " + filename);
+        }
+        const char* base = file.data();
+        offsets = (const uint64_t*)(base + header->offsets_offset);
+        crawled_at = (const uint64_t*)(base + header->crawled_offset);
+        lengths = (const uint32_t*)(base + header->lengths_offset);
+        sources = (const uint8_t*)(base + header->sources_offset);
+        urls = base + header->urls_offset;
+        if (offsets[n] != header->urls_size) return fail(error, "corrupt doc store " + filename);
+        const char* name = base + header->names_offset;
+        const char* end = name + header->names_size;
+        while (name < end && names.size() < header->num_sources) {
+            size_t len = strnlen(name, end - name);
+            names.push_back(std::string_view(name, len));
+            name += len + 1;
+        }
+        if (names.size() != header->num_sources) return fail(error, "corrupt doc store " + filename);
+        for (uint64_t d = 0; d < n; ++d) {
+            if (sources[d] >= names.size()) return fail(error, "corrupt doc store " + filename);
+        }
+        file.advise_random();
+        return true;
+    }
+
+    uint64_t size() const { return header ? header->num_docs : 0; }
+
+    // Empty for documents without a URL and for ids outside the store.
+    std::string_view url(int doc) const {
+        if ((uint64_t)doc >= size()) return std::string_view();
+        return std::string_view(urls + offsets[doc], offsets[doc + 1] - offsets[doc]);
+    }
+    std::string_view source(int doc) const { return (uint64_t)doc < size() ? names[sources[doc]] : std::string_view(); }
+    uint64_t crawled(int doc) const { return (uint64_t)doc < size() ? crawled_at[doc] : 0; }
+    uint32_t length(int doc) const { return (uint64_t)doc < size() ? lengths[doc] : 0; }
+};
+
+// Documents are added in doc id order. URLs and the fixed-width columns are
+// streamed to side files, so a build holds only the source names. The
+// store is written aside and renamed into place by finish().
+class DocStoreWriter {
+    std::string path;
+    std::ofstream urls_out;
+    std::ofstream offsets_out;
+    std::ofstream crawled_out;
+    std::ofstream sources_out;
+    uint64_t urls_size;
+    uint64_t num_docs;
+    Vector<std::string> names;
+    HashMap<std::string, int> codes;
+
+    std::string spool(const char* column) const { return path + "." + column + ".tmp"; }
+
+    void remove_spools() {
+        urls_out.close();
+        offsets_out.close();
+        crawled_out.close();
+        sources_out.close();
+        std::remove(spool("urls").c_str());
+        std::remove(spool("offsets").c_str());
+        std::remove(spool("crawled").c_str());
+        std::remove(spool("sources").c_str());
+    }
+
+    // Copying an empty file would set failbit on `out`.
+    void append_spool(std::ofstream& out, const char* column, uint64_t size) {
+        std::ifstream in(spool(column), std::ios::binary);
+        if (size > 0) out << in.rdbuf();
+    }
+
+public:
+    DocStoreWriter() : urls_size(0), num_docs(0) {}
+    DocStoreWriter(const DocStoreWriter&) = delete;
+    DocStoreWriter& operator=(const DocStoreWriter&) = delete;
+    // An unfinished store leaves nothing behind.
+    ~DocStoreWriter() {
+        if (urls_out.is_open()) remove_spools();
+    }
+
+    bool open(const std::string& filename) {
+        path = filename;
+        urls_out.open(spool("urls"), std::ios::binary | std::ios::trunc);
+        offsets_out.open(spool("offsets"), std::ios::binary | std::ios::trunc);
+        crawled_out.open(spool("crawled"), std::ios::binary | std::ios::trunc);
+        sources_out.open(spool("sources"), std::ios::binary | std::ios::trunc);
+        urls_size = 0;
+        num_docs = 0;
+        offsets_out.write((const char*)&urls_size, 8);
+        names.clear();
+        names.push_back(std::string());
+        codes.clear();
+        return urls_out.is_open() && offsets_out.is_open() && crawled_out.is_open() && sources_out.is_open();
+    }
+
+    // Sources beyond the first 255 distinct names are stored as "".
+    void add(std::string_view url, std::string_view source, uint64_t crawled_at) {
+        urls_out.write(url.data(), (std::streamsize)url.size());
+        urls_size += url.size();
+        offsets_out.write((const char*)&urls_size, 8);
+        crawled_out.write((const char*)&crawled_at, 8);
+        int code = 0;
+        if (!source.empty()) {
+            int* known = codes.find(source);
+            if (known) {
+                code = *known;
+            } else if (names.size() < DOC_STORE_MAX_SOURCES) {
+                code = (int)names.size();
+                names.push_back(std::string(source));
+                codes[source] = code;
+            }
+        }
+        uint8_t byte = (uint8_t)code;
+        sources_out.write((const char*)&byte, 1);
+        num_docs++;
+    }
+
+    void add(const DocStore& store, int doc) { add(store.url(doc), store.source(doc), store.crawled(doc)); }
+
+    uint64_t size() const { return num_docs; }
+
+    // `lengths` holds the length of every document added.
+    bool finish(const Vector<uint32_t>& lengths) { return finish(lengths.begin(), lengths.size()); }
+
+    bool finish(const uint32_t* lengths, uint64_t n) {
+        urls_out.close();
+        offsets_out.close();
+        crawled_out.close();
+        sources_out.close();
+        if (urls_out.fail() || offsets_out.fail() || crawled_out.fail() || sources_out.fail() || n != num_docs) {
+            remove_spools();
+            return false;
+        }
+        std::string names_data;
+        for (size_t i = 0; i < names.size(); ++i) {
+            names_data += names[i];
+            names_data += '\0';
+        }
+
+        DocStoreHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = DOC_STORE_MAGIC;
+        header.version = DOC_STORE_VERSION;
+        header.num_docs = n;
+        header.num_sources = names.size();
+        header.offsets_offset = sizeof(header);
+        header.crawled_offset = header.offsets_offset + (n + 1) * 8;
+        header.lengths_offset = header.crawled_offset + n * 8;
+        header.sources_offset = header.lengths_offset + n * 4;
+        header.names_offset = header.sources_offset + n;
+        header.names_size = names_data.size();
+        header.urls_offset = header.names_offset + header.names_size;
+        header.urls_size = urls_size;
+
+        std::string tmp = path + ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write((const char*)&header, sizeof(header));
+        append_spool(out, "offsets", (n + 1) * 8);
+        append_spool(out, "crawled", n * 8);
+        out.write((const char*)lengths, (std::streamsize)(n * 4));
+        append_spool(out, "sources", n);
+        out.write(names_data.data(), (std::streamsize)names_data.size());
+        append_spool(out, "urls", urls_size);
+        remove_spools();
+        out.close();
+        if (out.fail() || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
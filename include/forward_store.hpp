@@ -0,0 +1,342 @@
+#ifndef FORWARD_STORE_HPP
+#define FORWARD_STORE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include "custom_stl.hpp"
+#include "mapped_file.hpp"
+
+// Document texts of one index segment, in <segment>.fwd (little-endian):
+//
+//   ForwardStoreHeader
+//   blocks       each the u32 text lengths of its documents followed by
+//                their LZ-compressed concatenated texts
+//   offsets      u64[num_blocks + 1], file offsets of the blocks
+//   first_docs   u64[num_blocks + 1], first document of each block
+//
+// A block is closed once it holds FORWARD_BLOCK_BYTES of text, so it has a
+// few short documents or a single long one. Blocks are compressed
+// independently: reading one document decodes its block and nothing else.
+
+const uint32_t FORWARD_STORE_MAGIC = 0x53445746; // "FWDS"
+const uint32_t FORWARD_STORE_VERSION = 1;
+const size_t FORWARD_BLOCK_BYTES = 16384;
+
+struct ForwardStoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_docs;
+    uint64_t num_blocks;
+    uint64_t offsets_offset;
+    uint64_t first_docs_offset;
+};
+
+inline std::string forward_store_path(const std::string& segment_file) { return segment_file + ".fwd"; }
+
+// Byte-oriented LZ77 in the style of LZ4. A sequence is a token byte (high
+// nibble: literal count, low nibble: match length - 4; 15 means more length
+// bytes follow, each adding up to 255), the literals, and a u16 match
+// offset. The last sequence has literals only.
+const size_t LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 13;
+
+inline void lz_put_length(std::string& out, size_t n) {
+    for (; n >= 255; n -= 255) out += (char)255;
+    out += (char)n;
+}
+
+inline void lz_put_sequence(std::string& out, const char* literals, size_t num_literals, size_t offset,
+                            size_t match_length) {
+    size_t extra = match_length ? match_length - LZ_MIN_MATCH : 0;
+    out += (char)(((num_literals < 15 ? num_literals : 15) << 4) | (extra < 15 ? extra : 15));
+    if (num_literals >= 15) lz_put_length(out, num_literals - 15);
+    out.append(literals, num_literals);
+    if (!match_length) return;
+    out += (char)(offset & 0xff);
+    out += (char)(offset >> 8);
+    if (extra >= 15) lz_put_length(out, extra - 15);
+}
+
+inline void lz_compress(const char* src, size_t n, std::string& out) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    std::memset(table, 0, sizeof(table));
+    size_t anchor = 0, i = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t word;
+        std::memcpy(&word, src + i, 4);
+        uint32_t h = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)(i + 1);
+        if (candidate == 0 || i + 1 - candidate > 0xffff || std::memcmp(src + candidate - 1, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t from = candidate - 1, length = LZ_MIN_MATCH;
+        while (i + length < n && src[from + length] == src[i + length]) length++;
+        lz_put_sequence(out, src + anchor, i - anchor, i - from, length);
+        i += length;
+        anchor = i;
+    }
+    lz_put_sequence(out, src + anchor, n - anchor, 0, 0);
+}
+
+// Reads an extended length (bytes adding up to 255 each) after `base`;
+// SIZE_MAX if the input ends first.
+inline size_t lz_length(const unsigned char*& p, const unsigned char* end, size_t base) {
+    if (base < 15) return base;
+    while (p < end) {
+        unsigned char b = *p++;
+        base += b;
+        if (b != 255) return base;
+    }
+    return SIZE_MAX;
+}
+
+// Decodes `n` bytes of a `raw_size`-byte input into `out`, stopping early
+// once `limit` bytes are out; false if the input is malformed. Away from
+// the ends of input and output, literal runs and matches are copied in 16-
+// and 8-byte chunks that may spill into the slack after them.
+inline bool lz_decompress(const char* src, size_t n, size_t raw_size, std::string& out, size_t limit = SIZE_MAX) {
+    const size_t SLACK = 32;
+    size_t stop = limit < raw_size ? limit : raw_size;
+    out.resize(raw_size + SLACK);
+    char* dst = &out[0];
+    const unsigned char* p = (const unsigned char*)src;
+    const unsigned char* end = p + n;
+    size_t at = 0;
+    while (p < end && at < stop) {
+        unsigned token = *p++;
+        size_t literals = token >> 4;
+        size_t match = (token & 15) + LZ_MIN_MATCH;
+        if (literals < 15 && end - p >= 18 && raw_size - at >= 16) {
+            std::memcpy(dst + at, p, 16);
+            p += literals;
+            at += literals;
+            size_t offset = p[0] | ((size_t)p[1] << 8);
+            if (match < 15 + LZ_MIN_MATCH && offset >= 8 && offset <= at && raw_size - at >= match) {
+                p += 2;
+                char* to = dst + at;
+                std::memcpy(to, to - offset, 8);
+                std::memcpy(to + 8, to - offset + 8, 8);
+                if (match > 16) std::memcpy(to + 16, to - offset + 16, 8);
+                at += match;
+                continue;
+            }
+        } else {
+            literals = lz_length(p, end, literals);
+            if (literals > (size_t)(end - p) || literals > raw_size - at) return false;
+            std::memcpy(dst + at, p, literals);
+            p += literals;
+            at += literals;
+            if (p == end) break;
+        }
+        if (end - p < 2) return false;
+        size_t offset = p[0] | ((size_t)p[1] << 8);
+        p += 2;
+        match = lz_length(p, end, match - LZ_MIN_MATCH);
+        if (match == SIZE_MAX) return false;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > at || match > raw_size - at) return false;
+        char* to = dst + at;
+        const char* from = to - offset;
+        at += match;
+        if (offset >= 8) {
+            for (size_t k = 0; k < match; k += 8) std::memcpy(to + k, from + k, 8);
+        } else {
+            // The match overlaps the bytes it produces.
+            for (size_t k = 0; k < match; ++k) to[k] = from[k];
+        }
+    }
+    out.resize(at);
+    return at >= stop;
+}
+
+class ForwardStore {
+    MappedFile file;
+    const ForwardStoreHeader* header;
+    const uint64_t* offsets;
+    const uint64_t* first_docs;
+
+public:
+    ForwardStore() : header(nullptr), offsets(nullptr), first_docs(nullptr) {}
+    ForwardStore(const ForwardStore&) = delete;
+    ForwardStore& operator=(const ForwardStore&) = delete;
+
+    bool open(const std::string& filename, std::string& error) {
+        header = nullptr;
+        if (!file.open(filename)) {
+            error = "cannot open " + filename;
+            return false;
+        }
+        const ForwardStoreHeader* h = (const ForwardStoreHeader*)file.data();
+        if (file.size() < sizeof(ForwardStoreHeader) || h->magic != FORWARD_STORE_MAGIC) {
+            error = filename + " is not a forward store";
+            return false;
+        }
+        if (h->version != FORWARD_STORE_VERSION) {
+            error = "unsupported forward store version " + std::to_string(h->version);
+            return false;
+        }
+        if (h->offsets_offset + (h->num_blocks + 1) * 8 > file.size() ||
+            h->first_docs_offset + (h->num_blocks + 1) * 8 > file.size()) {
+            error = "corrupt forward store " + filename;
+            return false;
+        }
+        offsets = (const uint64_t*)(file.data() + h->offsets_offset);
+        first_docs = (const uint64_t*)(file.data() + h->first_docs_offset);
+        if (first_docs[0] != 0 || first_docs[h->num_blocks] != h->num_docs) {
+            error = "corrupt forward store " + filename;
+            return false;
+        }
+        for (uint64_t b = 0; b < h->num_blocks; ++b) {
+            if (first_docs[b] >= first_docs[b + 1] || offsets[b + 1] > h->offsets_offset ||
+                offsets[b] + (first_docs[b + 1] - first_docs[b]) * 4 > offsets[b + 1]) {
+                error = "corrupt forward store " + filename;
+                return false;
+            }
+        }
+        header = h;
+        file.advise_random();
+        return true;
+    }
+
+    uint64_t size() const { return header ? header->num_docs : 0; }
+
+    // Block holding `doc`, which must be in the store.
+    uint64_t block_of(int doc) const {
+        uint64_t lo = 0, hi = header->num_blocks;
+        while (hi - lo > 1) {
+            uint64_t mid = (lo + hi) / 2;
+            if (first_docs[mid] <= (uint64_t)doc) lo = mid;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    // Decompresses the texts of block `b` into `out`, or just enough of
+    // them to hold the first `max_bytes` of the text of `doc`. Returns the
+    // range of the text of `doc` in `out`, if it is in the block; false if
+    // the block is malformed.
+    bool read_block(uint64_t b, std::string& out, int doc, size_t& begin, size_t& end,
+                    size_t max_bytes = SIZE_MAX) const {
+        if (!header || b >= header->num_blocks) return false;
+        const char* p = file.data() + offsets[b];
+        uint64_t count = first_docs[b + 1] - first_docs[b];
+        size_t raw_size = 0, limit = SIZE_MAX;
+        begin = end = 0;
+        for (uint64_t d = 0; d < count; ++d) {
+            uint32_t length;
+            std::memcpy(&length, p + d * 4, 4);
+            if (first_docs[b] + d == (uint64_t)doc) {
+                begin = raw_size;
+                end = raw_size + (length < max_bytes ? length : max_bytes);
+                limit = end;
+            }
+            raw_size += length;
+        }
+        if (!lz_decompress(p + count * 4, offsets[b + 1] - offsets[b] - count * 4, raw_size, out, limit)) return false;
+        return end <= out.size();
+    }
+
+    // Text of `doc`, or its first `max_bytes`, decompressed into `buffer`;
+    // empty for ids outside the store.
+    std::string_view text(int doc, std::string& buffer, size_t max_bytes = SIZE_MAX) const {
+        if (doc < 0 || (uint64_t)doc >= size()) return std::string_view();
+        size_t begin, end;
+        if (!read_block(block_of(doc), buffer, doc, begin, end, max_bytes)) return std::string_view();
+        return std::string_view(buffer.data() + begin, end - begin);
+    }
+};
+
+// Documents are added in doc id order; only the current block is held in
+// memory. The store is written aside and renamed into place by finish().
+class ForwardStoreWriter {
+    std::string path;
+    std::ofstream out;
+    uint64_t num_docs;
+    uint64_t written;
+    Vector<uint64_t> offsets;
+    Vector<uint64_t> first_docs;
+    Vector<uint32_t> lengths;
+    std::string texts;
+    std::string compressed;
+
+    void flush_block() {
+        if (lengths.empty()) return;
+        compressed.clear();
+        lz_compress(texts.data(), texts.size(), compressed);
+        offsets.push_back(written);
+        first_docs.push_back(num_docs - lengths.size());
+        out.write((const char*)lengths.begin(), (std::streamsize)(lengths.size() * 4));
+        out.write(compressed.data(), (std::streamsize)compressed.size());
+        written += lengths.size() * 4 + compressed.size();
+        lengths.clear();
+        texts.clear();
+    }
+
+public:
+    ForwardStoreWriter() : num_docs(0), written(0) {}
+    ForwardStoreWriter(const ForwardStoreWriter&) = delete;
+    ForwardStoreWriter& operator=(const ForwardStoreWriter&) = delete;
+    // An unfinished store leaves nothing behind.
+    ~ForwardStoreWriter() {
+        if (!out.is_open()) return;
+        out.close();
+        std::remove((path + ".tmp").c_str());
+    }
+
+    bool open(const std::string& filename) {
+        path = filename;
+        num_docs = 0;
+        offsets.clear();
+        first_docs.clear();
+        lengths.clear();
+        texts.clear();
+        out.open(path + ".tmp", std::ios::binary | std::ios::trunc);
+        ForwardStoreHeader header;
+        std::memset(&header, 0, sizeof(header));
+        out.write((const char*)&header, sizeof(header));
+        written = sizeof(header);
+        return (bool)out;
+    }
+
+    void add(std::string_view text) {
+        lengths.push_back((uint32_t)text.size());
+        texts.append(text.data(), text.size());
+        num_docs++;
+        if (texts.size() >= FORWARD_BLOCK_BYTES) flush_block();
+    }
+
+    uint64_t size() const { return num_docs; }
+
+    bool finish() {
+        flush_block();
+        offsets.push_back(written);
+        first_docs.push_back(num_docs);
+        ForwardStoreHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = FORWARD_STORE_MAGIC;
+        header.version = FORWARD_STORE_VERSION;
+        header.num_docs = num_docs;
+        header.num_blocks = offsets.size() - 1;
+        header.offsets_offset = written;
+        header.first_docs_offset = written + offsets.size() * 8;
+        out.write((const char*)offsets.begin(), (std::streamsize)(offsets.size() * 8));
+        out.write((const char*)first_docs.begin(), (std::streamsize)(first_docs.size() * 8));
+        out.seekp(0);
+        out.write((const char*)&header, sizeof(header));
+        out.close();
+        std::string tmp = path + ".tmp";
+        if (out.fail() || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
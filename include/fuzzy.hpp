@@ -0,0 +1,135 @@
+#ifndef FUZZY_HPP
+#define FUZZY_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "custom_stl.hpp"
+#include "tokenizer.hpp"
+#include "index_format.hpp"
+
+// Typo-tolerant term lookup. A Levenshtein automaton for a word runs over
+// the sorted dictionary as if it were a trie: its state after reading a
+// prefix is the row of edit distances between the prefix and every prefix
+// of the word, so terms that share a prefix share its states. When a
+// character kills the state, the walk seeks straight to the next sibling
+// character that keeps it alive, or past the parent prefix if there is
+// none, so whole runs of dead subtrees cost one forward seek. Distances
+// count inserted, deleted and substituted characters, not bytes.
+
+const int MAX_FUZZY_DISTANCE = 2;
+
+class LevenshteinAutomaton {
+    std::u32string word;
+    uint8_t limit;
+
+public:
+    LevenshteinAutomaton(std::string_view text, int distance) : limit((uint8_t)(distance + 1)) {
+        for (size_t i = 0; i < text.size();) word.push_back(decode_utf8(text, i));
+    }
+
+    // Entries in a state row.
+    size_t width() const { return word.size() + 1; }
+
+    void start(uint8_t* row) const {
+        for (size_t j = 0; j < width(); ++j) row[j] = j < limit ? (uint8_t)j : limit;
+    }
+
+    // Fills `next` with the state after reading `c` in state `prev`.
+    // Distances are capped at the maximum plus one. False if no
+    // continuation can match any more.
+    bool step(const uint8_t* prev, uint32_t c, uint8_t* next) const {
+        uint8_t low = next[0] = prev[0] < limit ? prev[0] + 1 : limit;
+        for (size_t j = 1; j < width(); ++j) {
+            uint8_t v = prev[j - 1] + (word[j - 1] != c);
+            if (prev[j] + 1 < v) v = prev[j] + 1;
+            if (next[j - 1] + 1 < v) v = next[j - 1] + 1;
+            next[j] = v < limit ? v : limit;
+            if (next[j] < low) low = next[j];
+        }
+        return low < limit;
+    }
+
+    // Distance of the whole word from what was read; above the maximum if
+    // it does not match.
+    int distance(const uint8_t* row) const { return row[word.size()]; }
+
+    // Smallest character above `c` that `row` survives; false if none. Only
+    // a row at the maximum everywhere can die, and only by a character
+    // that no word position at the maximum matches.
+    bool next_live(const uint8_t* row, uint32_t c, uint32_t& next) const {
+        next = UINT32_MAX;
+        for (size_t j = 0; j < word.size(); ++j) {
+            if (row[j] + 1 == limit && word[j] > c && word[j] < next) next = word[j];
+        }
+        return next != UINT32_MAX;
+    }
+};
+
+struct FuzzyMatch {
+    std::string term;
+    int distance;
+    uint64_t df;
+};
+
+// Terms of `index` within `distance` edits of `word`, in dictionary order.
+inline void fuzzy_terms(const IndexReader& index, std::string_view word, int distance, Vector<FuzzyMatch>& out) {
+    LevenshteinAutomaton automaton(word, distance);
+    size_t width = automaton.width();
+    // rows[d * width...] is the state after the first d characters of
+    // `path`, the last term read; ends[d] is where character d ends in it.
+    std::vector<uint8_t> rows(width);
+    std::vector<size_t> ends;
+    automaton.start(rows.data());
+    std::string path, key;
+    size_t depth = 0;
+    TermCursor c = index.terms();
+    while (!c.at_end()) {
+        std::string_view term = c.term();
+        size_t common = 0;
+        while (common < term.size() && common < path.size() && term[common] == path[common]) common++;
+        size_t keep = 0;
+        while (keep < depth && ends[keep] <= common) keep++;
+        depth = keep;
+        ends.resize(depth);
+        bool dead = false;
+        uint32_t ch = 0;
+        for (size_t pos = depth ? ends[depth - 1] : 0; pos < term.size() && !dead;) {
+            ch = decode_utf8(term, pos);
+            if (rows.size() < (depth + 2) * width) rows.resize((depth + 2) * width);
+            dead = !automaton.step(&rows[depth * width], ch, &rows[(depth + 1) * width]);
+            ends.push_back(pos);
+            depth++;
+        }
+        path.assign(term.data(), term.size());
+        if (!dead) {
+            int d = automaton.distance(&rows[depth * width]);
+            if (d <= distance) {
+                FuzzyMatch match;
+                match.term = path;
+                match.distance = d;
+                match.df = index.df(c.index());
+                out.push_back(match);
+            }
+            c.next();
+            continue;
+        }
+
+        // Character `ch` after the parent prefix kills the state: go on at
+        // the next live sibling, or else after everything under the parent.
+        depth--;
+        key.assign(path, 0, depth ? ends[depth - 1] : 0);
+        uint32_t next;
+        if (automaton.next_live(&rows[depth * width], ch, next)) {
+            append_utf8(key, next);
+        } else {
+            while (!key.empty() && (unsigned char)key.back() == 0xff) key.pop_back();
+            if (key.empty()) return;
+            key.back() = (char)((unsigned char)key.back() + 1);
+        }
+        c.seek(key);
+    }
+}
+
+#endif
@@ -0,0 +1,675 @@
+#ifndef INDEX_FORMAT_HPP
+#define INDEX_FORMAT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <cstdio>
+#include <fstream>
+#include "custom_stl.hpp"
+#include "mapped_file.hpp"
+#include "postings.hpp"
+
+// On-disk layout (little-endian, all offsets are absolute file offsets):
+//
+//   IndexHeader
+//   postings   compressed postings lists (see postings.hpp) in dictionary order
+//   positions  positions streams in dictionary order; empty if not indexed
+//   terms      front-coded term blocks in dictionary order
+//   blocks     u64[num_blocks], offset of every term block within terms
+//   dict       TermEntry[num_terms], sorted by term
+//   lengths    u32[num_docs], document lengths in tokens
+//
+// Terms are sorted by bytes and stored in blocks of TERM_BLOCK. Each one is
+// a varint count of bytes shared with the previous term of its block, a
+// varint count of the bytes that follow and those bytes; the first term of
+// a block shares nothing, so a lookup binary-searches the block heads in
+// place and decodes a single block.
+//
+// The header carries FNV-1a checksums of every section and of itself.
+
+const uint32_t INDEX_MAGIC = 0x58444e49; // "INDX"
+const uint32_t INDEX_VERSION = 5;
+const size_t TERM_BLOCK = 16;
+
+struct IndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_terms;
+    uint64_t num_docs;
+    uint64_t num_postings;
+    uint64_t total_length;
+    uint64_t postings_offset;
+    uint64_t postings_size;
+    uint64_t positions_offset;
+    uint64_t positions_size;
+    uint64_t terms_offset;
+    uint64_t terms_size;
+    uint64_t blocks_offset;
+    uint64_t blocks_size;
+    uint64_t dict_offset;
+    uint64_t dict_size;
+    uint64_t lengths_offset;
+    uint64_t lengths_size;
+    uint64_t postings_checksum;
+    uint64_t positions_checksum;
+    uint64_t terms_checksum;
+    uint64_t blocks_checksum;
+    uint64_t dict_checksum;
+    uint64_t lengths_checksum;
+    uint64_t header_checksum;
+};
+
+struct TermEntry {
+    uint64_t postings_offset;
+    uint64_t positions_offset;
+    uint32_t df;
+    uint32_t max_tf;
+    uint32_t min_dl;
+    uint32_t reserved;
+};
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+inline uint64_t fnv1a(const void* data, size_t n, uint64_t h = FNV_OFFSET) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+inline uint64_t header_checksum(const IndexHeader& header) {
+    IndexHeader copy = header;
+    copy.header_checksum = 0;
+    return fnv1a(&copy, sizeof(copy));
+}
+
+// Writes an index in a single pass. Terms must be added in strictly
+// increasing byte order. Postings go straight to the output file and the
+// dictionary is spooled to temporary files next to it, so memory use does
+// not grow with the size of the index. Document lengths must be known up
+// front: they bound every block's scores. The index is written to a
+// temporary file that finish() renames over `filename`, so readers that
+// have the old file mapped keep seeing it whole.
+class IndexWriter {
+    std::string path;
+    const uint32_t* doc_lengths;
+    size_t num_docs;
+    std::fstream out;
+    std::ofstream terms_out;
+    std::ofstream blocks_out;
+    std::ofstream dict_out;
+    std::ofstream positions_out;
+    bool with_positions;
+    uint64_t positions_size;
+    uint64_t offset;
+    uint64_t num_postings;
+    uint64_t num_terms;
+    uint64_t terms_size;
+    std::string last_term;
+    // Kept apart from `buffer`, which may hold the postings being added.
+    std::string term_bytes;
+    std::string buffer;
+
+    // State of the term being streamed with begin_term()/add_posting().
+    std::string term_name;
+    uint64_t term_start;
+    uint64_t term_positions;
+    uint32_t block_positions;
+    uint32_t term_df;
+    uint32_t term_max_tf;
+    uint32_t term_min_dl;
+    uint32_t term_blocks;
+    uint32_t term_written;
+    int term_prev;
+    Vector<Pair<int, int>> block;
+    Vector<uint32_t> pending_skips;
+    uint32_t flushed_skips;
+
+    void write(const void* data, size_t n) {
+        out.write((const char*)data, n);
+        offset += n;
+    }
+
+    void add_entry(std::string_view term, uint64_t postings_offset, uint64_t positions_offset, uint32_t df,
+                   uint32_t max_tf, uint32_t min_dl) {
+        TermEntry entry;
+        entry.postings_offset = postings_offset;
+        entry.positions_offset = positions_offset;
+        entry.df = df;
+        entry.max_tf = max_tf;
+        entry.min_dl = min_dl;
+        entry.reserved = 0;
+        dict_out.write((const char*)&entry, sizeof(entry));
+
+        size_t shared = 0;
+        if (num_terms % TERM_BLOCK == 0) {
+            blocks_out.write((const char*)&terms_size, sizeof(terms_size));
+        } else {
+            while (shared < term.size() && shared < last_term.size() && term[shared] == last_term[shared]) shared++;
+        }
+        term_bytes.clear();
+        append_varint(term_bytes, (uint32_t)shared);
+        append_varint(term_bytes, (uint32_t)(term.size() - shared));
+        term_bytes.append(term.data() + shared, term.size() - shared);
+        terms_out.write(term_bytes.data(), term_bytes.size());
+        terms_size += term_bytes.size();
+        last_term.assign(term.data(), term.size());
+        num_terms++;
+        num_postings += df;
+    }
+
+    void flush_skips() {
+        if (pending_skips.empty()) return;
+        out.seekp(term_start + (uint64_t)flushed_skips * SKIP_ENTRY);
+        out.write((const char*)pending_skips.begin(), pending_skips.size() * sizeof(uint32_t));
+        out.seekp(offset);
+        flushed_skips += pending_skips.size() / (SKIP_ENTRY / 4);
+        pending_skips.clear();
+    }
+
+    void flush_block() {
+        uint32_t block_offset = (uint32_t)(offset - term_start);
+        uint32_t max_tf = 0, min_dl = UINT32_MAX;
+        posting_bounds(block.begin(), block.size(), doc_lengths, max_tf, min_dl);
+        if (max_tf > term_max_tf) term_max_tf = max_tf;
+        if (min_dl < term_min_dl) term_min_dl = min_dl;
+        buffer.clear();
+        encode_block(block.begin(), block.size(), term_prev, buffer);
+        write(buffer.data(), buffer.size());
+        term_written += block.size();
+        block.clear();
+        if (term_blocks > 1) {
+            pending_skips.push_back((uint32_t)term_prev);
+            pending_skips.push_back(block_offset);
+            pending_skips.push_back(max_tf);
+            pending_skips.push_back(min_dl);
+            pending_skips.push_back(block_positions);
+            if (pending_skips.size() >= 5 * 2048) flush_skips();
+        }
+    }
+
+    void write_positions(const char* data, size_t n) {
+        positions_out.write(data, n);
+        positions_size += n;
+    }
+
+    // Appends a spooled temp file to the output and removes it. With
+    // `dict` set the file holds TermEntry records whose positions offsets
+    // are rebased onto the positions section.
+    uint64_t append_file(const std::string& filename, bool dict = false, uint64_t positions_base = 0) {
+        uint64_t hash = FNV_OFFSET;
+        std::ifstream in(filename, std::ios::binary);
+        char chunk[sizeof(TermEntry) * 2048];
+        while (in) {
+            in.read(chunk, sizeof(chunk));
+            size_t n = (size_t)in.gcount();
+            if (n == 0) break;
+            if (dict) {
+                TermEntry* entries = (TermEntry*)chunk;
+                for (size_t i = 0; i < n / sizeof(TermEntry); ++i) entries[i].positions_offset += positions_base;
+            }
+            hash = fnv1a(chunk, n, hash);
+            write(chunk, n);
+        }
+        in.close();
+        std::remove(filename.c_str());
+        return hash;
+    }
+
+public:
+    IndexWriter() : doc_lengths(nullptr), num_docs(0), with_positions(false), positions_size(0), offset(0),
+                    num_postings(0), num_terms(0), terms_size(0), term_start(0), term_positions(0), block_positions(0),
+                    term_df(0), term_max_tf(0), term_min_dl(0), term_blocks(0), term_written(0), term_prev(-1),
+                    flushed_skips(0) {}
+    IndexWriter(const IndexWriter&) = delete;
+    IndexWriter& operator=(const IndexWriter&) = delete;
+    // An unfinished index leaves nothing behind.
+    ~IndexWriter() {
+        if (!out.is_open()) return;
+        out.close();
+        terms_out.close();
+        blocks_out.close();
+        dict_out.close();
+        positions_out.close();
+        std::remove((path + ".tmp").c_str());
+        std::remove((path + ".terms.tmp").c_str());
+        std::remove((path + ".blocks.tmp").c_str());
+        std::remove((path + ".dict.tmp").c_str());
+        std::remove((path + ".positions.tmp").c_str());
+    }
+
+    // `lengths` holds the length of every document and must outlive the
+    // writer. With `positions` every term must come with its positions.
+    bool open(const std::string& filename, const Vector<uint32_t>& lengths, bool positions) {
+        return open(filename, lengths.begin(), lengths.size(), positions);
+    }
+
+    // As above, for lengths that live elsewhere, e.g. in a mapped file.
+    bool open(const std::string& filename, const uint32_t* lengths, size_t n, bool positions) {
+        path = filename;
+        doc_lengths = lengths;
+        num_docs = n;
+        with_positions = positions;
+        out.open(filename + ".tmp", std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        terms_out.open(filename + ".terms.tmp", std::ios::binary | std::ios::trunc);
+        blocks_out.open(filename + ".blocks.tmp", std::ios::binary | std::ios::trunc);
+        dict_out.open(filename + ".dict.tmp", std::ios::binary | std::ios::trunc);
+        positions_out.open(filename + ".positions.tmp", std::ios::binary | std::ios::trunc);
+        if (!out.is_open() || !terms_out.is_open() || !blocks_out.is_open() || !dict_out.is_open() ||
+            !positions_out.is_open()) {
+            return false;
+        }
+        IndexHeader header;
+        std::memset(&header, 0, sizeof(header));
+        write(&header, sizeof(header));
+        return true;
+    }
+
+    // `positions` is the term's positions stream (see postings.hpp).
+    void add_term(std::string_view term, const Pair<int, int>* postings, size_t n,
+                  const char* positions = nullptr, size_t positions_bytes = 0) {
+        buffer.clear();
+        encode_postings(postings, n, doc_lengths, with_positions ? positions : nullptr, buffer);
+        add_encoded(term, (uint32_t)n, buffer.data(), buffer.size(), positions, positions_bytes);
+    }
+
+    // Adds a postings list that was already produced by encode_postings().
+    // The list-wide bounds are folded from the skip table, or from the
+    // postings themselves when the list is a single block.
+    void add_encoded(std::string_view term, uint32_t df, const char* data, size_t n,
+                     const char* positions = nullptr, size_t positions_bytes = 0) {
+        uint32_t max_tf = 0, min_dl = UINT32_MAX;
+        uint32_t blocks = (df + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (blocks > 1) {
+            for (uint32_t b = 0; b < blocks; ++b) {
+                uint32_t tf = load_u32(data + b * SKIP_ENTRY + 8), dl = load_u32(data + b * SKIP_ENTRY + 12);
+                if (tf > max_tf) max_tf = tf;
+                if (dl < min_dl) min_dl = dl;
+            }
+        } else {
+            for (PostingCursor c(data, df); !c.at_end(); c.next()) {
+                if ((uint32_t)c.tf() > max_tf) max_tf = (uint32_t)c.tf();
+                if (doc_lengths[c.doc()] < min_dl) min_dl = doc_lengths[c.doc()];
+            }
+        }
+        add_entry(term, offset, positions_size, df, max_tf, min_dl);
+        write(data, n);
+        if (with_positions) write_positions(positions, positions_bytes);
+    }
+
+    // Streams a postings list of known length one posting at a time; the
+    // result is identical to add_term() with the same postings.
+    void begin_term(std::string_view term, uint32_t df) {
+        term_name.assign(term.data(), term.size());
+        term_start = offset;
+        term_positions = positions_size;
+        term_df = df;
+        term_max_tf = 0;
+        term_min_dl = UINT32_MAX;
+        term_blocks = (df + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        term_written = 0;
+        term_prev = -1;
+        flushed_skips = 0;
+        if (term_blocks > 1) {
+            static const char zeros[64] = {0};
+            for (uint64_t left = (uint64_t)term_blocks * SKIP_ENTRY; left > 0;) {
+                size_t n = left < sizeof(zeros) ? (size_t)left : sizeof(zeros);
+                write(zeros, n);
+                left -= n;
+            }
+        }
+    }
+
+    void add_posting(int doc_id, int tf, const char* positions = nullptr, size_t positions_bytes = 0) {
+        if (block.empty()) block_positions = (uint32_t)(positions_size - term_positions);
+        if (with_positions) write_positions(positions, positions_bytes);
+        block.push_back(Pair<int, int>(doc_id, tf));
+        if (block.size() == BLOCK_SIZE) flush_block();
+    }
+
+    void end_term() {
+        if (!block.empty()) flush_block();
+        flush_skips();
+        add_entry(term_name, term_start, term_positions, term_df, term_max_tf, term_min_dl);
+    }
+
+    bool finish() {
+        IndexHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = INDEX_MAGIC;
+        header.version = INDEX_VERSION;
+        header.num_terms = num_terms;
+        header.num_docs = num_docs;
+        header.num_postings = num_postings;
+        for (size_t i = 0; i < num_docs; ++i) header.total_length += doc_lengths[i];
+        header.postings_offset = sizeof(IndexHeader);
+        header.postings_size = offset - sizeof(IndexHeader);
+
+        out.flush();
+        out.seekg(header.postings_offset);
+        header.postings_checksum = FNV_OFFSET;
+        char chunk[1 << 16];
+        for (uint64_t left = header.postings_size; left > 0;) {
+            size_t n = left < sizeof(chunk) ? (size_t)left : sizeof(chunk);
+            out.read(chunk, n);
+            header.postings_checksum = fnv1a(chunk, n, header.postings_checksum);
+            left -= n;
+        }
+        out.seekp(offset);
+
+        terms_out.close();
+        blocks_out.close();
+        dict_out.close();
+        positions_out.close();
+        header.positions_offset = offset;
+        header.positions_size = positions_size;
+        header.positions_checksum = append_file(path + ".positions.tmp");
+
+        header.terms_offset = offset;
+        header.terms_size = terms_size;
+        header.terms_checksum = append_file(path + ".terms.tmp");
+        static const char zeros[8] = {0};
+        if (offset % 8) write(zeros, 8 - offset % 8);
+
+        header.blocks_offset = offset;
+        header.blocks_size = (num_terms + TERM_BLOCK - 1) / TERM_BLOCK * sizeof(uint64_t);
+        header.blocks_checksum = append_file(path + ".blocks.tmp");
+
+        header.dict_offset = offset;
+        header.dict_size = num_terms * sizeof(TermEntry);
+        header.dict_checksum = append_file(path + ".dict.tmp", true, header.positions_offset);
+
+        header.lengths_offset = offset;
+        header.lengths_size = num_docs * sizeof(uint32_t);
+        header.lengths_checksum = fnv1a(doc_lengths, header.lengths_size);
+        write(doc_lengths, header.lengths_size);
+
+        header.header_checksum = header_checksum(header);
+        out.seekp(0);
+        out.write((const char*)&header, sizeof(header));
+        out.close();
+        std::string tmp = path + ".tmp";
+        if (out.fail() || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// Walks the dictionary in order, undoing the front coding one term at a
+// time. Obtained from IndexReader::terms().
+class TermCursor {
+    const char* terms;
+    const uint64_t* blocks;
+    size_t count;
+    size_t i;
+    const char* p;
+    std::string current;
+
+    void decode() {
+        if (i % TERM_BLOCK == 0) p = terms + blocks[i / TERM_BLOCK];
+        uint32_t shared = read_varint(p);
+        uint32_t n = read_varint(p);
+        current.resize(shared);
+        current.append(p, n);
+        p += n;
+    }
+
+    // First term of block `b`, stored whole.
+    std::string_view head(size_t b) const {
+        const char* q = terms + blocks[b];
+        read_varint(q);
+        uint32_t n = read_varint(q);
+        return std::string_view(q, n);
+    }
+
+public:
+    TermCursor() : terms(nullptr), blocks(nullptr), count(0), i(0), p(nullptr) {}
+    // Positioned on term `from` of `count`.
+    TermCursor(const char* terms, const uint64_t* blocks, size_t count, size_t from)
+        : terms(terms), blocks(blocks), count(count), i(from), p(nullptr) {
+        if (from >= count) return;
+        for (i = from - from % TERM_BLOCK; i <= from; ++i) decode();
+        i = from;
+    }
+
+    bool at_end() const { return i >= count; }
+    // Dictionary index of the current term.
+    size_t index() const { return i; }
+    // Valid until the cursor moves.
+    std::string_view term() const { return current; }
+
+    void next() {
+        if (i < count && ++i < count) decode();
+    }
+
+    // Moves forward to the first term >= key, galloping over the block
+    // heads from the current block; never moves back.
+    void seek(std::string_view key) {
+        if (at_end() || current >= key) return;
+        size_t num_blocks = (count + TERM_BLOCK - 1) / TERM_BLOCK;
+        size_t lo = i / TERM_BLOCK, hi = lo + 1;
+        for (size_t step = 1; hi < num_blocks && head(hi) <= key; step *= 2) {
+            lo = hi;
+            hi += step;
+        }
+        if (hi > num_blocks) hi = num_blocks;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (head(mid) <= key) lo = mid;
+            else hi = mid;
+        }
+        if (lo > i / TERM_BLOCK) {
+            i = lo * TERM_BLOCK;
+            decode();
+        }
+        // Scans the rest of the block like IndexReader::search(): `match`
+        // is how many bytes the last term passed, which sorts before key,
+        // shares with key. The term stopped at shares no more than that with
+        // the one before, so it is the start of key and its own suffix, and
+        // the terms in between are never rebuilt.
+        size_t match = 0;
+        while (match < current.size() && match < key.size() && current[match] == key[match]) match++;
+        if (match == key.size() || (match < current.size() && (unsigned char)current[match] > (unsigned char)key[match])) {
+            return;
+        }
+        while (++i < count) {
+            if (i % TERM_BLOCK == 0) p = terms + blocks[i / TERM_BLOCK];
+            size_t shared = read_varint(p);
+            size_t n = read_varint(p);
+            const char* suffix = p;
+            p += n;
+            if (shared > match) continue;
+            if (shared == match) {
+                size_t j = 0;
+                while (j < n && match < key.size() && suffix[j] == key[match]) {
+                    j++;
+                    match++;
+                }
+                if (j == n ? match < key.size()
+                           : match < key.size() && (unsigned char)suffix[j] < (unsigned char)key[match]) {
+                    continue;
+                }
+            }
+            current.assign(key.data(), shared);
+            current.append(suffix, n);
+            return;
+        }
+    }
+};
+
+class IndexReader {
+    MappedFile file;
+    const IndexHeader* header;
+    const char* terms_data;
+    const uint64_t* blocks;
+    const TermEntry* dict;
+    const uint32_t* lengths;
+    uint64_t loaded;
+
+    // First term of block `b`, stored whole.
+    std::string_view block_head(size_t b) const {
+        const char* p = terms_data + blocks[b];
+        read_varint(p);
+        uint32_t n = read_varint(p);
+        return std::string_view(p, n);
+    }
+
+    // Index of the first term >= key; `found` tells whether it equals key.
+    size_t search(std::string_view key, bool& found) const {
+        found = false;
+        size_t lo = 0, hi = (size() + TERM_BLOCK - 1) / TERM_BLOCK;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (block_head(mid) <= key) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == 0) return 0;
+        // Scans the block without rebuilding its terms: `match` is how many
+        // bytes the last term, which sorts before key, shares with key.
+        size_t i = (lo - 1) * TERM_BLOCK;
+        size_t end = i + TERM_BLOCK < size() ? i + TERM_BLOCK : size();
+        const char* p = terms_data + blocks[lo - 1];
+        size_t match = 0;
+        for (; i < end; ++i) {
+            size_t shared = read_varint(p);
+            size_t n = read_varint(p);
+            const char* suffix = p;
+            p += n;
+            if (shared > match) continue;
+            if (shared < match) return i;
+            size_t j = 0;
+            while (j < n && match < key.size() && suffix[j] == key[match]) {
+                j++;
+                match++;
+            }
+            if (j == n) {
+                if (match < key.size()) continue;
+                found = true;
+                return i;
+            }
+            if (match == key.size() || (unsigned char)suffix[j] > (unsigned char)key[match]) return i;
+        }
+        return end;
+    }
+
+    static uint64_t next_generation() {
+        static std::atomic<uint64_t> counter(0);
+        return ++counter;
+    }
+
+    bool fail(std::string& error, const std::string& message) {
+        error = message;
+        file.close();
+        header = nullptr;
+        terms_data = nullptr;
+        blocks = nullptr;
+        dict = nullptr;
+        lengths = nullptr;
+        loaded = 0;
+        return false;
+    }
+
+public:
+    IndexReader() : header(nullptr), terms_data(nullptr), blocks(nullptr), dict(nullptr), lengths(nullptr), loaded(0) {}
+
+    bool open(const std::string& filename, bool verify, std::string& error) {
+        if (!file.open(filename)) return fail(error, "cannot open " + filename);
+        if (file.size() < sizeof(IndexHeader)) return fail(error, "truncated header in " + filename);
+
+        header = (const IndexHeader*)file.data();
+        if (header->magic != INDEX_MAGIC) return fail(error, filename + " is not an index file");
+        if (header->version != INDEX_VERSION) {
+            return fail(error, "unsupported index version " + std::to_string(header->version));
+        }
+        if (header->header_checksum != header_checksum(*header)) return fail(error, "corrupt index header");
+        if (header->dict_offset + header->dict_size > file.size() ||
+            header->terms_offset + header->terms_size > file.size() ||
+            header->blocks_offset + header->blocks_size > file.size() ||
+            header->postings_offset + header->postings_size > file.size() ||
+            header->positions_offset + header->positions_size > file.size() ||
+            header->lengths_offset + header->lengths_size > file.size() ||
+            header->lengths_size != header->num_docs * sizeof(uint32_t) ||
+            header->blocks_size != (header->num_terms + TERM_BLOCK - 1) / TERM_BLOCK * sizeof(uint64_t)) {
+            return fail(error, "truncated index file");
+        }
+
+        const char* base = file.data();
+        if (verify) {
+            if (fnv1a(base + header->postings_offset, header->postings_size) != header->postings_checksum ||
+                fnv1a(base + header->positions_offset, header->positions_size) != header->positions_checksum ||
+                fnv1a(base + header->terms_offset, header->terms_size) != header->terms_checksum ||
+                fnv1a(base + header->blocks_offset, header->blocks_size) != header->blocks_checksum ||
+                fnv1a(base + header->dict_offset, header->dict_size) != header->dict_checksum ||
+                fnv1a(base + header->lengths_offset, header->lengths_size) != header->lengths_checksum) {
+                return fail(error, "index checksum mismatch");
+            }
+        }
+        terms_data = base + header->terms_offset;
+        blocks = (const uint64_t*)(base + header->blocks_offset);
+        for (size_t b = 0; b < header->blocks_size / sizeof(uint64_t); ++b) {
+            if (blocks[b] >= header->terms_size) return fail(error, "corrupt term blocks");
+        }
+        dict = (const TermEntry*)(base + header->dict_offset);
+        lengths = (const uint32_t*)(base + header->lengths_offset);
+        file.advise_random();
+        loaded = next_generation();
+        return true;
+    }
+
+    size_t size() const { return header ? header->num_terms : 0; }
+    uint64_t num_docs() const { return header ? header->num_docs : 0; }
+    uint64_t total_length() const { return header ? header->total_length : 0; }
+    bool has_positions() const { return header && header->positions_size > 0; }
+    // Distinct for every successful open() in this process, so anything
+    // derived from one loaded index can tell when it has been replaced.
+    uint64_t generation() const { return loaded; }
+    uint32_t doc_length(int doc_id) const { return lengths[doc_id]; }
+
+    double avg_doc_length() const {
+        return header && header->num_docs ? (double)header->total_length / header->num_docs : 0.0;
+    }
+
+    // Cursor over the terms in dictionary order, starting at term `from`.
+    TermCursor terms(size_t from = 0) const { return TermCursor(terms_data, blocks, size(), from); }
+
+    std::string term(size_t i) const { return std::string(terms(i).term()); }
+
+    uint32_t df(size_t i) const { return dict[i].df; }
+
+    PostingCursor cursor(size_t i) const {
+        const char* positions = has_positions() ? file.data() + dict[i].positions_offset : nullptr;
+        return PostingCursor(file.data() + dict[i].postings_offset, dict[i].df, dict[i].max_tf, dict[i].min_dl,
+                             positions);
+    }
+
+    // Index of the first term >= key in dictionary order. The terms
+    // starting with a prefix run from lower_bound(prefix) onwards.
+    size_t lower_bound(std::string_view key) const {
+        bool found;
+        return search(key, found);
+    }
+
+    static const size_t npos = (size_t)-1;
+
+    size_t find(std::string_view key) const {
+        bool found;
+        size_t i = search(key, found);
+        return found ? i : npos;
+    }
+
+    // Cursor over the postings of `key`; already at_end() if the term is absent.
+    PostingCursor postings(std::string_view key) const {
+        size_t i = find(key);
+        return i == npos ? PostingCursor() : cursor(i);
+    }
+};
+
+#endif
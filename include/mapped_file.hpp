@@ -0,0 +1,63 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+class MappedFile {
+    const char* ptr;
+    size_t len;
+
+public:
+    MappedFile() : ptr(nullptr), len(0) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        len = (size_t)st.st_size;
+        if (len == 0) {
+            ::close(fd);
+            return true;
+        }
+        void* p = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            len = 0;
+            return false;
+        }
+        ptr = (const char*)p;
+        return true;
+    }
+
+    void close() {
+        if (ptr) munmap((void*)ptr, len);
+        ptr = nullptr;
+        len = 0;
+    }
+
+    void advise_random() const {
+        if (ptr) madvise((void*)ptr, len, MADV_RANDOM);
+    }
+
+    void advise_sequential() const {
+        if (ptr) madvise((void*)ptr, len, MADV_SEQUENTIAL);
+    }
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+};
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "postings.hpp"
+
+// Query instrumentation. Stage timers and counters accumulate in thread
+// locals while a query runs and are folded into shared histograms once per
+// query, so the hot path never touches a shared cache line.
+
+enum Stage { STAGE_PARSE, STAGE_LOOKUP, STAGE_EVALUATE, STAGE_SORT, STAGE_SNIPPETS, STAGE_TOTAL, NUM_STAGES };
+
+inline const char* stage_name(int stage) {
+    static const char* names[] = {"parse", "lookup", "evaluate", "sort", "snippets", "total"};
+    return names[stage];
+}
+
+enum Counter {
+    COUNT_QUERIES,
+    COUNT_QUERY_ERRORS,
+    COUNT_CACHE_HITS,
+    COUNT_CACHE_MISSES,
+    COUNT_BLOCKS_DECODED,
+    COUNT_POSTINGS_DECODED,
+    COUNT_BYTES_DECODED,
+    COUNT_DOCS_SCORED,
+    NUM_COUNTERS
+};
+
+inline const char* counter_name(int counter) {
+    static const char* names[] = {"queries", "query_errors", "cache_hits", "cache_misses", "blocks_decoded",
+                                  "postings_decoded", "bytes_decoded", "docs_scored"};
+    return names[counter];
+}
+
+inline uint64_t now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear histogram in the spirit of HdrHistogram: every power of two
+// is split into 16 buckets, so a recorded value is known to within 1/16.
+// Values up to 2^40 (about 18 minutes in ns) are kept; larger ones go to
+// the last bucket.
+class Histogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB = 1 << SUB_BITS;
+    static const int MAX_EXP = 40;
+    static const int BUCKETS = SUB + (MAX_EXP - SUB_BITS + 1) * SUB;
+
+private:
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+
+public:
+    Histogram() : total(0), sum_(0), max_(0) {
+        for (int i = 0; i < BUCKETS; ++i) counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    static int bucket(uint64_t v) {
+        if (v < (uint64_t)SUB) return (int)v;
+        int e = 63 - __builtin_clzll(v);
+        if (e > MAX_EXP) return BUCKETS - 1;
+        return SUB + (e - SUB_BITS) * SUB + (int)((v >> (e - SUB_BITS)) & (SUB - 1));
+    }
+
+    // Largest value that falls into bucket `b`.
+    static uint64_t bucket_upper(int b) {
+        if (b < SUB) return (uint64_t)b;
+        int e = (b - SUB) / SUB + SUB_BITS;
+        uint64_t sub = (uint64_t)((b - SUB) % SUB);
+        return ((SUB + sub + 1) << (e - SUB_BITS)) - 1;
+    }
+
+    void record(uint64_t v) {
+        counts[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(v, std::memory_order_relaxed);
+        uint64_t seen = max_.load(std::memory_order_relaxed);
+        while (v > seen && !max_.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the value at quantile `q`.
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t)(q * n + 0.5);
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += counts[b].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t upper = bucket_upper(b);
+                return upper < max() ? upper : max();
+            }
+        }
+        return max();
+    }
+
+    // Number of values in buckets that end at or below `v`.
+    uint64_t count_at_most(uint64_t v) const {
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS && bucket_upper(b) <= v; ++b) seen += counts[b].load(std::memory_order_relaxed);
+        return seen;
+    }
+};
+
+// Per-thread state of the query being run. Nested timers charge their time
+// to their own stage only, so stage times add up to the query's time.
+struct QueryTrace {
+    uint64_t ns[NUM_STAGES];
+    int active;
+
+    QueryTrace() : active(NUM_STAGES) {
+        for (int i = 0; i < NUM_STAGES; ++i) ns[i] = 0;
+    }
+};
+
+inline QueryTrace& query_trace() {
+    thread_local QueryTrace trace;
+    return trace;
+}
+
+class StageTimer {
+    int stage;
+    int parent;
+    uint64_t start;
+    bool running;
+
+public:
+    StageTimer(Stage stage) : stage(stage), parent(query_trace().active), start(now_ns()), running(true) {
+        query_trace().active = stage;
+    }
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+    ~StageTimer() { stop(); }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+        uint64_t elapsed = now_ns() - start;
+        QueryTrace& trace = query_trace();
+        trace.ns[stage] += elapsed;
+        if (parent != NUM_STAGES) trace.ns[parent] -= elapsed;
+        trace.active = parent;
+    }
+};
+
+class QueryStats {
+    Histogram stages[NUM_STAGES];
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+
+public:
+    QueryStats() {
+        for (int i = 0; i < NUM_COUNTERS; ++i) counters[i].store(0, std::memory_order_relaxed);
+    }
+
+    void add(Counter counter, uint64_t n = 1) { counters[counter].fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get(Counter counter) const { return counters[counter].load(std::memory_order_relaxed); }
+    const Histogram& stage(int s) const { return stages[s]; }
+
+    // Folds this thread's trace and cursor counters into the totals. Stages
+    // the query did not reach are not recorded.
+    void finish_query(uint64_t total_ns, size_t scored) {
+        QueryTrace& trace = query_trace();
+        for (int s = 0; s < NUM_STAGES; ++s) {
+            if (s != STAGE_TOTAL && trace.ns[s] > 0) stages[s].record(trace.ns[s]);
+            trace.ns[s] = 0;
+        }
+        stages[STAGE_TOTAL].record(total_ns);
+        CursorStats& cursor = cursor_stats();
+        add(COUNT_QUERIES);
+        add(COUNT_BLOCKS_DECODED, cursor.blocks);
+        add(COUNT_POSTINGS_DECODED, cursor.postings);
+        add(COUNT_BYTES_DECODED, cursor.bytes);
+        add(COUNT_DOCS_SCORED, scored);
+        cursor = CursorStats();
+    }
+
+    // Human-readable summary for the `stats` command.
+    std::string text() const {
+        std::string out = "stage        count     mean_us   p50_us    p95_us    p99_us    max_us\n";
+        char line[160];
+        for (int s = 0; s < NUM_STAGES; ++s) {
+            const Histogram& h = stages[s];
+            double mean = h.count() ? h.sum() / 1e3 / h.count() : 0.0;
+            std::snprintf(line, sizeof(line), "%-12s %-9llu %-9.1f %-9.1f %-9.1f %-9.1f %.1f\n", stage_name(s),
+                          (unsigned long long)h.count(), mean, h.percentile(0.50) / 1e3, h.percentile(0.95) / 1e3,
+                          h.percentile(0.99) / 1e3, h.max() / 1e3);
+            out += line;
+        }
+        for (int c = 0; c < NUM_COUNTERS; ++c) {
+            out += std::string(counter_name(c)) + " " + std::to_string(get((Counter)c)) + "\n";
+        }
+        return out;
+    }
+
+    std::string json() const {
+        std::string out = "{\"stages\":{";
+        for (int s = 0; s < NUM_STAGES; ++s) {
+            const Histogram& h = stages[s];
+            out += std::string(s ? "," : "") + "\"" + stage_name(s) + "\":{\"count\":" + std::to_string(h.count()) +
+                   ",\"sum_ns\":" + std::to_string(h.sum()) + ",\"p50_ns\":" + std::to_string(h.percentile(0.50)) +
+                   ",\"p95_ns\":" + std::to_string(h.percentile(0.95)) +
+                   ",\"p99_ns\":" + std::to_string(h.percentile(0.99)) + ",\"max_ns\":" + std::to_string(h.max()) +
+                   "}";
+        }
+        out += "},\"counters\":{";
+        for (int c = 0; c < NUM_COUNTERS; ++c) {
+            out += std::string(c ? "," : "") + "\"" + counter_name(c) + "\":" + std::to_string(get((Counter)c));
+        }
+        return out + "}}";
+    }
+
+    // Prometheus text exposition format. Stage histograms are exported with
+    // fixed bounds from 1 µs to 10 s; each count is exact to within one
+    // histogram bucket.
+    std::string prometheus() const {
+        static const double bounds[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+                                        1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+        std::string out = "# HELP search_stage_seconds Time spent in each query stage.\n"
+                          "# TYPE search_stage_seconds histogram\n";
+        char line[160];
+        for (int s = 0; s < NUM_STAGES; ++s) {
+            const Histogram& h = stages[s];
+            for (size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); ++b) {
+                std::snprintf(line, sizeof(line), "search_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                              stage_name(s), bounds[b], (unsigned long long)h.count_at_most((uint64_t)(bounds[b] * 1e9)));
+                out += line;
+            }
+            std::snprintf(line, sizeof(line),
+                          "search_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                          "search_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+                          "search_stage_seconds_count{stage=\"%s\"} %llu\n",
+                          stage_name(s), (unsigned long long)h.count(), stage_name(s), h.sum() / 1e9, stage_name(s),
+                          (unsigned long long)h.count());
+            out += line;
+        }
+        for (int c = 0; c < NUM_COUNTERS; ++c) {
+            std::string name = std::string("search_") + counter_name(c) + "_total";
+            out += "# TYPE " + name + " counter\n" + name + " " + std::to_string(get((Counter)c)) + "\n";
+        }
+        return out;
+    }
+
+    // Replaces `path` atomically so a scraper never reads half a file.
+    bool write_prometheus(const std::string& path) const {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            if (!out.is_open()) return false;
+            out << prometheus();
+            if (!out) return false;
+        }
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+};
+
+inline QueryStats& query_stats() {
+    static QueryStats stats;
+    return stats;
+}
+
+// Rewrites a Prometheus file every `interval_sec` seconds, and once more
+// when stopped.
+class MetricsDumper {
+    std::string path;
+    int interval_sec;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            wake.wait_for(lock, std::chrono::seconds(interval_sec));
+            if (!query_stats().write_prometheus(path)) {
+                std::fprintf(stderr, "Cannot write metrics to %s\n", path.c_str());
+            }
+        }
+    }
+
+public:
+    MetricsDumper(const std::string& path, int interval_sec)
+        : path(path), interval_sec(interval_sec > 0 ? interval_sec : 1), stopping(false),
+          thread([this]() { run(); }) {}
+    MetricsDumper(const MetricsDumper&) = delete;
+    MetricsDumper& operator=(const MetricsDumper&) = delete;
+
+    ~MetricsDumper() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+};
+
+#endif
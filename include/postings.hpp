@@ -0,0 +1,437 @@
+#ifndef POSTINGS_HPP
+#define POSTINGS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <string>
+#include "custom_stl.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Compressed postings list of one term:
+//
+//   skip table  (last_doc u32, block offset u32, max_tf u32, min_dl u32,
+//               positions offset u32) per block, only if df > BLOCK_SIZE
+//   blocks      full blocks: doc_bits u8, tf_bits u8, packed (delta - 1), packed (tf - 1)
+//               last partial block: varint (delta - 1, tf - 1) pairs
+//
+// Full blocks are bit-packed in four interleaved lanes (value i goes to lane
+// i % 4) so that one 128-bit load/shift/mask yields four consecutive values.
+//
+// max_tf and min_dl are the largest tf and the shortest document length in
+// the block. Any BM25-like score that grows with tf and falls with length is
+// bounded by their combination, whatever the collection statistics are.
+//
+// Positions live in a separate stream so that queries without phrases never
+// touch them. For every posting it holds tf varints: the first token
+// position in the document, then the gaps to the next ones. The skip table
+// records where each block's positions start, relative to the term's first.
+
+const uint32_t BLOCK_SIZE = 128;
+const uint32_t SKIP_ENTRY = 20;
+const int DOC_END = INT_MAX;
+
+inline uint32_t load_u32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void append_u32(std::string& out, uint32_t v) {
+    out.append((const char*)&v, sizeof(v));
+}
+
+inline void append_varint(std::string& out, uint32_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+inline uint32_t read_varint(const char*& p) {
+    uint32_t v = 0;
+    int shift = 0;
+    while (true) {
+        unsigned char c = (unsigned char)*p++;
+        v |= (uint32_t)(c & 0x7f) << shift;
+        if (c < 0x80) return v;
+        shift += 7;
+    }
+}
+
+inline const char* skip_varints(const char* p, uint32_t count) {
+    while (count > 0) {
+        if (!((unsigned char)*p & 0x80)) count--;
+        p++;
+    }
+    return p;
+}
+
+inline uint32_t bits_needed(uint32_t v) {
+    uint32_t bits = 0;
+    while (v) {
+        bits++;
+        v >>= 1;
+    }
+    return bits;
+}
+
+// Packs BLOCK_SIZE values of `bits` width into bits * 16 bytes.
+inline void pack_block(const uint32_t* values, uint32_t bits, std::string& out) {
+    if (bits == 0) return;
+    uint32_t words[BLOCK_SIZE];
+    std::memset(words, 0, bits * 4 * sizeof(uint32_t));
+    for (uint32_t i = 0; i < BLOCK_SIZE; ++i) {
+        uint32_t lane = i & 3;
+        uint32_t pos = (i >> 2) * bits;
+        uint32_t word = pos >> 5, shift = pos & 31;
+        words[word * 4 + lane] |= values[i] << shift;
+        if (shift + bits > 32) words[(word + 1) * 4 + lane] |= values[i] >> (32 - shift);
+    }
+    out.append((const char*)words, bits * 4 * sizeof(uint32_t));
+}
+
+inline void unpack_block(const char* in, uint32_t bits, uint32_t* out) {
+    if (bits == 0) {
+        std::memset(out, 0, BLOCK_SIZE * sizeof(uint32_t));
+        return;
+    }
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi32(bits == 32 ? -1 : (int)((1u << bits) - 1));
+    for (uint32_t slot = 0; slot < BLOCK_SIZE / 4; ++slot) {
+        uint32_t pos = slot * bits;
+        uint32_t word = pos >> 5, shift = pos & 31;
+        __m128i w = _mm_loadu_si128((const __m128i*)(in + word * 16));
+        __m128i v = _mm_srl_epi32(w, _mm_cvtsi32_si128((int)shift));
+        if (shift + bits > 32) {
+            __m128i hi = _mm_loadu_si128((const __m128i*)(in + (word + 1) * 16));
+            v = _mm_or_si128(v, _mm_sll_epi32(hi, _mm_cvtsi32_si128((int)(32 - shift))));
+        }
+        _mm_storeu_si128((__m128i*)(out + slot * 4), _mm_and_si128(v, mask));
+    }
+#else
+    const uint32_t mask = bits == 32 ? 0xffffffffu : ((1u << bits) - 1);
+    for (uint32_t slot = 0; slot < BLOCK_SIZE / 4; ++slot) {
+        uint32_t pos = slot * bits;
+        uint32_t word = pos >> 5, shift = pos & 31;
+        for (uint32_t lane = 0; lane < 4; ++lane) {
+            uint32_t v = load_u32(in + (word * 4 + lane) * 4) >> shift;
+            if (shift + bits > 32) v |= load_u32(in + ((word + 1) * 4 + lane) * 4) << (32 - shift);
+            out[slot * 4 + lane] = v & mask;
+        }
+    }
+#endif
+}
+
+// Encodes one block of at most BLOCK_SIZE postings; `prev` is the last doc
+// id of the previous block (-1 for the first one) and is updated.
+inline void encode_block(const Pair<int, int>* postings, size_t count, int& prev, std::string& out) {
+    if (count == BLOCK_SIZE) {
+        uint32_t deltas[BLOCK_SIZE];
+        uint32_t tfs[BLOCK_SIZE];
+        uint32_t max_delta = 0, max_tf = 0;
+        for (size_t i = 0; i < count; ++i) {
+            deltas[i] = (uint32_t)(postings[i].first - prev - 1);
+            tfs[i] = (uint32_t)(postings[i].second - 1);
+            prev = postings[i].first;
+            max_delta |= deltas[i];
+            max_tf |= tfs[i];
+        }
+        uint32_t doc_bits = bits_needed(max_delta), tf_bits = bits_needed(max_tf);
+        out.push_back((char)doc_bits);
+        out.push_back((char)tf_bits);
+        pack_block(deltas, doc_bits, out);
+        pack_block(tfs, tf_bits, out);
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            append_varint(out, (uint32_t)(postings[i].first - prev - 1));
+            append_varint(out, (uint32_t)(postings[i].second - 1));
+            prev = postings[i].first;
+        }
+    }
+}
+
+// Folds the postings into the running (max_tf, min_dl) bound.
+inline void posting_bounds(const Pair<int, int>* postings, size_t n, const uint32_t* doc_lengths,
+                           uint32_t& max_tf, uint32_t& min_dl) {
+    for (size_t i = 0; i < n; ++i) {
+        if ((uint32_t)postings[i].second > max_tf) max_tf = (uint32_t)postings[i].second;
+        if (doc_lengths[postings[i].first] < min_dl) min_dl = doc_lengths[postings[i].first];
+    }
+}
+
+// `positions` is the term's positions stream, or null if the index has none.
+// `doc_lengths` may be null for lists that are never scored, such as the
+// runs of a memory-bounded build; their blocks then carry no bounds.
+inline void encode_postings(const Pair<int, int>* postings, size_t n, const uint32_t* doc_lengths,
+                            const char* positions, std::string& out) {
+    size_t num_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t skip_pos = out.size();
+    if (num_blocks > 1) out.append(num_blocks * SKIP_ENTRY, '\0');
+
+    int prev = -1;
+    const char* pos = positions;
+    for (size_t b = 0; b < num_blocks; ++b) {
+        size_t start = b * BLOCK_SIZE;
+        size_t count = n - start < BLOCK_SIZE ? n - start : BLOCK_SIZE;
+        uint32_t block_offset = (uint32_t)(out.size() - skip_pos);
+        uint32_t positions_offset = (uint32_t)(pos - positions);
+        encode_block(postings + start, count, prev, out);
+        if (pos) {
+            for (size_t i = start; i < start + count; ++i) pos = skip_varints(pos, (uint32_t)postings[i].second);
+        }
+
+        if (num_blocks > 1) {
+            uint32_t entry[5] = {(uint32_t)prev, block_offset, 0, UINT32_MAX, positions_offset};
+            if (doc_lengths) posting_bounds(postings + start, count, doc_lengths, entry[2], entry[3]);
+            std::memcpy(&out[skip_pos + b * SKIP_ENTRY], entry, SKIP_ENTRY);
+        }
+    }
+}
+
+// Work done by the cursors of the current thread, collected per query by
+// the searcher's instrumentation.
+struct CursorStats {
+    uint64_t blocks;
+    uint64_t postings;
+    uint64_t bytes;
+
+    CursorStats() : blocks(0), postings(0), bytes(0) {}
+};
+
+inline CursorStats& cursor_stats() {
+    thread_local CursorStats stats;
+    return stats;
+}
+
+// Forward-only cursor over a compressed postings list. Blocks are decoded
+// lazily: doc ids when the cursor enters a block, tfs on the first tf() call.
+//
+// Besides the decoded position the cursor keeps a "shallow" block pointer
+// that only reads the skip table; seek_block() moves it for Block-Max WAND.
+class PostingCursor {
+    const char* base;
+    const char* pos_data;
+    uint32_t df_;
+    uint32_t num_blocks;
+    uint32_t max_tf_;
+    uint32_t min_dl_;
+    uint32_t shallow;
+    uint32_t block;
+    uint32_t pos;
+    uint32_t count;
+    const char* tf_data;
+    uint32_t tf_bits;
+    bool tfs_ready;
+    int cur_doc;
+    int docs[BLOCK_SIZE];
+    uint32_t tfs[BLOCK_SIZE];
+    // Where positions() left off, so that forward calls within a block
+    // resume instead of rescanning the block's positions.
+    uint32_t pos_block;
+    uint32_t pos_index;
+    const char* pos_ptr;
+
+    int block_last_doc(uint32_t b) const { return (int)load_u32(base + b * SKIP_ENTRY); }
+
+    void load_block(uint32_t b) {
+        block = b;
+        pos = 0;
+        if (b >= num_blocks) {
+            count = 0;
+            cur_doc = DOC_END;
+            return;
+        }
+        uint32_t offset = num_blocks > 1 ? load_u32(base + b * SKIP_ENTRY + 4) : 0;
+        const char* p = base + offset;
+        int prev = b == 0 ? -1 : block_last_doc(b - 1);
+        uint32_t start = b * BLOCK_SIZE;
+        count = df_ - start < BLOCK_SIZE ? df_ - start : BLOCK_SIZE;
+        CursorStats& stats = cursor_stats();
+        stats.blocks++;
+        stats.postings += count;
+
+        if (count == BLOCK_SIZE) {
+            uint32_t doc_bits = (unsigned char)p[0];
+            tf_bits = (unsigned char)p[1];
+            unpack_block(p + 2, doc_bits, (uint32_t*)docs);
+            for (uint32_t i = 0; i < BLOCK_SIZE; ++i) {
+                prev += docs[i] + 1;
+                docs[i] = prev;
+            }
+            tf_data = p + 2 + doc_bits * 16;
+            tfs_ready = false;
+            stats.bytes += 2 + doc_bits * 16;
+        } else {
+            const char* begin = p;
+            for (uint32_t i = 0; i < count; ++i) {
+                prev += (int)read_varint(p) + 1;
+                docs[i] = prev;
+                tfs[i] = read_varint(p) + 1;
+            }
+            tfs_ready = true;
+            stats.bytes += (uint64_t)(p - begin);
+        }
+        cur_doc = docs[0];
+    }
+
+public:
+    PostingCursor() : base(nullptr), pos_data(nullptr), df_(0), num_blocks(0), max_tf_(0), min_dl_(0), shallow(0),
+                      block(0), pos(0), count(0), tf_data(nullptr), tf_bits(0), tfs_ready(true), cur_doc(DOC_END),
+                      pos_block(UINT32_MAX), pos_index(0), pos_ptr(nullptr) {}
+
+    // `max_tf` and `min_dl` are the list-wide bounds from the dictionary;
+    // `positions` is the term's positions stream, if the index has one.
+    PostingCursor(const char* data, uint32_t df, uint32_t max_tf = 0, uint32_t min_dl = 0,
+                  const char* positions = nullptr) : PostingCursor() {
+        base = data;
+        pos_data = positions;
+        df_ = df;
+        max_tf_ = max_tf;
+        min_dl_ = min_dl;
+        num_blocks = (df + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        load_block(0);
+    }
+
+    uint32_t df() const { return df_; }
+    uint32_t max_tf() const { return max_tf_; }
+    bool has_positions() const { return pos_data != nullptr; }
+    uint32_t min_dl() const { return min_dl_; }
+    bool at_end() const { return cur_doc == DOC_END; }
+    int doc() const { return cur_doc; }
+
+    int tf() {
+        if (!tfs_ready) {
+            unpack_block(tf_data, tf_bits, tfs);
+            for (uint32_t i = 0; i < BLOCK_SIZE; ++i) tfs[i] += 1;
+            tfs_ready = true;
+            cursor_stats().bytes += tf_bits * 16;
+        }
+        return (int)tfs[pos];
+    }
+
+    void next() {
+        if (++pos < count) cur_doc = docs[pos];
+        else load_block(block + 1);
+    }
+
+    // Moves the shallow pointer to the block that may contain `target`
+    // without decoding anything. Returns false if the list ends before it.
+    bool seek_block(int target) {
+        if (num_blocks <= 1) return count > 0 && docs[count - 1] >= target;
+        if (shallow < block) shallow = block;
+        while (shallow < num_blocks && block_last_doc(shallow) < target) ++shallow;
+        return shallow < num_blocks;
+    }
+
+    // Last doc id and bounds of the block under the shallow pointer.
+    int block_last() const {
+        return num_blocks > 1 ? block_last_doc(shallow) : docs[count - 1];
+    }
+    uint32_t block_max_tf() const {
+        return num_blocks > 1 ? load_u32(base + shallow * SKIP_ENTRY + 8) : max_tf_;
+    }
+    uint32_t block_min_dl() const {
+        return num_blocks > 1 ? load_u32(base + shallow * SKIP_ENTRY + 12) : min_dl_;
+    }
+
+    // Moves to the first posting with doc_id >= target. The skip table is
+    // searched by galloping from the current block, so the cost grows with
+    // the log of the distance skipped rather than with the list length.
+    void advance(int target) {
+        if (cur_doc >= target) return;
+        if (num_blocks > 1 && block_last_doc(block) < target) {
+            uint32_t lo = block + 1, hi = lo, step = 1;
+            while (hi < num_blocks && block_last_doc(hi) < target) {
+                lo = hi + 1;
+                hi = lo + step;
+                step <<= 1;
+            }
+            if (hi > num_blocks) hi = num_blocks;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (block_last_doc(mid) < target) lo = mid + 1;
+                else hi = mid;
+            }
+            load_block(lo);
+            if (cur_doc >= target) return;
+        }
+        if (docs[count - 1] < target) {
+            load_block(block + 1);
+            return;
+        }
+        uint32_t lo = pos + 1, hi = count - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (docs[mid] < target) lo = mid + 1;
+            else hi = mid;
+        }
+        pos = lo;
+        cur_doc = docs[pos];
+    }
+
+    // Token positions of the current posting, in increasing order.
+    void positions(Vector<uint32_t>& out) {
+        out.clear();
+        if (!pos_data || at_end()) return;
+        tf();
+        if (pos_block != block || pos_index > pos) {
+            pos_block = block;
+            pos_index = 0;
+            pos_ptr = pos_data + (num_blocks > 1 ? load_u32(base + block * SKIP_ENTRY + 16) : 0);
+        }
+        while (pos_index < pos) pos_ptr = skip_varints(pos_ptr, tfs[pos_index++]);
+        const char* p = pos_ptr;
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < tfs[pos]; ++i) {
+            value += read_varint(p);
+            out.push_back(value);
+        }
+        cursor_stats().bytes += (uint64_t)(p - pos_ptr);
+    }
+
+    // Decoded doc ids from the current position to the end of the block.
+    const int* block_docs() const { return docs + pos; }
+    uint32_t block_remaining() const { return count - pos; }
+    void next_block() { load_block(block + 1); }
+};
+
+// Writes the values common to two sorted lists of distinct ints to `out`
+// (room for min(na, nb) values) and returns their count. With SSE2 every
+// step compares four values of `a` against four of `b` in all rotations.
+inline size_t intersect_sorted(const int* a, size_t na, const int* b, size_t nb, int* out) {
+    size_t i = 0, j = 0, k = 0;
+#if defined(__SSE2__)
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb), _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x39))),
+            _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4e)),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x93))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        for (int lane = 0; lane < 4; ++lane) {
+            if (mask & (1 << lane)) out[k++] = a[i + lane];
+        }
+        int a_max = a[i + 3], b_max = b[j + 3];
+        if (a_max <= b_max) i += 4;
+        if (b_max <= a_max) j += 4;
+    }
+#endif
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) i++;
+        else if (b[j] < a[i]) j++;
+        else {
+            out[k++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return k;
+}
+
+#endif
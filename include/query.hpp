@@ -0,0 +1,902 @@
+#ifndef QUERY_HPP
+#define QUERY_HPP
+
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include "custom_stl.hpp"
+#include "tokenizer.hpp"
+#include "postings.hpp"
+#include "index_format.hpp"
+#include "fuzzy.hpp"
+
+// Query language and its evaluation over an IndexReader.
+//
+//   query   := or
+//   or      := and ('|' and)*
+//   and     := near (['&'] near)*          adjacent operands are ANDed
+//   near    := unary ('NEAR/k' unary)*     terms within a window of k tokens
+//   unary   := '!' unary | primary
+//   primary := '(' query ')' | '"' text '"' | word | word '*' | word '~' k
+//
+// A word or quoted text is run through the tokenizer; several tokens form a
+// phrase. A word ending in '*' is a prefix: it is only lower-cased, and
+// expand_terms() turns it into an OR over the dictionary terms starting
+// with it. A word followed by '~1' or '~2' is stemmed and likewise expanded
+// to the terms within that many edits of its stem. The parsed tree is
+// compiled into lazy iterators that only ever hold one decoded block per
+// term, so a query needs memory proportional to its size, not to the length
+// of its postings lists. Phrases and NEAR are matched at doc level first;
+// positions are decoded only for documents that contain all their terms.
+
+// Lists whose df differs by more than this factor are intersected by
+// advancing the longer one to each doc of the shorter; closer lists are
+// merged block by block with intersect_sorted().
+const uint32_t GALLOP_RATIO = 32;
+
+const int MAX_QUERY_DEPTH = 64;
+
+// Most terms a prefix or fuzzy word expands to; the closest ones, then the
+// ones in the most documents, are kept.
+const size_t MAX_EXPANSIONS = 64;
+
+inline Vector<int> intersect_lists(const Vector<int>& list1, const Vector<int>& list2) {
+    Vector<int> result;
+    size_t i = 0, j = 0;
+    while (i < list1.size() && j < list2.size()) {
+        if (list1[i] < list2[j]) i++;
+        else if (list2[j] < list1[i]) j++;
+        else {
+            result.push_back(list1[i]);
+            i++; j++;
+        }
+    }
+    return result;
+}
+
+inline Vector<int> collect_docs(PostingCursor& cursor) {
+    Vector<int> docs;
+    docs.reserve(cursor.df());
+    for (; !cursor.at_end(); cursor.next()) docs.push_back(cursor.doc());
+    return docs;
+}
+
+// Docs of the shorter list `a` that are also in `b`, skipping through `b`.
+inline Vector<int> intersect_gallop(PostingCursor& a, PostingCursor& b) {
+    Vector<int> result;
+    for (; !a.at_end(); a.next()) {
+        b.advance(a.doc());
+        if (b.at_end()) break;
+        if (b.doc() == a.doc()) result.push_back(a.doc());
+    }
+    return result;
+}
+
+// One step of a block-wise intersection: aligns both cursors, intersects
+// what is left of their current blocks into `out` (BLOCK_SIZE ints) and
+// moves past the block that ends first. Returns the number of matches.
+inline size_t intersect_step(PostingCursor& a, PostingCursor& b, int* out) {
+    a.advance(b.doc());
+    b.advance(a.doc());
+    if (a.at_end() || b.at_end()) return 0;
+    const int* pa = a.block_docs();
+    const int* pb = b.block_docs();
+    uint32_t na = a.block_remaining(), nb = b.block_remaining();
+    size_t n = intersect_sorted(pa, na, pb, nb, out);
+
+    int last_a = pa[na - 1], last_b = pb[nb - 1];
+    if (last_a <= last_b) a.next_block();
+    if (last_b <= last_a) b.next_block();
+    if (last_a < last_b) b.advance(last_a + 1);
+    else if (last_b < last_a) a.advance(last_b + 1);
+    return n;
+}
+
+// Intersects two lists of similar length one decoded block at a time.
+inline Vector<int> intersect_blocks(PostingCursor& a, PostingCursor& b) {
+    Vector<int> result;
+    int out[BLOCK_SIZE];
+    while (!a.at_end() && !b.at_end()) {
+        size_t n = intersect_step(a, b, out);
+        for (size_t i = 0; i < n; ++i) result.push_back(out[i]);
+    }
+    return result;
+}
+
+struct QueryNode {
+    enum Type { TERM, AND, OR, NOT, PHRASE, NEAR, PREFIX, FUZZY };
+
+    Type type;
+    // The stem of a TERM or FUZZY, the lower-cased prefix of a PREFIX.
+    std::string term;
+    // Window of a NEAR node: its terms must fit in distance + 1 tokens.
+    // Edits allowed by a FUZZY node.
+    int distance;
+    Vector<QueryNode*> children;
+
+    QueryNode(Type type) : type(type), distance(0) {}
+    QueryNode(const QueryNode&) = delete;
+    QueryNode& operator=(const QueryNode&) = delete;
+    ~QueryNode() {
+        for (size_t i = 0; i < children.size(); ++i) delete children[i];
+    }
+};
+
+class QueryParser {
+    enum TokenType { WORD, QUOTED, LPAREN, RPAREN, OR_OP, AND_OP, NOT_OP, NEAR_OP, END };
+
+    const std::string& text;
+    size_t pos;
+    TokenType type;
+    std::string word;
+    int distance;
+    std::string error;
+    int depth;
+
+    static bool is_operator(char c) {
+        return c == '(' || c == ')' || c == '|' || c == '&' || c == '!' || c == '"';
+    }
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+    void lex() {
+        while (pos < text.size() && is_space(text[pos])) pos++;
+        word.clear();
+        if (pos >= text.size()) {
+            type = END;
+            return;
+        }
+        char c = text[pos];
+        if (c == '"') {
+            size_t close = text.find('"', pos + 1);
+            if (close == std::string::npos) {
+                fail("unterminated quote");
+                type = END;
+                return;
+            }
+            word = text.substr(pos + 1, close - pos - 1);
+            pos = close + 1;
+            type = QUOTED;
+            return;
+        }
+        if (is_operator(c)) {
+            pos++;
+            type = c == '(' ? LPAREN : c == ')' ? RPAREN : c == '|' ? OR_OP : c == '&' ? AND_OP : NOT_OP;
+            return;
+        }
+        size_t start = pos;
+        while (pos < text.size() && !is_space(text[pos]) && !is_operator(text[pos])) pos++;
+        word = text.substr(start, pos - start);
+        type = WORD;
+        if (word.size() > 5 && word.compare(0, 5, "NEAR/") == 0 &&
+            word.find_first_not_of("0123456789", 5) == std::string::npos && word.size() <= 10) {
+            distance = std::atoi(word.c_str() + 5);
+            type = NEAR_OP;
+        }
+    }
+
+    void fail(const std::string& message) {
+        if (error.empty()) error = message + " at offset " + std::to_string(pos);
+    }
+
+    static QueryNode* combine(QueryNode::Type op, QueryNode* left, QueryNode* right) {
+        if (!left) return right;
+        if (!right) return left;
+        QueryNode* node = left;
+        if (left->type != op) {
+            node = new QueryNode(op);
+            node->children.push_back(left);
+        }
+        if (right->type == op) {
+            for (size_t i = 0; i < right->children.size(); ++i) node->children.push_back(right->children[i]);
+            right->children.clear();
+            delete right;
+        } else {
+            node->children.push_back(right);
+        }
+        return node;
+    }
+
+    static QueryNode* terms_node(const std::string& s) {
+        Vector<std::string> tokens;
+        tokenize_to_container(s, tokens);
+        if (tokens.empty()) return nullptr;
+        QueryNode* node = new QueryNode(tokens.size() == 1 ? QueryNode::TERM : QueryNode::PHRASE);
+        if (tokens.size() == 1) node->term = tokens[0];
+        for (size_t i = 0; tokens.size() > 1 && i < tokens.size(); ++i) {
+            QueryNode* term = new QueryNode(QueryNode::TERM);
+            term->term = tokens[i];
+            node->children.push_back(term);
+        }
+        return node;
+    }
+
+    // A prefix must be a single word: every character before the '*' a letter.
+    QueryNode* prefix_node(const std::string& s) {
+        const LetterTable& letters = letter_table();
+        size_t end = s.find_last_not_of('*') + 1;
+        std::string prefix;
+        for (size_t i = 0; i < end;) {
+            uint32_t lower = letters.fold(decode_utf8(s, i));
+            if (!lower) {
+                fail("a prefix must be a single word");
+                return nullptr;
+            }
+            append_utf8(prefix, lower);
+        }
+        if (prefix.empty()) {
+            fail("'*' needs a prefix");
+            return nullptr;
+        }
+        QueryNode* node = new QueryNode(QueryNode::PREFIX);
+        node->term = prefix;
+        return node;
+    }
+
+    // `s` is a word, '~' and the number of edits.
+    QueryNode* fuzzy_node(const std::string& s, size_t tilde) {
+        int edits = std::atoi(s.c_str() + tilde + 1);
+        if (s.size() - tilde != 2 || edits < 1 || edits > MAX_FUZZY_DISTANCE) {
+            fail("a fuzzy word allows 1 to " + std::to_string(MAX_FUZZY_DISTANCE) + " edits");
+            return nullptr;
+        }
+        Vector<std::string> tokens;
+        tokenize_to_container(s.substr(0, tilde), tokens);
+        if (tokens.size() != 1) {
+            fail(tokens.empty() ? "'~' needs a word" : "a fuzzy word must be a single word");
+            return nullptr;
+        }
+        QueryNode* node = new QueryNode(QueryNode::FUZZY);
+        node->term = tokens[0];
+        node->distance = edits;
+        return node;
+    }
+
+    // A null result without an error is an operand with no indexable text.
+    QueryNode* parse_primary() {
+        if (type == WORD && word.back() == '*') {
+            QueryNode* node = prefix_node(word);
+            lex();
+            return node;
+        }
+        size_t tilde = type == WORD ? word.rfind('~') : std::string::npos;
+        if (tilde != std::string::npos && tilde + 1 < word.size() &&
+            word.find_first_not_of("0123456789", tilde + 1) == std::string::npos) {
+            QueryNode* node = fuzzy_node(word, tilde);
+            lex();
+            return node;
+        }
+        if (type == WORD || type == QUOTED) {
+            QueryNode* node = terms_node(word);
+            lex();
+            return node;
+        }
+        if (type == LPAREN) {
+            if (++depth > MAX_QUERY_DEPTH) {
+                fail("query nested too deeply");
+                return nullptr;
+            }
+            lex();
+            QueryNode* node = parse_or();
+            if (type != RPAREN) {
+                fail("expected ')'");
+                delete node;
+                return nullptr;
+            }
+            depth--;
+            lex();
+            return node;
+        }
+        fail("expected a term");
+        return nullptr;
+    }
+
+    QueryNode* parse_unary() {
+        if (type != NOT_OP) return parse_primary();
+        if (++depth > MAX_QUERY_DEPTH) {
+            fail("query nested too deeply");
+            return nullptr;
+        }
+        lex();
+        QueryNode* operand = parse_unary();
+        depth--;
+        if (!operand) return nullptr;
+        if (operand->type == QueryNode::NOT) {
+            QueryNode* inner = operand->children[0];
+            operand->children.clear();
+            delete operand;
+            return inner;
+        }
+        QueryNode* node = new QueryNode(QueryNode::NOT);
+        node->children.push_back(operand);
+        return node;
+    }
+
+    QueryNode* parse_near() {
+        QueryNode* node = parse_unary();
+        while (error.empty() && type == NEAR_OP) {
+            int k = distance;
+            lex();
+            QueryNode* right = parse_unary();
+            if (!error.empty()) break;
+            if (!node || !right || right->type != QueryNode::TERM ||
+                (node->type != QueryNode::TERM && node->type != QueryNode::NEAR)) {
+                fail("NEAR needs single terms on both sides");
+            } else if (node->type == QueryNode::NEAR && node->distance != k) {
+                fail("mixed NEAR distances");
+            }
+            if (!error.empty()) {
+                delete right;
+                break;
+            }
+            if (node->type == QueryNode::TERM) {
+                QueryNode* near = new QueryNode(QueryNode::NEAR);
+                near->distance = k;
+                near->children.push_back(node);
+                node = near;
+            }
+            node->children.push_back(right);
+        }
+        return node;
+    }
+
+    QueryNode* parse_and() {
+        QueryNode* node = parse_near();
+        while (error.empty()) {
+            if (type == AND_OP) lex();
+            else if (type != WORD && type != QUOTED && type != LPAREN && type != NOT_OP) break;
+            node = combine(QueryNode::AND, node, parse_near());
+        }
+        return node;
+    }
+
+    QueryNode* parse_or() {
+        QueryNode* node = parse_and();
+        while (error.empty() && type == OR_OP) {
+            lex();
+            node = combine(QueryNode::OR, node, parse_and());
+        }
+        return node;
+    }
+
+public:
+    QueryParser(const std::string& text) : text(text), pos(0), type(END), distance(0), depth(0) {}
+
+    // Returns the query tree, or nullptr if the query is empty or invalid;
+    // in the latter case `error` describes the problem.
+    QueryNode* parse(std::string& message) {
+        lex();
+        QueryNode* node = error.empty() ? parse_or() : nullptr;
+        if (error.empty() && type != END) fail(type == RPAREN ? "unbalanced ')'" : "unexpected operator");
+        message = error;
+        if (!error.empty()) {
+            delete node;
+            return nullptr;
+        }
+        return node;
+    }
+};
+
+inline QueryNode* parse_query(const std::string& query, std::string& error) {
+    QueryParser parser(query);
+    return parser.parse(error);
+}
+
+// Canonical text of a parsed query: stemmed terms, with the operands of
+// AND, OR and NEAR sorted. Queries that differ only in spelling, case or
+// operand order get the same key.
+inline std::string query_key(const QueryNode* node) {
+    if (node->type == QueryNode::TERM) return node->term;
+    if (node->type == QueryNode::PREFIX) return node->term + "*";
+    if (node->type == QueryNode::FUZZY) return node->term + "~" + std::to_string(node->distance);
+    Vector<std::string> parts;
+    for (size_t i = 0; i < node->children.size(); ++i) parts.push_back(query_key(node->children[i]));
+    if (node->type != QueryNode::PHRASE) std::sort(parts.begin(), parts.end());
+    std::string key = node->type == QueryNode::AND ? "&(" : node->type == QueryNode::OR ? "|(" :
+                      node->type == QueryNode::NOT ? "!(" : node->type == QueryNode::PHRASE ? "\"(" :
+                      "NEAR/" + std::to_string(node->distance) + "(";
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (i) key += ' ';
+        key += parts[i];
+    }
+    return key + ")";
+}
+
+// The at most `limit` terms of `segments` that start with `prefix`, the ones
+// with the highest document frequency summed over the segments (the first
+// in dictionary order on ties). Each segment's range is found with one
+// lower_bound() and walked in step with the others, so only terms that
+// make the cut are copied.
+inline void prefix_expansions(const std::string& prefix, const Vector<const IndexReader*>& segments, size_t limit,
+                              Vector<std::string>& out) {
+    Vector<TermCursor> cursors;
+    for (size_t s = 0; s < segments.size(); ++s) cursors.push_back(segments[s]->terms(segments[s]->lower_bound(prefix)));
+    auto in_range = [&](size_t s) {
+        return !cursors[s].at_end() && cursors[s].term().compare(0, prefix.size(), prefix) == 0;
+    };
+    // Heap of the best terms so far, the worst one on top.
+    typedef Pair<uint64_t, std::string> Candidate;
+    auto better = [](const Candidate& x, const Candidate& y) {
+        return x.first != y.first ? x.first > y.first : x.second < y.second;
+    };
+    Vector<Candidate> best;
+    std::string term;
+    while (limit > 0) {
+        bool any = false;
+        for (size_t s = 0; s < cursors.size(); ++s) {
+            if (in_range(s) && (!any || cursors[s].term() < term)) {
+                term.assign(cursors[s].term().data(), cursors[s].term().size());
+                any = true;
+            }
+        }
+        if (!any) break;
+        uint64_t df = 0;
+        for (size_t s = 0; s < cursors.size(); ++s) {
+            if (!in_range(s) || cursors[s].term() != term) continue;
+            df += segments[s]->df(cursors[s].index());
+            cursors[s].next();
+        }
+        // Terms arrive in dictionary order, so a tie never displaces.
+        if (best.size() == limit) {
+            if (df <= best[0].first) continue;
+            std::pop_heap(best.begin(), best.end(), better);
+            best[best.size() - 1] = Candidate(df, term);
+        } else {
+            best.push_back(Candidate(df, term));
+        }
+        std::push_heap(best.begin(), best.end(), better);
+    }
+    for (size_t i = 0; i < best.size(); ++i) out.push_back(best[i].second);
+}
+
+// Calls work(s) for every segment s below n and returns when all calls are
+// done, possibly running them on several threads at once.
+typedef std::function<void(size_t, const std::function<void(size_t)>&)> SegmentRunner;
+
+// The at most `limit` terms of `segments` within `edits` edits of `word`:
+// the closest ones, then those with the highest document frequency summed
+// over the segments, then the first in dictionary order. The segments are
+// searched by `run` if given.
+inline void fuzzy_expansions(const std::string& word, int edits, const Vector<const IndexReader*>& segments,
+                             size_t limit, Vector<std::string>& out, const SegmentRunner* run = nullptr) {
+    Vector<Vector<FuzzyMatch>> per_segment(segments.size());
+    std::function<void(size_t)> search = [&](size_t s) { fuzzy_terms(*segments[s], word, edits, per_segment[s]); };
+    if (run) (*run)(segments.size(), search);
+    else for (size_t s = 0; s < segments.size(); ++s) search(s);
+    Vector<FuzzyMatch> found;
+    for (size_t s = 0; s < segments.size(); ++s) {
+        for (size_t i = 0; i < per_segment[s].size(); ++i) found.push_back(std::move(per_segment[s][i]));
+    }
+    // A term in several segments is found once in each.
+    std::sort(found.begin(), found.end(), [](const FuzzyMatch& x, const FuzzyMatch& y) { return x.term < y.term; });
+    Vector<FuzzyMatch> matches;
+    for (size_t i = 0; i < found.size(); ++i) {
+        if (!matches.empty() && matches[matches.size() - 1].term == found[i].term) {
+            matches[matches.size() - 1].df += found[i].df;
+        } else {
+            matches.push_back(found[i]);
+        }
+    }
+    auto better = [](const FuzzyMatch& x, const FuzzyMatch& y) {
+        if (x.distance != y.distance) return x.distance < y.distance;
+        return x.df != y.df ? x.df > y.df : x.term < y.term;
+    };
+    size_t n = matches.size() < limit ? matches.size() : limit;
+    std::partial_sort(matches.begin(), matches.begin() + n, matches.end(), better);
+    for (size_t i = 0; i < n; ++i) out.push_back(matches[i].term);
+}
+
+// Replaces every PREFIX and FUZZY node with the terms of `segments` it
+// stands for: a TERM, or an OR of at most `limit` terms in dictionary
+// order. All terms are weighted alike, whatever their distance. A node
+// that no term matches stays as it is and matches nothing. Fuzzy words are
+// looked up in the segments by `run` if given.
+inline void expand_terms(QueryNode* node, const Vector<const IndexReader*>& segments, size_t limit = MAX_EXPANSIONS,
+                         const SegmentRunner* run = nullptr) {
+    if (node->type != QueryNode::PREFIX && node->type != QueryNode::FUZZY) {
+        for (size_t i = 0; i < node->children.size(); ++i) expand_terms(node->children[i], segments, limit, run);
+        return;
+    }
+    Vector<std::string> terms;
+    if (node->type == QueryNode::PREFIX) prefix_expansions(node->term, segments, limit, terms);
+    else fuzzy_expansions(node->term, node->distance, segments, limit, terms, run);
+    if (terms.empty()) return;
+    if (terms.size() == 1) {
+        node->type = QueryNode::TERM;
+        node->term = terms[0];
+        node->distance = 0;
+        return;
+    }
+    std::sort(terms.begin(), terms.end());
+    node->type = QueryNode::OR;
+    node->term.clear();
+    node->distance = 0;
+    for (size_t i = 0; i < terms.size(); ++i) {
+        QueryNode* child = new QueryNode(QueryNode::TERM);
+        child->term = terms[i];
+        node->children.push_back(child);
+    }
+}
+
+// Terms whose postings score a document, in query order; negated subtrees
+// are left out.
+inline void scoring_terms(const QueryNode* node, Vector<std::string>& out) {
+    if (node->type == QueryNode::TERM) out.push_back(node->term);
+    else if (node->type != QueryNode::NOT) {
+        for (size_t i = 0; i < node->children.size(); ++i) scoring_terms(node->children[i], out);
+    }
+}
+
+// Terms that every matching document contains.
+inline Vector<std::string> required_terms(const QueryNode* node) {
+    Vector<std::string> result;
+    if (node->type == QueryNode::TERM) {
+        result.push_back(node->term);
+    } else if (node->type != QueryNode::OR && node->type != QueryNode::NOT) {
+        for (size_t i = 0; i < node->children.size(); ++i) {
+            Vector<std::string> child = required_terms(node->children[i]);
+            for (size_t j = 0; j < child.size(); ++j) result.push_back(child[j]);
+        }
+    } else if (node->type == QueryNode::OR) {
+        result = required_terms(node->children[0]);
+        for (size_t i = 1; i < node->children.size() && !result.empty(); ++i) {
+            Vector<std::string> child = required_terms(node->children[i]);
+            size_t kept = 0;
+            for (size_t j = 0; j < result.size(); ++j) {
+                bool found = false;
+                for (size_t c = 0; c < child.size() && !found; ++c) found = child[c] == result[j];
+                if (found) result[kept++] = result[j];
+            }
+            Vector<std::string> common;
+            for (size_t j = 0; j < kept; ++j) common.push_back(result[j]);
+            result = std::move(common);
+        }
+    }
+    return result;
+}
+
+// True if every match contains at least one scoring term.
+inline bool matches_need_terms(const QueryNode* node) {
+    if (node->type == QueryNode::TERM) return true;
+    if (node->type == QueryNode::NOT) return false;
+    bool any = false, all = true;
+    for (size_t i = 0; i < node->children.size(); ++i) {
+        bool child = matches_need_terms(node->children[i]);
+        any = any || child;
+        all = all && child;
+    }
+    return node->type == QueryNode::OR ? all : any;
+}
+
+// Lazy iterator over the sorted doc ids matching a subquery. A freshly
+// built iterator is positioned on its first match; doc() is DOC_END once
+// it is exhausted.
+class DocIterator {
+public:
+    virtual ~DocIterator() {}
+    virtual int doc() const = 0;
+    virtual void next() = 0;
+    // Moves to the first match >= target; never moves backwards.
+    virtual void advance(int target) = 0;
+    // Upper bound on the number of matches, used to order AND operands.
+    virtual uint64_t cost() const = 0;
+    virtual PostingCursor* term_cursor() { return nullptr; }
+};
+
+class TermIterator : public DocIterator {
+    PostingCursor cursor;
+
+public:
+    TermIterator(const PostingCursor& cursor) : cursor(cursor) {}
+    int doc() const override { return cursor.doc(); }
+    void next() override { cursor.next(); }
+    void advance(int target) override { cursor.advance(target); }
+    uint64_t cost() const override { return cursor.df(); }
+    PostingCursor* term_cursor() override { return &cursor; }
+};
+
+class AllIterator : public DocIterator {
+    int cur;
+    int num_docs;
+
+public:
+    AllIterator(int num_docs) : cur(num_docs > 0 ? 0 : DOC_END), num_docs(num_docs) {}
+    int doc() const override { return cur; }
+    void next() override { cur = cur + 1 < num_docs ? cur + 1 : DOC_END; }
+    void advance(int target) override {
+        if (target > cur) cur = target < num_docs ? target : DOC_END;
+    }
+    uint64_t cost() const override { return (uint64_t)num_docs; }
+};
+
+// Intersection of two term lists of similar length, produced one block of
+// matches at a time by intersect_step().
+class BlockAndIterator : public DocIterator {
+    PostingCursor a;
+    PostingCursor b;
+    int buf[BLOCK_SIZE];
+    uint32_t n;
+    uint32_t i;
+
+    void fill(int target) {
+        a.advance(target);
+        b.advance(target);
+        i = n = 0;
+        while (n == 0 && !a.at_end() && !b.at_end()) n = (uint32_t)intersect_step(a, b, buf);
+        if (n == 0) {
+            buf[0] = DOC_END;
+            n = 1;
+        }
+    }
+
+public:
+    BlockAndIterator(const PostingCursor& a, const PostingCursor& b) : a(a), b(b), n(0), i(0) { fill(0); }
+    int doc() const override { return buf[i]; }
+    void next() override {
+        if (buf[i] == DOC_END) return;
+        if (++i == n) fill(0);
+    }
+    void advance(int target) override {
+        while (i < n && buf[i] < target) i++;
+        if (i == n) fill(target);
+    }
+    uint64_t cost() const override { return a.df() < b.df() ? a.df() : b.df(); }
+};
+
+// Docs in every positive operand and in none of the negative ones. The
+// cheapest operand leads and the others are advanced to its candidates.
+class AndIterator : public DocIterator {
+    Vector<DocIterator*> positives;
+    Vector<DocIterator*> negatives;
+    int cur;
+
+    void find(int target) {
+        DocIterator* lead = positives[0];
+        while (true) {
+            lead->advance(target);
+            int d = lead->doc();
+            if (d == DOC_END) break;
+            target = d;
+            for (size_t i = 1; i < positives.size() && target == d; ++i) {
+                positives[i]->advance(d);
+                target = positives[i]->doc();
+            }
+            if (target == DOC_END) break;
+            if (target != d) continue;
+            for (size_t i = 0; i < negatives.size() && target == d; ++i) {
+                negatives[i]->advance(d);
+                if (negatives[i]->doc() == d) target = d + 1;
+            }
+            if (target == d) {
+                cur = d;
+                return;
+            }
+        }
+        cur = DOC_END;
+    }
+
+public:
+    AndIterator(Vector<DocIterator*> pos, Vector<DocIterator*> neg)
+        : positives(std::move(pos)), negatives(std::move(neg)), cur(-1) {
+        find(0);
+    }
+    ~AndIterator() override {
+        for (size_t i = 0; i < positives.size(); ++i) delete positives[i];
+        for (size_t i = 0; i < negatives.size(); ++i) delete negatives[i];
+    }
+    int doc() const override { return cur; }
+    void next() override {
+        if (cur != DOC_END) find(cur + 1);
+    }
+    void advance(int target) override {
+        if (target > cur) find(target);
+    }
+    uint64_t cost() const override { return positives[0]->cost(); }
+};
+
+class OrIterator : public DocIterator {
+    Vector<DocIterator*> children;
+    int cur;
+
+    void update() {
+        cur = DOC_END;
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (children[i]->doc() < cur) cur = children[i]->doc();
+        }
+    }
+
+public:
+    OrIterator(Vector<DocIterator*> nodes) : children(std::move(nodes)) { update(); }
+    ~OrIterator() override {
+        for (size_t i = 0; i < children.size(); ++i) delete children[i];
+    }
+    int doc() const override { return cur; }
+    void next() override {
+        if (cur == DOC_END) return;
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (children[i]->doc() == cur) children[i]->next();
+        }
+        update();
+    }
+    void advance(int target) override {
+        if (target <= cur) return;
+        for (size_t i = 0; i < children.size(); ++i) children[i]->advance(target);
+        update();
+    }
+    uint64_t cost() const override {
+        uint64_t total = 0;
+        for (size_t i = 0; i < children.size(); ++i) total += children[i]->cost();
+        return total;
+    }
+};
+
+// Phrase or NEAR over plain terms: a doc-level conjunction led by the
+// rarest term, whose candidates are then checked against positions.
+class PositionalIterator : public DocIterator {
+    Vector<PostingCursor> terms;
+    Vector<size_t> order;
+    Vector<Vector<uint32_t>> positions;
+    Vector<size_t> heads;
+    bool phrase;
+    int distance;
+    int cur;
+
+    // Some start p with p + i among the positions of term i, for every i.
+    bool match_phrase() {
+        for (size_t i = 0; i < heads.size(); ++i) heads[i] = 0;
+        const Vector<uint32_t>& first = positions[0];
+        for (size_t j = 0; j < first.size(); ++j) {
+            bool ok = true;
+            for (size_t i = 1; i < positions.size() && ok; ++i) {
+                const Vector<uint32_t>& list = positions[i];
+                uint32_t want = first[j] + (uint32_t)i;
+                while (heads[i] < list.size() && list[heads[i]] < want) heads[i]++;
+                if (heads[i] == list.size()) return false;
+                ok = list[heads[i]] == want;
+            }
+            if (ok) return true;
+        }
+        return false;
+    }
+
+    // Some choice of one position per term spanning at most `distance`.
+    bool match_window() {
+        for (size_t i = 0; i < heads.size(); ++i) heads[i] = 0;
+        while (true) {
+            size_t low = 0;
+            uint32_t lo = UINT32_MAX, hi = 0;
+            for (size_t i = 0; i < positions.size(); ++i) {
+                uint32_t p = positions[i][heads[i]];
+                if (p < lo) {
+                    lo = p;
+                    low = i;
+                }
+                if (p > hi) hi = p;
+            }
+            if (hi - lo <= (uint32_t)distance) return true;
+            if (++heads[low] == positions[low].size()) return false;
+        }
+    }
+
+    void find(int target) {
+        PostingCursor& lead = terms[order[0]];
+        while (true) {
+            lead.advance(target);
+            int d = lead.doc();
+            if (d == DOC_END) break;
+            target = d;
+            for (size_t i = 1; i < order.size() && target == d; ++i) {
+                terms[order[i]].advance(d);
+                target = terms[order[i]].doc();
+            }
+            if (target == DOC_END) break;
+            if (target != d) continue;
+            for (size_t i = 0; i < terms.size(); ++i) terms[i].positions(positions[i]);
+            if (phrase ? match_phrase() : match_window()) {
+                cur = d;
+                return;
+            }
+            target = d + 1;
+        }
+        cur = DOC_END;
+    }
+
+public:
+    PositionalIterator(Vector<PostingCursor> cursors, bool phrase, int distance)
+        : terms(std::move(cursors)), order(terms.size()), positions(terms.size()), heads(terms.size()),
+          phrase(phrase), distance(distance), cur(-1) {
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [this](size_t x, size_t y) { return terms[x].df() < terms[y].df(); });
+        find(0);
+    }
+    int doc() const override { return cur; }
+    void next() override {
+        if (cur != DOC_END) find(cur + 1);
+    }
+    void advance(int target) override {
+        if (target > cur) find(target);
+    }
+    uint64_t cost() const override { return terms[order[0]].df(); }
+};
+
+// Builds an AND node. If the two cheapest operands are plain terms of
+// similar df they are fused into a BlockAndIterator.
+inline DocIterator* make_and(Vector<DocIterator*> positives, Vector<DocIterator*> negatives) {
+    std::sort(positives.begin(), positives.end(), [](const DocIterator* x, const DocIterator* y) {
+        return x->cost() < y->cost();
+    });
+    if (positives.size() >= 2) {
+        PostingCursor* a = positives[0]->term_cursor();
+        PostingCursor* b = positives[1]->term_cursor();
+        if (a && b && b->df() / (a->df() + 1) < GALLOP_RATIO) {
+            DocIterator* fused = new BlockAndIterator(*a, *b);
+            delete positives[0];
+            delete positives[1];
+            Vector<DocIterator*> rest;
+            rest.push_back(fused);
+            for (size_t i = 2; i < positives.size(); ++i) rest.push_back(positives[i]);
+            positives = std::move(rest);
+        }
+    }
+    if (positives.size() == 1 && negatives.empty()) return positives[0];
+    return new AndIterator(std::move(positives), std::move(negatives));
+}
+
+inline bool doc_deleted(const uint64_t* deleted, int doc) { return (deleted[doc >> 6] >> (doc & 63)) & 1; }
+
+// Drops the documents set in a deleted-docs bitmap from the matches of
+// `inner`, which it owns. Rankers only score what the query tree yields,
+// so wrapping the root is enough to hide deleted documents.
+class LiveIterator : public DocIterator {
+    DocIterator* inner;
+    const uint64_t* deleted;
+
+    void skip() {
+        while (inner->doc() != DOC_END && doc_deleted(deleted, inner->doc())) inner->next();
+    }
+
+public:
+    LiveIterator(DocIterator* inner, const uint64_t* deleted) : inner(inner), deleted(deleted) { skip(); }
+    ~LiveIterator() override { delete inner; }
+    int doc() const override { return inner->doc(); }
+    void next() override {
+        inner->next();
+        skip();
+    }
+    void advance(int target) override {
+        inner->advance(target);
+        skip();
+    }
+    uint64_t cost() const override { return inner->cost(); }
+};
+
+// Without a positions stream phrases and NEAR fall back to plain AND. A
+// PREFIX or FUZZY left by expand_terms() matches nothing.
+inline DocIterator* compile_query(const QueryNode* node, const IndexReader& index) {
+    if (node->type == QueryNode::TERM) return new TermIterator(index.postings(node->term));
+    if (node->type == QueryNode::PREFIX || node->type == QueryNode::FUZZY) return new TermIterator(PostingCursor());
+    if ((node->type == QueryNode::PHRASE || node->type == QueryNode::NEAR) && index.has_positions()) {
+        Vector<PostingCursor> cursors;
+        for (size_t i = 0; i < node->children.size(); ++i) cursors.push_back(index.postings(node->children[i]->term));
+        return new PositionalIterator(std::move(cursors), node->type == QueryNode::PHRASE, node->distance);
+    }
+
+    Vector<DocIterator*> positives, negatives;
+    if (node->type == QueryNode::NOT) {
+        negatives.push_back(compile_query(node->children[0], index));
+    } else if (node->type == QueryNode::OR) {
+        for (size_t i = 0; i < node->children.size(); ++i) positives.push_back(compile_query(node->children[i], index));
+        return new OrIterator(std::move(positives));
+    } else {
+        for (size_t i = 0; i < node->children.size(); ++i) {
+            const QueryNode* child = node->children[i];
+            if (child->type == QueryNode::NOT) negatives.push_back(compile_query(child->children[0], index));
+            else positives.push_back(compile_query(child, index));
+        }
+    }
+    if (positives.empty()) positives.push_back(new AllIterator((int)index.num_docs()));
+    return make_and(std::move(positives), std::move(negatives));
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef QUERY_CACHE_HPP
+#define QUERY_CACHE_HPP
+
+#include <string>
+#include <cstdint>
+#include "custom_stl.hpp"
+
+// Bounded segmented LRU cache of query results keyed by normalized query
+// text. New entries start in a probation segment and move to the protected
+// segment on their second hit, so a burst of one-off queries only evicts
+// other one-off queries. Entries belong to one index generation; looking up
+// or inserting with another generation empties the cache first.
+// Largest capacity; entry slots are allocated up front.
+const size_t MAX_QUERY_CACHE = 1 << 20;
+
+template<typename V>
+class QueryCache {
+    struct Entry {
+        std::string key;
+        uint64_t hash;
+        V value;
+        int prev;
+        int next;
+        int segment;
+    };
+
+    enum { PROBATION, PROTECTED };
+
+    Vector<Entry> entries;
+    // Open addressing over entry indices, -1 for an empty slot.
+    Vector<int> table;
+    size_t capacity;
+    size_t protected_capacity;
+    size_t used;
+    int head[2];
+    int tail[2];
+    size_t count[2];
+    uint64_t generation;
+    uint64_t hit_count;
+    uint64_t miss_count;
+    uint64_t invalidation_count;
+
+    size_t mask() const { return table.size() - 1; }
+
+    int lookup(const std::string& key, uint64_t h) const {
+        for (size_t i = (size_t)h & mask();; i = (i + 1) & mask()) {
+            int e = table[i];
+            if (e < 0) return -1;
+            if (entries[e].hash == h && entries[e].key == key) return e;
+        }
+    }
+
+    void table_insert(int e) {
+        size_t i = (size_t)entries[e].hash & mask();
+        while (table[i] >= 0) i = (i + 1) & mask();
+        table[i] = e;
+    }
+
+    // Backward-shift deletion keeps probe sequences unbroken.
+    void table_erase(int e) {
+        size_t i = (size_t)entries[e].hash & mask();
+        while (table[i] != e) i = (i + 1) & mask();
+        for (size_t j = (i + 1) & mask(); table[j] >= 0; j = (j + 1) & mask()) {
+            size_t home = (size_t)entries[table[j]].hash & mask();
+            if (((j - home) & mask()) >= ((j - i) & mask())) {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i] = -1;
+    }
+
+    void unlink(int e) {
+        Entry& entry = entries[e];
+        if (entry.prev >= 0) entries[entry.prev].next = entry.next;
+        else head[entry.segment] = entry.next;
+        if (entry.next >= 0) entries[entry.next].prev = entry.prev;
+        else tail[entry.segment] = entry.prev;
+        count[entry.segment]--;
+    }
+
+    void push_front(int e, int segment) {
+        Entry& entry = entries[e];
+        entry.segment = segment;
+        entry.prev = -1;
+        entry.next = head[segment];
+        if (head[segment] >= 0) entries[head[segment]].prev = e;
+        else tail[segment] = e;
+        head[segment] = e;
+        count[segment]++;
+    }
+
+    void touch(int e) {
+        unlink(e);
+        push_front(e, PROTECTED);
+        if (count[PROTECTED] > protected_capacity) {
+            int demoted = tail[PROTECTED];
+            unlink(demoted);
+            push_front(demoted, PROBATION);
+        }
+    }
+
+    void sync(uint64_t current) {
+        if (current == generation) return;
+        if (used > 0) invalidation_count++;
+        clear();
+        generation = current;
+    }
+
+public:
+    // `capacity` is capped at MAX_QUERY_CACHE.
+    QueryCache(size_t capacity)
+        : capacity(capacity < MAX_QUERY_CACHE ? capacity : MAX_QUERY_CACHE),
+          protected_capacity(this->capacity - this->capacity / 5), used(0), generation(0),
+          hit_count(0), miss_count(0), invalidation_count(0) {
+        size_t n = 16;
+        while (n < this->capacity * 2) n *= 2;
+        entries = Vector<Entry>(this->capacity);
+        table = Vector<int>(n);
+        clear();
+    }
+
+    // Returns the cached value or nullptr; the pointer is valid until the
+    // next insert().
+    const V* find(const std::string& key, uint64_t current) {
+        sync(current);
+        int e = capacity ? lookup(key, hash_bytes(key.data(), key.size())) : -1;
+        if (e < 0) {
+            miss_count++;
+            return nullptr;
+        }
+        hit_count++;
+        touch(e);
+        return &entries[e].value;
+    }
+
+    void insert(const std::string& key, uint64_t current, const V& value) {
+        sync(current);
+        if (capacity == 0) return;
+        uint64_t h = hash_bytes(key.data(), key.size());
+        int e = lookup(key, h);
+        if (e >= 0) {
+            entries[e].value = value;
+            touch(e);
+            return;
+        }
+        if (used < capacity) {
+            e = (int)used++;
+        } else {
+            e = tail[PROBATION] >= 0 ? tail[PROBATION] : tail[PROTECTED];
+            table_erase(e);
+            unlink(e);
+        }
+        entries[e].key = key;
+        entries[e].hash = h;
+        entries[e].value = value;
+        push_front(e, PROBATION);
+        table_insert(e);
+    }
+
+    void clear() {
+        for (size_t i = 0; i < table.size(); ++i) table[i] = -1;
+        for (size_t i = 0; i < used; ++i) {
+            entries[i].key.clear();
+            entries[i].value = V();
+        }
+        used = 0;
+        head[PROBATION] = head[PROTECTED] = -1;
+        tail[PROBATION] = tail[PROTECTED] = -1;
+        count[PROBATION] = count[PROTECTED] = 0;
+    }
+
+    size_t size() const { return used; }
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+    uint64_t invalidations() const { return invalidation_count; }
+};
+
+#endif
@@ -0,0 +1,327 @@
+#ifndef RANKING_HPP
+#define RANKING_HPP
+
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include "custom_stl.hpp"
+#include "postings.hpp"
+#include "index_format.hpp"
+#include "query.hpp"
+#include "metrics.hpp"
+
+struct SearchResult {
+    int doc_id;
+    double score;
+};
+
+// Keeps the k best results seen so far; on equal scores the smaller doc
+// id wins. The worst kept result sits on top of the heap.
+class TopK {
+    Vector<SearchResult> heap;
+    size_t k;
+
+    static bool better(const SearchResult& a, const SearchResult& b) {
+        return a.score > b.score || (a.score == b.score && a.doc_id < b.doc_id);
+    }
+
+public:
+    // The heap grows as results arrive, so a large k costs nothing up front.
+    TopK(size_t k) : k(k) { heap.reserve(k < 64 ? k : 64); }
+
+    size_t capacity() const { return k; }
+
+    // Score a new result must exceed to enter once the heap is full.
+    double threshold() const { return heap.size() < k ? -HUGE_VAL : heap[0].score; }
+
+    void push(int doc_id, double score) {
+        SearchResult r;
+        r.doc_id = doc_id;
+        r.score = score;
+        if (heap.size() < k) {
+            heap.push_back(r);
+            std::push_heap(heap.begin(), heap.end(), better);
+        } else if (k > 0 && better(r, heap[0])) {
+            std::pop_heap(heap.begin(), heap.end(), better);
+            heap[k - 1] = r;
+            std::push_heap(heap.begin(), heap.end(), better);
+        }
+    }
+
+    // Offers every result `other` kept, e.g. to merge the top k of shards
+    // that were searched apart.
+    void merge(const TopK& other) {
+        for (size_t i = 0; i < other.heap.size(); ++i) push(other.heap[i].doc_id, other.heap[i].score);
+    }
+
+    Vector<SearchResult> sorted() {
+        StageTimer timer(STAGE_SORT);
+        std::sort(heap.begin(), heap.end(), better);
+        return heap;
+    }
+};
+
+// Collection-wide statistics that scores are computed from. For a
+// segmented index they are summed over all segments, so a document scores
+// the same whichever segment holds it.
+struct CollectionStats {
+    uint64_t num_docs;
+    double avg_doc_length;
+    Vector<std::string> terms;
+    Vector<uint32_t> dfs;
+
+    CollectionStats() : num_docs(0), avg_doc_length(0.0) {}
+
+    // Adds the document frequencies of `query_terms` in `index`.
+    void add_dfs(const IndexReader& index, const Vector<std::string>& query_terms) {
+        for (size_t i = 0; i < query_terms.size(); ++i) {
+            bool repeated = false;
+            for (size_t j = 0; j < i && !repeated; ++j) repeated = query_terms[j] == query_terms[i];
+            if (repeated) continue;
+            size_t t = 0;
+            while (t < terms.size() && terms[t] != query_terms[i]) t++;
+            if (t == terms.size()) {
+                terms.push_back(query_terms[i]);
+                dfs.push_back(0);
+            }
+            size_t found = index.find(query_terms[i]);
+            if (found != IndexReader::npos) dfs[t] += index.df(found);
+        }
+    }
+
+    uint32_t df(const std::string& term) const {
+        for (size_t t = 0; t < terms.size(); ++t) {
+            if (terms[t] == term) return dfs[t];
+        }
+        return 0;
+    }
+};
+
+inline CollectionStats collection_stats(const IndexReader& index, const Vector<std::string>& terms) {
+    CollectionStats stats;
+    stats.num_docs = index.num_docs();
+    stats.avg_doc_length = index.avg_doc_length();
+    stats.add_dfs(index, terms);
+    return stats;
+}
+
+// Document-at-a-time tf-idf ranking: every match of the query tree is
+// scored as soon as it is produced, with one cursor per query token that
+// only moves forward, and offered to `top` under its global id (`base`
+// plus the id in `index`). Returns the number of matches.
+inline size_t rank_segment(DocIterator& matches, const Vector<std::string>& terms, const IndexReader& index,
+                           const CollectionStats& stats, int base, TopK& top) {
+    Vector<PostingCursor> cursors;
+    Vector<double> idfs;
+    for (size_t j = 0; j < terms.size(); ++j) {
+        PostingCursor postings = index.postings(terms[j]);
+        if (postings.at_end()) continue;
+        double df = (double)stats.df(terms[j]);
+        idfs.push_back(std::log10((double)stats.num_docs / (df + 1.0)));
+        cursors.push_back(postings);
+    }
+
+    size_t total = 0;
+    for (; matches.doc() != DOC_END; matches.next()) {
+        int d = matches.doc();
+        double score = 0.0;
+        for (size_t j = 0; j < cursors.size(); ++j) {
+            cursors[j].advance(d);
+            if (cursors[j].doc() == d) score += (double)cursors[j].tf() * idfs[j];
+        }
+        top.push(base + d, score);
+        total++;
+    }
+    return total;
+}
+
+// rank_segment() over a single index of `total_docs` documents; `total`
+// receives the number of matches.
+inline Vector<SearchResult> rank_results(DocIterator& matches, const Vector<std::string>& terms, const IndexReader& index,
+                                         int total_docs, size_t k, size_t& total) {
+    CollectionStats stats = collection_stats(index, terms);
+    stats.num_docs = (uint64_t)total_docs;
+    TopK top(k);
+    total = rank_segment(matches, terms, index, stats, 0, top);
+    return top.sorted();
+}
+
+const double BM25_K1 = 1.2;
+const double BM25_B = 0.75;
+
+struct BM25 {
+    double num_docs;
+    double avgdl;
+
+    BM25(const CollectionStats& stats) : num_docs((double)stats.num_docs), avgdl(stats.avg_doc_length) {
+        if (avgdl <= 0.0) avgdl = 1.0;
+    }
+
+    double idf(uint32_t df) const { return std::log(1.0 + (num_docs - df + 0.5) / (df + 0.5)); }
+
+    // Grows with tf and falls with dl, so (max_tf, min_dl) bounds a block.
+    double tf_part(uint32_t tf, uint32_t dl) const {
+        return tf * (BM25_K1 + 1.0) / (tf + BM25_K1 * (1.0 - BM25_B + BM25_B * dl / avgdl));
+    }
+};
+
+struct ScoreTerm {
+    std::string term;
+    PostingCursor cursor;
+    double weight;
+    double max_score;
+};
+
+// Block-Max WAND over the scoring terms of the query, with the query tree
+// as a filter on the candidates. Documents are visited in doc id order; a
+// candidate is decoded and scored only if the block bounds of the terms
+// that can contain it exceed the current top-k threshold. Terms every match
+// must contain are required, which turns conjunctions into leapfrog
+// intersections. Queries that can match documents without any scoring term
+// (a bare NOT) are scored exhaustively. Results go to `top` under their
+// global ids (`base` plus the id in `index`), so one TopK can collect
+// several segments and its threshold carries over from one to the next.
+// Returns the number of documents scored.
+inline size_t search_bm25_segment(const QueryNode& query, DocIterator& matches, const IndexReader& index,
+                                  const CollectionStats& stats, int base, TopK& top) {
+    BM25 bm25(stats);
+    Vector<std::string> tokens;
+    scoring_terms(&query, tokens);
+    Vector<std::string> names;
+    Vector<int> counts;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        size_t n = 0;
+        while (n < names.size() && names[n] != tokens[i]) n++;
+        if (n == names.size()) {
+            names.push_back(tokens[i]);
+            counts.push_back(0);
+        }
+        counts[n]++;
+    }
+
+    Vector<ScoreTerm> terms;
+    for (size_t n = 0; n < names.size(); ++n) {
+        PostingCursor cursor = index.postings(names[n]);
+        if (cursor.at_end()) continue;
+        ScoreTerm t;
+        t.term = names[n];
+        t.cursor = cursor;
+        t.weight = counts[n] * bm25.idf(stats.df(names[n]));
+        t.max_score = t.weight * bm25.tf_part(cursor.max_tf(), cursor.min_dl());
+        terms.push_back(t);
+    }
+
+    size_t evaluated = 0;
+    if (top.capacity() == 0) return 0;
+
+    if (!matches_need_terms(&query)) {
+        for (; matches.doc() != DOC_END; matches.next()) {
+            int d = matches.doc();
+            uint32_t dl = index.doc_length(d);
+            double score = 0.0;
+            for (size_t t = 0; t < terms.size(); ++t) {
+                terms[t].cursor.advance(d);
+                if (terms[t].cursor.doc() == d) {
+                    score += terms[t].weight * bm25.tf_part((uint32_t)terms[t].cursor.tf(), dl);
+                }
+            }
+            top.push(base + d, score);
+            evaluated++;
+        }
+        return evaluated;
+    }
+
+    Vector<std::string> must = required_terms(&query);
+    Vector<PostingCursor*> required;
+    for (size_t r = 0; r < must.size(); ++r) {
+        size_t t = 0;
+        while (t < terms.size() && terms[t].term != must[r]) t++;
+        if (t == terms.size()) return 0;
+        required.push_back(&terms[t].cursor);
+    }
+
+    Vector<ScoreTerm*> order;
+    for (size_t t = 0; t < terms.size(); ++t) order.push_back(&terms[t]);
+
+    while (true) {
+        for (size_t i = 1; i < order.size(); ++i) {
+            ScoreTerm* t = order[i];
+            size_t j = i;
+            while (j > 0 && order[j - 1]->cursor.doc() > t->cursor.doc()) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = t;
+        }
+        size_t live = order.size();
+        while (live > 0 && order[live - 1]->cursor.at_end()) live--;
+
+        double theta = top.threshold();
+        double bound = 0.0;
+        size_t pivot = live;
+        for (size_t i = 0; i < live; ++i) {
+            bound += order[i]->max_score;
+            if (bound > theta) {
+                pivot = i;
+                break;
+            }
+        }
+        if (pivot == live) break;
+        int d = order[pivot]->cursor.doc();
+        while (pivot + 1 < live && order[pivot + 1]->cursor.doc() == d) pivot++;
+
+        int target = d;
+        for (size_t r = 0; r < required.size(); ++r) {
+            if (required[r]->doc() > target) target = required[r]->doc();
+        }
+        if (target == DOC_END) break;
+
+        if (target == d) {
+            double block_bound = 0.0;
+            int boundary = DOC_END;
+            for (size_t i = 0; i <= pivot; ++i) {
+                PostingCursor& c = order[i]->cursor;
+                if (!c.seek_block(d)) continue;
+                block_bound += order[i]->weight * bm25.tf_part(c.block_max_tf(), c.block_min_dl());
+                if (c.block_last() < boundary) boundary = c.block_last();
+            }
+            if (block_bound > theta) {
+                if (order[0]->cursor.doc() == d) {
+                    matches.advance(d);
+                    if (matches.doc() == d) {
+                        double score = 0.0;
+                        uint32_t dl = index.doc_length(d);
+                        for (size_t i = 0; i <= pivot; ++i) {
+                            score += order[i]->weight * bm25.tf_part((uint32_t)order[i]->cursor.tf(), dl);
+                        }
+                        top.push(base + d, score);
+                        evaluated++;
+                    }
+                    for (size_t i = 0; i <= pivot; ++i) order[i]->cursor.next();
+                    continue;
+                }
+            } else {
+                target = boundary == DOC_END ? DOC_END : boundary + 1;
+                if (pivot + 1 < live && order[pivot + 1]->cursor.doc() < target) target = order[pivot + 1]->cursor.doc();
+            }
+        }
+        for (size_t i = 0; i < live; ++i) {
+            if (order[i]->cursor.doc() < target) order[i]->cursor.advance(target);
+        }
+    }
+    return evaluated;
+}
+
+// search_bm25_segment() over a single index; `evaluated` receives the
+// number of documents scored.
+inline Vector<SearchResult> search_bm25(const QueryNode& query, DocIterator& matches, const IndexReader& index, size_t k,
+                                        size_t& evaluated) {
+    Vector<std::string> terms;
+    scoring_terms(&query, terms);
+    CollectionStats stats = collection_stats(index, terms);
+    TopK top(k);
+    evaluated = search_bm25_segment(query, matches, index, stats, 0, top);
+    return top.sorted();
+}
+
+#endif
@@ -0,0 +1,363 @@
+#ifndef SEGMENTS_HPP
+#define SEGMENTS_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "custom_stl.hpp"
+#include "index_format.hpp"
+#include "doc_store.hpp"
+#include "forward_store.hpp"
+
+// Segmented index. A manifest next to the main index file lists the index
+// files (segments) that together form the logical index, each covering a
+// contiguous range of global doc ids:
+//
+//   generation 7
+//   next 12
+//   segment index.bin 0 35000
+//   segment seg_10.bin 35000 812
+//   segment seg_11.bin 35812 95 seg_11.bin.7.del 3
+//
+// Segment files are named relative to the manifest's directory and list
+// their own documents from 0; a document's global id is the segment's
+// base plus its local id. A segment with deleted documents also names its
+// deleted-docs bitmap and how many of the deleted documents still have
+// postings in the segment file. Bitmaps are never modified in place: a
+// delete writes a new one named after the new generation. The manifest is
+// only ever replaced whole (written aside and renamed), so readers see
+// either the old or the new set of segments. Writers serialize on a lock
+// file next to it.
+
+struct SegmentInfo {
+    std::string file;
+    uint64_t base;
+    uint64_t docs;
+    std::string deletes;
+    uint64_t dead;
+
+    SegmentInfo() : base(0), docs(0), dead(0) {}
+};
+
+struct Manifest {
+    uint64_t generation;
+    uint64_t next_segment;
+    Vector<SegmentInfo> segments;
+
+    Manifest() : generation(0), next_segment(0) {}
+
+    uint64_t num_docs() const {
+        return segments.empty() ? 0 : segments[segments.size() - 1].base + segments[segments.size() - 1].docs;
+    }
+};
+
+inline std::string manifest_path(const std::string& index_file) { return index_file + ".manifest"; }
+
+// Directory part of `path`, with a trailing slash, or "" for a bare name.
+inline std::string dir_of(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+}
+
+inline std::string base_name(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+inline bool file_exists(const std::string& path) { return ::access(path.c_str(), F_OK) == 0; }
+
+inline bool read_manifest(const std::string& path, Manifest& manifest, std::string& error) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        error = "cannot open " + path;
+        return false;
+    }
+    manifest = Manifest();
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "generation") {
+            fields >> manifest.generation;
+        } else if (key == "next") {
+            fields >> manifest.next_segment;
+        } else if (key == "segment") {
+            SegmentInfo info;
+            fields >> info.file >> info.base >> info.docs;
+            if (!fields.fail() && fields >> info.deletes) fields >> info.dead;
+            else fields.clear();
+            if (fields.fail() || info.base != manifest.num_docs()) {
+                error = "bad segment entry in " + path + ": " + line;
+                return false;
+            }
+            manifest.segments.push_back(info);
+        } else if (!key.empty()) {
+            error = "unknown manifest entry in " + path + ": " + line;
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool write_manifest(const std::string& path, const Manifest& manifest) {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if (!out.is_open()) return false;
+        out << "generation " << manifest.generation << "\n";
+        out << "next " << manifest.next_segment << "\n";
+        for (size_t i = 0; i < manifest.segments.size(); ++i) {
+            const SegmentInfo& s = manifest.segments[i];
+            out << "segment " << s.file << " " << s.base << " " << s.docs;
+            if (!s.deletes.empty()) out << " " << s.deletes << " " << s.dead;
+            out << "\n";
+        }
+        out.flush();
+        if (!out) return false;
+    }
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// Reads the manifest of `index_file`, or describes a plain index without
+// one as its only segment.
+inline bool load_manifest(const std::string& index_file, Manifest& manifest, std::string& error) {
+    std::string path = manifest_path(index_file);
+    if (file_exists(path)) return read_manifest(path, manifest, error);
+    IndexReader reader;
+    if (!reader.open(index_file, false, error)) return false;
+    manifest = Manifest();
+    SegmentInfo info;
+    info.file = base_name(index_file);
+    info.docs = reader.num_docs();
+    manifest.segments.push_back(info);
+    return true;
+}
+
+// Deleted-docs bitmaps are raw 64-bit words, bit d of the file set if local
+// document d of the segment is deleted.
+inline bool read_bitmap(const std::string& path, uint64_t docs, Vector<uint64_t>& bits, std::string& error) {
+    size_t words = (size_t)((docs + 63) / 64);
+    bits = Vector<uint64_t>(words);
+    std::ifstream in(path, std::ios::binary);
+    if (words > 0) in.read((char*)bits.begin(), (std::streamsize)(words * sizeof(uint64_t)));
+    if (!in) {
+        error = "cannot read deleted docs bitmap " + path;
+        return false;
+    }
+    return true;
+}
+
+inline bool write_bitmap(const std::string& path, const Vector<uint64_t>& bits) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write((const char*)bits.begin(), (std::streamsize)(bits.size() * sizeof(uint64_t)));
+    out.close();
+    return !out.fail();
+}
+
+inline uint64_t count_bits(const Vector<uint64_t>& bits) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < bits.size(); ++i) n += (uint64_t)__builtin_popcountll(bits[i]);
+    return n;
+}
+
+// Exclusive advisory lock on `path` (created if needed), released on
+// destruction. With `wait` false, locked() tells whether it was acquired.
+// The file stays behind: removing it would let a waiting process lock a
+// file that the next one no longer finds.
+class FileLock {
+    int fd;
+
+public:
+    FileLock(const std::string& path, bool wait = true) : fd(::open(path.c_str(), O_RDWR | O_CREAT, 0644)) {
+        if (fd >= 0 && ::flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+    ~FileLock() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool locked() const { return fd >= 0; }
+};
+
+// All segments of an index, opened together with their doc and forward
+// stores. Without a manifest the index file alone is the only segment.
+class SegmentedIndex {
+    Vector<IndexReader*> readers;
+    Vector<DocStore*> stores;
+    Vector<ForwardStore*> texts;
+    Vector<int> bases;
+    Vector<Vector<uint64_t>> deletes;
+    uint64_t docs;
+    uint64_t deleted;
+    uint64_t total_length;
+    uint64_t manifest_generation;
+    uint64_t loaded;
+
+    void close() {
+        for (size_t i = 0; i < readers.size(); ++i) delete readers[i];
+        for (size_t i = 0; i < stores.size(); ++i) delete stores[i];
+        for (size_t i = 0; i < texts.size(); ++i) delete texts[i];
+        readers.clear();
+        stores.clear();
+        texts.clear();
+        bases.clear();
+        deletes.clear();
+        docs = 0;
+        deleted = 0;
+        total_length = 0;
+        loaded = 0;
+    }
+
+    bool add(const std::string& file, uint64_t base, bool verify, std::string& error) {
+        IndexReader* reader = new IndexReader;
+        if (!reader->open(file, verify, error)) {
+            delete reader;
+            return false;
+        }
+        readers.push_back(reader);
+        // Indexes built before doc stores existed have none; their
+        // documents just have no metadata.
+        DocStore* store = new DocStore;
+        stores.push_back(store);
+        std::string store_file = doc_store_path(file);
+        if (file_exists(store_file)) {
+            if (!store->open(store_file, error)) return false;
+            if (store->size() != reader->num_docs()) {
+                error = store_file + " does not match " + file;
+                return false;
+            }
+        }
+        // Likewise for document texts.
+        ForwardStore* text = new ForwardStore;
+        texts.push_back(text);
+        std::string text_file = forward_store_path(file);
+        if (file_exists(text_file)) {
+            if (!text->open(text_file, error)) return false;
+            if (text->size() != reader->num_docs()) {
+                error = text_file + " does not match " + file;
+                return false;
+            }
+        }
+        bases.push_back((int)base);
+        deletes.push_back(Vector<uint64_t>());
+        docs = base + reader->num_docs();
+        total_length += reader->total_length();
+        return true;
+    }
+
+public:
+    SegmentedIndex() : docs(0), deleted(0), total_length(0), manifest_generation(0), loaded(0) {}
+    SegmentedIndex(const SegmentedIndex&) = delete;
+    SegmentedIndex& operator=(const SegmentedIndex&) = delete;
+    ~SegmentedIndex() { close(); }
+
+    bool open(const std::string& index_file, bool verify, std::string& error) {
+        close();
+        std::string path = manifest_path(index_file);
+        if (!file_exists(path)) {
+            manifest_generation = 0;
+            if (!add(index_file, 0, verify, error)) return false;
+        } else {
+            Manifest manifest;
+            if (!read_manifest(path, manifest, error)) return false;
+            if (manifest.segments.empty()) {
+                error = path + " lists no segments";
+                return false;
+            }
+            manifest_generation = manifest.generation;
+            std::string dir = dir_of(index_file);
+            for (size_t i = 0; i < manifest.segments.size(); ++i) {
+                const SegmentInfo& s = manifest.segments[i];
+                if (!add(dir + s.file, s.base, verify, error)) {
+                    close();
+                    return false;
+                }
+                if (readers[i]->num_docs() != s.docs) {
+                    error = s.file + " does not match the manifest";
+                    close();
+                    return false;
+                }
+                if (!s.deletes.empty()) {
+                    if (!read_bitmap(dir + s.deletes, s.docs, deletes[i], error)) {
+                        close();
+                        return false;
+                    }
+                    deleted += count_bits(deletes[i]);
+                }
+            }
+        }
+        loaded = readers[readers.size() - 1]->generation();
+        return true;
+    }
+
+    size_t num_segments() const { return readers.size(); }
+    const IndexReader& segment(size_t i) const { return *readers[i]; }
+    // Global id of the first document of segment `i`.
+    int base(size_t i) const { return bases[i]; }
+    const DocStore& doc_store(size_t i) const { return *stores[i]; }
+    const ForwardStore& forward_store(size_t i) const { return *texts[i]; }
+
+    // Segment holding global doc id `doc`.
+    size_t segment_of(int doc) const {
+        size_t lo = 0, hi = bases.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (bases[mid] <= doc) lo = mid;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    // Deleted-docs bitmap of segment `i`, or nullptr if none are deleted.
+    const uint64_t* deleted_docs(size_t i) const { return deletes[i].empty() ? nullptr : deletes[i].begin(); }
+
+    // Includes deleted documents, which keep their ids.
+    uint64_t num_docs() const { return docs; }
+    uint64_t num_deleted() const { return deleted; }
+    double avg_doc_length() const { return docs ? (double)total_length / docs : 0.0; }
+    uint64_t version() const { return manifest_generation; }
+    // Changes with every open(), like IndexReader::generation().
+    uint64_t generation() const { return loaded; }
+
+    bool has_positions() const {
+        for (size_t i = 0; i < readers.size(); ++i) {
+            if (!readers[i]->has_positions()) return false;
+        }
+        return true;
+    }
+
+    // Distinct terms over all segments, counted by merging their
+    // dictionaries.
+    size_t size() const {
+        if (readers.size() == 1) return readers[0]->size();
+        Vector<TermCursor> cursors;
+        for (size_t i = 0; i < readers.size(); ++i) cursors.push_back(readers[i]->terms());
+        size_t n = 0;
+        while (true) {
+            size_t first = cursors.size();
+            for (size_t i = 0; i < cursors.size(); ++i) {
+                if (!cursors[i].at_end() && (first == cursors.size() || cursors[i].term() < cursors[first].term())) {
+                    first = i;
+                }
+            }
+            if (first == cursors.size()) return n;
+            n++;
+            for (size_t i = 0; i < cursors.size(); ++i) {
+                if (i != first && !cursors[i].at_end() && cursors[i].term() == cursors[first].term()) cursors[i].next();
+            }
+            cursors[first].next();
+        }
+    }
+};
+
+#endif
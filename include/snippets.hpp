@@ -0,0 +1,215 @@
+#ifndef SNIPPETS_HPP
+#define SNIPPETS_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "custom_stl.hpp"
+#include "tokenizer.hpp"
+
+// Query-time snippets: the document is tokenized again, tokens whose stem is
+// a query term are located by their byte ranges, and the windows holding
+// the most distinct terms (then the most matches) are cut out with the
+// matches wrapped in the given markers.
+
+const size_t SNIPPET_FRAGMENT_BYTES = 160;
+const size_t SNIPPET_FRAGMENTS = 2;
+// Only the beginning of a long document is decompressed and searched.
+const size_t SNIPPET_SCAN_BYTES = 16384;
+
+struct SnippetMatch {
+    size_t begin;
+    size_t end;
+    uint64_t term_bit;
+};
+
+// Start of the UTF-8 sequence holding byte `i`.
+inline size_t utf8_start(std::string_view text, size_t i) {
+    while (i > 0 && i < text.size() && ((unsigned char)text[i] & 0xC0) == 0x80) i--;
+    return i;
+}
+
+// Appends text[begin, end) with whitespace runs folded to one space and
+// the matches inside it highlighted.
+inline void append_fragment(std::string& out, std::string_view text, size_t begin, size_t end,
+                            const Vector<SnippetMatch>& matches, const char* open, const char* close) {
+    size_t m = 0;
+    while (m < matches.size() && matches[m].begin < begin) m++;
+    bool space = false;
+    for (size_t i = begin; i < end;) {
+        if (m < matches.size() && matches[m].begin == i && matches[m].end <= end) {
+            if (space) out += ' ';
+            space = false;
+            out += open;
+            out.append(text.data() + i, matches[m].end - i);
+            out += close;
+            i = matches[m++].end;
+            continue;
+        }
+        char c = text[i++];
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            space = true;
+            continue;
+        }
+        if (space) out += ' ';
+        space = false;
+        out += c;
+    }
+}
+
+// Stems `text[begin, end)`, a single word starting with a query term, and
+// records it if the stem is one of `terms`.
+inline void match_word(std::string_view text, size_t begin, size_t end, const Vector<std::string>& terms,
+                       size_t num_terms, Vector<SnippetMatch>& matches) {
+    thread_tokenizer().tokenize(text.substr(begin, end - begin), [&](const Token& token) {
+        for (size_t t = 0; t < num_terms; ++t) {
+            if (token.term != terms[t]) continue;
+            SnippetMatch match;
+            match.begin = begin + token.begin;
+            match.end = begin + token.end;
+            match.term_bit = 1ULL << t;
+            matches.push_back(match);
+            return;
+        }
+    });
+}
+
+// Matches of the stemmed `terms` in `text`, in text order. A stem is a
+// prefix of its folded word, so words are folded and checked against the
+// terms letter by letter, and only those starting with a term are handed
+// to the tokenizer to be stemmed. Terms after the 64th are not looked for.
+inline void find_matches(std::string_view text, const Vector<std::string>& terms, Vector<SnippetMatch>& matches) {
+    const LetterTable& letters = letter_table();
+    Vector<std::u32string> prefixes;
+    for (size_t t = 0; t < terms.size() && t < 64; ++t) {
+        std::u32string prefix;
+        for (size_t i = 0; i < terms[t].size();) prefix.push_back(decode_utf8(terms[t], i));
+        prefixes.push_back(prefix);
+    }
+    size_t num_terms = prefixes.size();
+    uint64_t alive = 0;
+    size_t length = 0, begin = 0;
+    for (size_t i = 0; i < text.size();) {
+        size_t start = i;
+        uint32_t lower;
+        unsigned char c = (unsigned char)text[i];
+        if (c < 0x80) {
+            i++;
+            lower = letters.lower[c];
+        } else if ((c & 0xe0) == 0xc0 && i + 1 < text.size() && ((unsigned char)text[i + 1] & 0xc0) == 0x80) {
+            // Two-byte sequences (Cyrillic) without the general decoder.
+            lower = letters.fold(((c & 0x1f) << 6) | ((unsigned char)text[i + 1] & 0x3f));
+            i += 2;
+        } else {
+            lower = letters.fold(decode_utf8(text, i));
+        }
+        if (lower) {
+            if (length == 0) {
+                begin = start;
+                alive = 0;
+                for (size_t t = 0; t < num_terms; ++t) {
+                    if (prefixes[t][0] == lower) alive |= 1ULL << t;
+                }
+            } else if (alive) {
+                for (uint64_t live = alive; live; live &= live - 1) {
+                    size_t t = (size_t)__builtin_ctzll(live);
+                    if (length < prefixes[t].size() && prefixes[t][length] != lower) alive &= ~(1ULL << t);
+                }
+            }
+            length++;
+            continue;
+        }
+        if (length == 0) continue;
+        for (uint64_t live = alive; live; live &= live - 1) {
+            if (length < prefixes[(size_t)__builtin_ctzll(live)].size()) continue;
+            match_word(text, begin, start, terms, num_terms, matches);
+            break;
+        }
+        length = 0;
+    }
+    for (uint64_t live = length ? alive : 0; live; live &= live - 1) {
+        if (length < prefixes[(size_t)__builtin_ctzll(live)].size()) continue;
+        match_word(text, begin, text.size(), terms, num_terms, matches);
+        break;
+    }
+}
+
+// Up to `fragments` highlighted fragments of `text` for the stemmed query
+// `terms`, joined by "...". A text without matches yields its beginning.
+inline std::string make_snippet(std::string_view text, const Vector<std::string>& terms, const char* open,
+                                const char* close, size_t fragments = SNIPPET_FRAGMENTS,
+                                size_t fragment_bytes = SNIPPET_FRAGMENT_BYTES) {
+    Vector<SnippetMatch> matches;
+    find_matches(text, terms, matches);
+
+    // Greedily takes the best window of matches, then sets aside the
+    // matches close enough to it to end up in the same fragment.
+    Vector<Pair<size_t, size_t>> windows;
+    Vector<char> used(matches.size());
+    for (size_t i = 0; i < used.size(); ++i) used[i] = 0;
+    while (windows.size() < fragments) {
+        size_t best_first = 0, best_last = 0, best_score = 0;
+        for (size_t i = 0; i < matches.size(); ++i) {
+            if (used[i]) continue;
+            uint64_t seen = 0;
+            size_t j = i;
+            for (; j < matches.size() && !used[j] && matches[j].end - matches[i].begin <= fragment_bytes; ++j) {
+                seen |= matches[j].term_bit;
+            }
+            size_t score = (size_t)__builtin_popcountll(seen) * 1024 + (j - i);
+            if (score > best_score) {
+                best_score = score;
+                best_first = i;
+                best_last = j - 1;
+            }
+        }
+        if (best_score == 0) break;
+        windows.push_back(Pair<size_t, size_t>(best_first, best_last));
+        for (size_t i = 0; i < matches.size(); ++i) {
+            if (matches[i].end + fragment_bytes > matches[best_first].begin &&
+                matches[i].begin < matches[best_last].end + fragment_bytes) {
+                used[i] = 1;
+            }
+        }
+    }
+    for (size_t a = 1; a < windows.size(); ++a) {
+        for (size_t b = a; b > 0 && windows[b].first < windows[b - 1].first; --b) {
+            Pair<size_t, size_t> t = windows[b];
+            windows[b] = windows[b - 1];
+            windows[b - 1] = t;
+        }
+    }
+
+    std::string out;
+    size_t last_end = 0;
+    if (windows.empty()) windows.push_back(Pair<size_t, size_t>(SIZE_MAX, SIZE_MAX));
+    for (size_t w = 0; w < windows.size(); ++w) {
+        size_t span_begin = 0, span_end = 0;
+        if (windows[w].first != SIZE_MAX) {
+            span_begin = matches[windows[w].first].begin;
+            span_end = matches[windows[w].second].end;
+        }
+        // Centre the matches in the fragment and cut at spaces.
+        size_t slack = fragment_bytes - (span_end - span_begin);
+        size_t begin = span_begin > slack / 2 ? span_begin - slack / 2 : 0;
+        if (begin < last_end) begin = last_end;
+        size_t end = begin + fragment_bytes < text.size() ? begin + fragment_bytes : text.size();
+        if (end < span_end) end = span_end;
+        if (begin > 0) {
+            size_t space = text.find(' ', begin);
+            begin = space != std::string_view::npos && space < span_begin ? space + 1 : utf8_start(text, begin);
+        }
+        if (end < text.size()) {
+            size_t space = text.rfind(' ', end);
+            end = space != std::string_view::npos && space > span_end ? space : utf8_start(text, end);
+        }
+        if (begin > 0 && begin != last_end) out += "...";
+        else if (w > 0) out += ' ';
+        append_fragment(out, text, begin, end, matches, open, close);
+        last_end = end;
+    }
+    if (last_end < text.size()) out += "...";
+    return out;
+}
+
+#endif
@@ -1,13 +1,12 @@
 #ifndef TOKENIZER_HPP
 #define TOKENIZER_HPP
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
-#include <algorithm>
-#include <clocale>
-#include <cwctype>
-#include <cstdlib>
+#include "custom_stl.hpp"
 
 struct TokenStats {
     long long total_tokens = 0;
@@ -15,30 +14,237 @@ struct TokenStats {
     std::map<std::string, int> frequency;
 };
 
-inline std::wstring utf8_to_wstring(const std::string& str) {
-    if (str.empty()) return std::wstring();
-    size_t len = std::mbstowcs(nullptr, str.c_str(), 0);
-    if (len == (size_t)-1) return std::wstring();
-    std::wstring wstr(len, 0);
-    std::mbstowcs(&wstr[0], str.c_str(), len);
-    return wstr;
+// Decodes one UTF-8 sequence starting at text[i] and advances i. Malformed
+// input yields U+FFFD and consumes a single byte.
+inline uint32_t decode_utf8(std::string_view text, size_t& i) {
+    unsigned char c = (unsigned char)text[i];
+    if (c < 0x80) {
+        i += 1;
+        return c;
+    }
+    size_t len;
+    uint32_t cp;
+    if ((c & 0xe0) == 0xc0) { len = 2; cp = c & 0x1f; }
+    else if ((c & 0xf0) == 0xe0) { len = 3; cp = c & 0x0f; }
+    else if ((c & 0xf8) == 0xf0) { len = 4; cp = c & 0x07; }
+    else {
+        i += 1;
+        return 0xfffd;
+    }
+    if (i + len > text.size()) {
+        i += 1;
+        return 0xfffd;
+    }
+    for (size_t k = 1; k < len; ++k) {
+        unsigned char cc = (unsigned char)text[i + k];
+        if ((cc & 0xc0) != 0x80) {
+            i += 1;
+            return 0xfffd;
+        }
+        cp = (cp << 6) | (cc & 0x3f);
+    }
+    i += len;
+    return cp;
+}
+
+inline void append_utf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back((char)cp);
+    } else if (cp < 0x800) {
+        out.push_back((char)(0xc0 | (cp >> 6)));
+        out.push_back((char)(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        out.push_back((char)(0xe0 | (cp >> 12)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back((char)(0x80 | (cp & 0x3f)));
+    } else {
+        out.push_back((char)(0xf0 | (cp >> 18)));
+        out.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back((char)(0x80 | (cp & 0x3f)));
+    }
+}
+
+// Letter classes and lower-case mapping for Latin, Greek and Cyrillic
+// (U+0000..U+052F), matching the glibc UTF-8 locales for those blocks.
+// Kana, CJK ideographs and Hangul count as caseless letters; everything
+// else separates tokens.
+struct LetterTable {
+    static const uint32_t LIMIT = 0x530;
+    uint16_t lower[LIMIT];
+
+    static bool in(uint32_t c, uint32_t lo, uint32_t hi) { return c >= lo && c <= hi; }
+
+    static bool is_letter(uint32_t c) {
+        return in(c, 0x41, 0x5a) || in(c, 0x61, 0x7a) || c == 0xaa || c == 0xb5 || c == 0xba ||
+               in(c, 0xc0, 0xd6) || in(c, 0xd8, 0xf6) || in(c, 0xf8, 0x2c1) || in(c, 0x2c6, 0x2d1) ||
+               in(c, 0x2e0, 0x2e4) || c == 0x2ec || c == 0x2ee || c == 0x345 || in(c, 0x370, 0x374) ||
+               in(c, 0x376, 0x377) || in(c, 0x37a, 0x37d) || c == 0x37f || c == 0x386 ||
+               in(c, 0x388, 0x38a) || c == 0x38c || in(c, 0x38e, 0x3a1) || in(c, 0x3a3, 0x3f5) ||
+               in(c, 0x3f7, 0x481) || in(c, 0x48a, 0x52f);
+    }
+
+    static uint32_t to_lower(uint32_t c) {
+        bool even = (c & 1) == 0;
+        if (in(c, 0x41, 0x5a) || (in(c, 0xc0, 0xde) && c != 0xd7)) return c + 0x20;
+        if (c == 0x130) return 0x69;
+        if (c == 0x178) return 0xff;
+        if ((in(c, 0x100, 0x137) || in(c, 0x14a, 0x177)) && even) return c + 1;
+        if ((in(c, 0x139, 0x148) || in(c, 0x179, 0x17e) || in(c, 0x1cd, 0x1dc)) && !even) return c + 1;
+        if ((in(c, 0x1de, 0x1ef) || in(c, 0x1f8, 0x21f) || in(c, 0x222, 0x233) || in(c, 0x246, 0x24f)) && even) return c + 1;
+        if (in(c, 0x370, 0x373) || c == 0x376) return even ? c + 1 : c;
+        if (c == 0x37f) return 0x3f3;
+        if (c == 0x386) return 0x3ac;
+        if (in(c, 0x388, 0x38a)) return c + 0x25;
+        if (c == 0x38c) return 0x3cc;
+        if (in(c, 0x38e, 0x38f)) return c + 0x3f;
+        if (in(c, 0x391, 0x3a1) || in(c, 0x3a3, 0x3ab)) return c + 0x20;
+        if (c == 0x3cf) return 0x3d7;
+        if (in(c, 0x3d8, 0x3ef) && even) return c + 1;
+        if (c == 0x3f4) return 0x3b8;
+        if (c == 0x3f7 || c == 0x3fa) return c + 1;
+        if (c == 0x3f9) return 0x3f2;
+        if (in(c, 0x3fd, 0x3ff)) return c - 0x82;
+        if (in(c, 0x400, 0x40f)) return c + 0x50;
+        if (in(c, 0x410, 0x42f)) return c + 0x20;
+        if ((in(c, 0x460, 0x481) || in(c, 0x48a, 0x4bf) || in(c, 0x4d0, 0x52f)) && even) return c + 1;
+        if (c == 0x4c0) return 0x4cf;
+        if (in(c, 0x4c1, 0x4ce) && !even) return c + 1;
+        return c;
+    }
+
+    LetterTable() {
+        for (uint32_t c = 0; c < LIMIT; ++c) lower[c] = is_letter(c) ? (uint16_t)to_lower(c) : 0;
+        // Latin Extended-B has no regular case pairing.
+        static const uint16_t irregular[][2] = {
+            {0x181, 0x253}, {0x182, 0x183}, {0x184, 0x185}, {0x186, 0x254}, {0x187, 0x188}, {0x189, 0x256},
+            {0x18a, 0x257}, {0x18b, 0x18c}, {0x18e, 0x1dd}, {0x18f, 0x259}, {0x190, 0x25b}, {0x191, 0x192},
+            {0x193, 0x260}, {0x194, 0x263}, {0x196, 0x269}, {0x197, 0x268}, {0x198, 0x199}, {0x19c, 0x26f},
+            {0x19d, 0x272}, {0x19f, 0x275}, {0x1a0, 0x1a1}, {0x1a2, 0x1a3}, {0x1a4, 0x1a5}, {0x1a6, 0x280},
+            {0x1a7, 0x1a8}, {0x1a9, 0x283}, {0x1ac, 0x1ad}, {0x1ae, 0x288}, {0x1af, 0x1b0}, {0x1b1, 0x28a},
+            {0x1b2, 0x28b}, {0x1b3, 0x1b4}, {0x1b5, 0x1b6}, {0x1b7, 0x292}, {0x1b8, 0x1b9}, {0x1bc, 0x1bd},
+            {0x1c4, 0x1c6}, {0x1c5, 0x1c6}, {0x1c7, 0x1c9}, {0x1c8, 0x1c9}, {0x1ca, 0x1cc}, {0x1cb, 0x1cc},
+            {0x1f1, 0x1f3}, {0x1f2, 0x1f3}, {0x1f4, 0x1f5}, {0x1f6, 0x195}, {0x1f7, 0x1bf}, {0x220, 0x19e},
+            {0x23a, 0x2c65}, {0x23b, 0x23c}, {0x23d, 0x19a}, {0x23e, 0x2c66}, {0x241, 0x242}, {0x243, 0x180},
+            {0x244, 0x289}, {0x245, 0x28c},
+        };
+        for (size_t i = 0; i < sizeof(irregular) / sizeof(irregular[0]); ++i) {
+            lower[irregular[i][0]] = irregular[i][1];
+        }
+    }
+
+    // Lower-case form of a letter, 0 for anything else.
+    uint32_t fold(uint32_t c) const {
+        if (c < LIMIT) return lower[c];
+        if (in(c, 0x3040, 0x9fff) || in(c, 0xac00, 0xd7a3)) return c;
+        return 0;
+    }
+};
+
+inline const LetterTable& letter_table() {
+    static const LetterTable table;
+    return table;
+}
+
+// Index of a lower-case Russian letter (а..я -> 0..31, ё -> 32), -1 otherwise.
+constexpr int russian_letter(wchar_t c) {
+    return (c >= L'а' && c <= L'я') ? (int)(c - L'а') : (c == L'ё' ? 32 : -1);
 }
 
-inline std::string wstring_to_utf8(const std::wstring& wstr) {
-    if (wstr.empty()) return std::string();
-    size_t len = std::wcstombs(nullptr, wstr.c_str(), 0);
-    if (len == (size_t)-1) return std::string();
-    std::string str(len, 0);
-    std::wcstombs(&str[0], wstr.c_str(), len);
-    return str;
+template <size_t N>
+constexpr size_t total_length(const wchar_t* const (&suffixes)[N]) {
+    size_t total = 0;
+    for (size_t i = 0; i < N; ++i) {
+        for (const wchar_t* p = suffixes[i]; *p; ++p) total++;
+    }
+    return total;
 }
 
+// Reverse trie over a suffix list, built at compile time. One backward
+// walk over the word visits every listed suffix the word ends with.
+template <size_t MaxNodes>
+struct SuffixAutomaton {
+    uint8_t next[MaxNodes][33];
+    int8_t id[MaxNodes];
+
+    template <size_t N>
+    constexpr SuffixAutomaton(const wchar_t* const (&suffixes)[N]) : next(), id() {
+        size_t nodes = 1;
+        for (size_t n = 0; n < MaxNodes; ++n) id[n] = -1;
+        for (size_t i = 0; i < N; ++i) {
+            size_t len = 0;
+            while (suffixes[i][len]) len++;
+            size_t node = 0;
+            for (size_t k = len; k-- > 0;) {
+                int c = russian_letter(suffixes[i][k]);
+                if (!next[node][c]) next[node][c] = (uint8_t)nodes++;
+                node = next[node][c];
+            }
+            if (id[node] < 0) id[node] = (int8_t)i;
+        }
+    }
+
+    // Length of the suffix to strip: among the listed suffixes the word
+    // ends with, the earliest in list order whose remaining stem length
+    // passes `accept`. 0 if there is none.
+    template <typename Accept>
+    size_t match(const std::wstring& word, Accept accept) const {
+        size_t len = word.size();
+        int best = 128;
+        size_t best_len = 0;
+        size_t node = 0;
+        for (size_t k = 1; k <= len; ++k) {
+            int c = russian_letter(word[len - k]);
+            if (c < 0) break;
+            node = next[node][c];
+            if (!node) break;
+            if (id[node] >= 0 && id[node] < best && accept(len - k)) {
+                best = id[node];
+                best_len = k;
+            }
+        }
+        return best_len;
+    }
+};
+
+#define RUSSIAN_SUFFIXES(name, ...)                                                     \
+    static constexpr const wchar_t* name##_list[] = {__VA_ARGS__};                      \
+    static constexpr SuffixAutomaton<total_length(name##_list) + 1> name{name##_list};
+
+struct RussianSuffixes {
+    RUSSIAN_SUFFIXES(perfGerund1, L"вши", L"вшись", L"в") // preceded by a, я
+    RUSSIAN_SUFFIXES(perfGerund2, L"ив", L"ивши", L"ившись", L"ыв", L"ывши", L"ывшись")
+    RUSSIAN_SUFFIXES(reflexive, L"ся", L"сь")
+    RUSSIAN_SUFFIXES(adjective,
+        L"ее", L"ие", L"ые", L"ое", L"ими", L"ыми", L"ей", L"ий", L"ый", L"ой",
+        L"ем", L"им", L"ым", L"ом", L"его", L"ого", L"ему", L"ому", L"их", L"ых",
+        L"ую", L"юю", L"ая", L"яя", L"ою", L"ею")
+    RUSSIAN_SUFFIXES(verb1, // preceded by a, я
+        L"ла", L"на", L"ете", L"йте", L"ли", L"й", L"л", L"ем", L"н", L"ло", L"но",
+        L"ет", L"ют", L"ны", L"ть", L"ешь", L"нно")
+    RUSSIAN_SUFFIXES(verb2,
+        L"ила", L"ыла", L"ена", L"ейте", L"уйте", L"ите", L"или", L"ыли", L"ей",
+        L"уй", L"ил", L"ыл", L"им", L"ым", L"ен", L"ило", L"ыло", L"ено", L"ят",
+        L"ует", L"уют", L"ит", L"ыт", L"ены", L"ить", L"ыть", L"ишь", L"ую", L"ю")
+    RUSSIAN_SUFFIXES(noun,
+        L"а", L"ев", L"ов", L"ие", L"ье", L"е", L"иями", L"ями", L"ами", L"еи",
+        L"ии", L"и", L"ией", L"ей", L"ой", L"ий", L"й", L"иям", L"ям", L"ием",
+        L"ем", L"ам", L"ом", L"о", L"у", L"ах", L"иях", L"ях", L"ы", L"ь", L"ию",
+        L"ью", L"ю", L"ия", L"ья", L"я")
+    RUSSIAN_SUFFIXES(derivational, L"ост", L"ость")
+    RUSSIAN_SUFFIXES(superlative, L"ейше", L"ейш")
+};
+
+#undef RUSSIAN_SUFFIXES
+
 class RussianStemmer {
 private:
-    const std::wstring vowels = L"аеиоуыэюяё";
-
-    bool isVowel(wchar_t c) {
-        return vowels.find(c) != std::wstring::npos;
+    static bool isVowel(wchar_t c) {
+        // а е и о у ы э ю я ё
+        const uint64_t mask = (1ULL << 0) | (1ULL << 5) | (1ULL << 8) | (1ULL << 14) | (1ULL << 19) |
+                              (1ULL << 27) | (1ULL << 29) | (1ULL << 30) | (1ULL << 31) | (1ULL << 32);
+        int i = russian_letter(c);
+        return i >= 0 && ((mask >> i) & 1);
     }
 
     size_t findRV(const std::wstring& word) {
@@ -50,26 +256,25 @@ private:
         return std::wstring::npos;
     }
 
-    bool endsWith(const std::wstring& word, const std::wstring& suffix) {
-        if (word.length() < suffix.length()) return false;
-        return word.compare(word.length() - suffix.length(), suffix.length(), suffix) == 0;
+    template <size_t MaxNodes>
+    static bool removeAny(std::wstring& word, const SuffixAutomaton<MaxNodes>& suffixes, size_t rv) {
+        size_t n = suffixes.match(word, [rv](size_t stem) { return stem >= rv; });
+        word.resize(word.length() - n);
+        return n > 0;
     }
 
-    bool removeEnd(std::wstring& word, const std::wstring& suffix, size_t rv) {
-        if (endsWith(word, suffix)) {
-            if (word.length() - suffix.length() >= rv) {
-                word.resize(word.length() - suffix.length());
-                return true;
-            }
-        }
-        return false;
+    // Suffixes of groups 1 must follow а or я, which stays in the stem.
+    template <size_t MaxNodes>
+    static bool removeAfterA(std::wstring& word, const SuffixAutomaton<MaxNodes>& suffixes, size_t rv) {
+        size_t n = suffixes.match(word, [&word, rv](size_t stem) {
+            return stem >= rv && stem > 0 && (word[stem - 1] == L'а' || word[stem - 1] == L'я');
+        });
+        word.resize(word.length() - n);
+        return n > 0;
     }
 
-    bool removeAny(std::wstring& word, const std::vector<std::wstring>& suffixes, size_t rv) {
-        for (const auto& suffix : suffixes) {
-            if (removeEnd(word, suffix, rv)) return true;
-        }
-        return false;
+    static bool endsWith(const std::wstring& word, wchar_t c) {
+        return !word.empty() && word.back() == c;
     }
 
 public:
@@ -77,94 +282,37 @@ public:
         size_t rv = findRV(word);
         if (rv == std::wstring::npos) return;
 
-        static const std::vector<std::wstring> perfGerund1 = {L"вши", L"вшись", L"в"}; // preceded by a, я
-        static const std::vector<std::wstring> perfGerund2 = {L"ив", L"ивши", L"ившись", L"ыв", L"ывши", L"ывшись"};
-
-        bool step1Success = false;
-        
-        for (const auto& suffix : perfGerund1) {
-            if (endsWith(word, suffix)) {
-                size_t len = word.length() - suffix.length();
-                if (len >= rv && len > 0) {
-                    wchar_t prev = word[len - 1];
-                    if (prev == L'а' || prev == L'я') {
-                        word.resize(len);
-                        step1Success = true;
-                        break;
-                    }
-                }
-            }
-        }
-        
+        bool step1Success = removeAfterA(word, RussianSuffixes::perfGerund1, rv);
         if (!step1Success) {
-            if (removeAny(word, perfGerund2, rv)) step1Success = true;
+            step1Success = removeAny(word, RussianSuffixes::perfGerund2, rv);
         }
 
         if (!step1Success) {
-            static const std::vector<std::wstring> reflexive = {L"ся", L"сь"};
-            removeAny(word, reflexive, rv);
-
-            static const std::vector<std::wstring> adjective = {
-                L"ее", L"ие", L"ые", L"ое", L"ими", L"ыми", L"ей", L"ий", L"ый", L"ой", 
-                L"ем", L"им", L"ым", L"ом", L"его", L"ого", L"ему", L"ому", L"их", L"ых", 
-                L"ую", L"юю", L"ая", L"яя", L"ою", L"ею"
-            };
-            if (!removeAny(word, adjective, rv)) {
-                static const std::vector<std::wstring> verb1 = {
-                    L"ла", L"на", L"ете", L"йте", L"ли", L"й", L"л", L"ем", L"н", L"ло", L"но", 
-                    L"ет", L"ют", L"ны", L"ть", L"ешь", L"нно"
-                }; 
-                static const std::vector<std::wstring> verb2 = {
-                    L"ила", L"ыла", L"ена", L"ейте", L"уйте", L"ите", L"или", L"ыли", L"ей", 
-                    L"уй", L"ил", L"ыл", L"им", L"ым", L"ен", L"ило", L"ыло", L"ено", L"ят", 
-                    L"ует", L"уют", L"ит", L"ыт", L"ены", L"ить", L"ыть", L"ишь", L"ую", L"ю"
-                };
-
-                bool verbRemoved = false;
-                for (const auto& suffix : verb1) {
-                    if (endsWith(word, suffix)) {
-                        size_t len = word.length() - suffix.length();
-                        if (len >= rv && len > 0) {
-                            wchar_t prev = word[len - 1];
-                            if (prev == L'а' || prev == L'я') {
-                                word.resize(len);
-                                verbRemoved = true;
-                                break;
-                            }
-                        }
-                    }
-                }
+            removeAny(word, RussianSuffixes::reflexive, rv);
+
+            if (!removeAny(word, RussianSuffixes::adjective, rv)) {
+                bool verbRemoved = removeAfterA(word, RussianSuffixes::verb1, rv);
                 if (!verbRemoved) {
-                    if (removeAny(word, verb2, rv)) verbRemoved = true;
+                    verbRemoved = removeAny(word, RussianSuffixes::verb2, rv);
                 }
-
                 if (!verbRemoved) {
-                    static const std::vector<std::wstring> noun = {
-                        L"а", L"ев", L"ов", L"ие", L"ье", L"е", L"иями", L"ями", L"ами", L"еи", 
-                        L"ии", L"и", L"ией", L"ей", L"ой", L"ий", L"й", L"иям", L"ям", L"ием", 
-                        L"ем", L"ам", L"ом", L"о", L"у", L"ах", L"иях", L"ях", L"ы", L"ь", L"ию", 
-                        L"ью", L"ю", L"ия", L"ья", L"я"
-                    };
-                    removeAny(word, noun, rv);
+                    removeAny(word, RussianSuffixes::noun, rv);
                 }
             }
         }
 
-        removeEnd(word, L"и", rv);
-
-        static const std::vector<std::wstring> derivational = {L"ост", L"ость"};
-        removeAny(word, derivational, rv);
+        if (endsWith(word, L'и') && word.length() - 1 >= rv) word.pop_back();
 
-        static const std::vector<std::wstring> superlative = {L"ейше", L"ейш"};
-        removeAny(word, superlative, rv);
+        removeAny(word, RussianSuffixes::derivational, rv);
+        removeAny(word, RussianSuffixes::superlative, rv);
 
-        if (endsWith(word, L"нн")) {
+        if (word.length() >= 2 && word[word.length() - 2] == L'н' && word.back() == L'н') {
             if (word.length() - 2 >= rv) {
                 word.pop_back();
             }
         }
         
-        if (endsWith(word, L"ь")) {
+        if (endsWith(word, L'ь')) {
              if (word.length() - 1 >= rv) {
                 word.pop_back();
             }
@@ -172,81 +320,162 @@ public:
     }
 };
 
-inline void tokenize(const std::string& text, TokenStats& stats) {
+// Direct-mapped cache from folded surface forms to stem lengths (a stem is
+// always a prefix of its word). Bounded by its slot count; longer words
+// bypass it.
+class StemCache {
+public:
+    static const size_t MAX_WORD = 24;
+
+private:
+    struct Slot {
+        uint64_t hash;
+        uint8_t word_len;
+        uint8_t stem_len;
+        char16_t word[MAX_WORD];
+    };
+    Vector<Slot> slots;
+    size_t mask;
+
+    static uint64_t hash_word(const std::wstring& word) {
+        uint64_t h = 0x9e3779b97f4a7c15ULL;
+        for (wchar_t c : word) h = hash_mix(h ^ (uint64_t)c, 0xa0761d6478bd642fULL);
+        return h | 1;
+    }
+
+    bool matches(const Slot& slot, uint64_t h, const std::wstring& word) const {
+        if (slot.hash != h || slot.word_len != word.size()) return false;
+        for (size_t i = 0; i < word.size(); ++i) {
+            if (slot.word[i] != (char16_t)word[i]) return false;
+        }
+        return true;
+    }
+
+public:
+    size_t hits;
+    size_t misses;
+
+    StemCache(size_t capacity = 8192) : hits(0), misses(0) {
+        size_t n = 1;
+        while (n < capacity) n *= 2;
+        slots = Vector<Slot>(n);
+        for (size_t i = 0; i < n; ++i) slots[i].hash = 0;
+        mask = n - 1;
+    }
+
+    void stem(RussianStemmer& stemmer, std::wstring& word) {
+        if (word.size() > MAX_WORD) {
+            stemmer.stem(word);
+            return;
+        }
+        for (wchar_t c : word) {
+            if ((uint32_t)c > 0xffff) {
+                stemmer.stem(word);
+                return;
+            }
+        }
+        uint64_t h = hash_word(word);
+        Slot& slot = slots[h & mask];
+        if (matches(slot, h, word)) {
+            hits++;
+            word.resize(slot.stem_len);
+            return;
+        }
+        misses++;
+        slot.hash = h;
+        slot.word_len = (uint8_t)word.size();
+        for (size_t i = 0; i < word.size(); ++i) slot.word[i] = (char16_t)word[i];
+        stemmer.stem(word);
+        slot.stem_len = (uint8_t)word.size();
+    }
+};
+
+struct Token {
+    std::string_view term;  // lower-cased stem; valid until the next token
+    size_t begin;           // byte range of the surface form in the input
+    size_t end;
+};
 
-    std::wstring wtext = utf8_to_wstring(text);
-    std::wstring current_token;
+// Splits UTF-8 text into stemmed tokens. Words are folded and stemmed in
+// buffers owned by the tokenizer, so after warm-up no token allocates.
+// Stems of recently seen words come from the per-tokenizer StemCache.
+class Tokenizer {
     RussianStemmer stemmer;
+    StemCache cache;
+    std::wstring word;
+    std::string term;
+
+public:
+    const StemCache& stem_cache() const { return cache; }
 
-    for (wchar_t c : wtext) {
-        if (std::iswalpha(c)) {
-            current_token += std::towlower(c);
-        } else if (c == L'-' && !current_token.empty()) {
-            if (!current_token.empty()) {
-                stemmer.stem(current_token);
-                std::string token_utf8 = wstring_to_utf8(current_token);
-                
-                stats.total_tokens++;
-                stats.total_length += token_utf8.length();
-                stats.frequency[token_utf8]++;
-                current_token.clear();
+    template <typename F>
+    void tokenize(std::string_view text, F&& on_token) {
+        const LetterTable& letters = letter_table();
+        word.clear();
+        size_t begin = 0, end = 0;
+        size_t i = 0;
+        while (i < text.size()) {
+            size_t start = i;
+            uint32_t lower;
+            unsigned char c = (unsigned char)text[i];
+            if (c < 0x80) {
+                i++;
+                lower = letters.lower[c];
+            } else {
+                lower = letters.fold(decode_utf8(text, i));
             }
-        } else {
-            if (!current_token.empty()) {
-                stemmer.stem(current_token);
-                std::string token_utf8 = wstring_to_utf8(current_token);
-                
-                stats.total_tokens++;
-                stats.total_length += token_utf8.length();
-                stats.frequency[token_utf8]++;
-                current_token.clear();
+            if (lower) {
+                if (word.empty()) begin = start;
+                word.push_back((wchar_t)lower);
+                end = i;
+            } else if (!word.empty()) {
+                emit(begin, end, on_token);
             }
         }
+        if (!word.empty()) emit(begin, end, on_token);
     }
-    
-    if (!current_token.empty()) {
-        stemmer.stem(current_token);
-        std::string token_utf8 = wstring_to_utf8(current_token);
-        
-        stats.total_tokens++;
-        stats.total_length += token_utf8.length();
-        stats.frequency[token_utf8]++;
+
+private:
+    template <typename F>
+    void emit(size_t begin, size_t end, F& on_token) {
+        cache.stem(stemmer, word);
+        term.clear();
+        for (wchar_t c : word) append_utf8(term, (uint32_t)c);
+        word.clear();
+        Token token;
+        token.term = term;
+        token.begin = begin;
+        token.end = end;
+        on_token(token);
     }
+};
+
+inline Tokenizer& thread_tokenizer() {
+    thread_local Tokenizer tokenizer;
+    return tokenizer;
+}
+
+inline void tokenize(const std::string& text, TokenStats& stats) {
+    thread_tokenizer().tokenize(text, [&stats](const Token& token) {
+        stats.total_tokens++;
+        stats.total_length += token.term.size();
+        stats.frequency[std::string(token.term)]++;
+    });
 }
 
 inline std::vector<std::string> tokenize_to_vector(const std::string& text) {
     std::vector<std::string> tokens;
-    std::wstring wtext = utf8_to_wstring(text);
-    std::wstring current_token;
-    RussianStemmer stemmer;
-
-    auto process_token = [&](std::wstring& token) {
-        if (!token.empty()) {
-            stemmer.stem(token);
-            tokens.push_back(wstring_to_utf8(token));
-            token.clear();
-        }
-    };
-
-    for (wchar_t c : wtext) {
-        if (std::iswalpha(c)) {
-            current_token += std::towlower(c);
-        } else if (c == L'-' && !current_token.empty()) {
-             process_token(current_token);
-        } else {
-             process_token(current_token);
-        }
-    }
-    process_token(current_token);
+    thread_tokenizer().tokenize(text, [&tokens](const Token& token) {
+        tokens.push_back(std::string(token.term));
+    });
     return tokens;
 }
 
 template <typename Container>
 void tokenize_to_container(const std::string& text, Container& container) {
-    std::vector<std::string> tokens = tokenize_to_vector(text);
-    for (const auto& token : tokens) {
-        container.push_back(token);
-    }
+    thread_tokenizer().tokenize(text, [&container](const Token& token) {
+        container.push_back(std::string(token.term));
+    });
 }
 
 #endif
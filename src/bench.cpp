@@ -0,0 +1,515 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <filesystem>
+#include "../include/custom_stl.hpp"
+#include "../include/tokenizer.hpp"
+#include "../include/postings.hpp"
+#include "../include/index_format.hpp"
+#include "../include/query.hpp"
+#include "../include/ranking.hpp"
+#include "../include/forward_store.hpp"
+#include "../include/snippets.hpp"
+
+// Benchmark suite. A deterministic Zipf-distributed corpus of Russian-like
+// text and a matching query log are generated from a seed, then timed:
+// tokenize/stem, index build (bin/indexer on the generated corpus), index
+// load, intersection kernels at several length ratios, ranking, end-to-end
+// query latency and snippets for the top results. Results are printed and
+// written as JSON so runs of different builds can be compared.
+
+// Raw generator output only: std:: distributions differ between standard
+// libraries, and the corpus must be the same everywhere for a given seed.
+struct BenchRng {
+    std::mt19937_64 gen;
+
+    BenchRng(uint64_t seed) : gen(seed) {}
+    uint64_t next() { return gen(); }
+    uint64_t below(uint64_t n) { return gen() % n; }
+    double unit() { return (gen() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+// Vocabulary of Cyrillic pseudo-words, each a stem of 2-4 open syllables
+// plus a common inflection, sampled by Zipf rank.
+class ZipfCorpus {
+    Vector<std::string> words;
+    Vector<double> cdf;
+    uint64_t seed;
+
+    static std::string make_word(BenchRng& rng) {
+        static const char* consonants[] = {"б", "в", "г", "д", "ж", "з", "к", "л", "м", "н", "п", "р", "с", "т", "ф", "х", "ц", "ч", "ш"};
+        static const char* vowels[] = {"а", "е", "и", "о", "у", "ы", "я", "ю"};
+        static const char* endings[] = {"", "а", "ы", "ов", "ами", "ого", "ому", "ение", "ость", "ать", "ила", "ский", "ной"};
+        std::string word;
+        int syllables = 2 + (int)rng.below(3);
+        for (int i = 0; i < syllables; ++i) {
+            word += consonants[rng.below(sizeof(consonants) / sizeof(consonants[0]))];
+            word += vowels[rng.below(sizeof(vowels) / sizeof(vowels[0]))];
+        }
+        return word + endings[rng.below(sizeof(endings) / sizeof(endings[0]))];
+    }
+
+public:
+    ZipfCorpus(size_t vocab, double exponent, uint64_t seed) : seed(seed) {
+        BenchRng rng(seed);
+        words.reserve(vocab);
+        cdf.reserve(vocab);
+        double sum = 0.0;
+        for (size_t r = 0; r < vocab; ++r) {
+            words.push_back(make_word(rng));
+            sum += 1.0 / std::pow((double)(r + 1), exponent);
+            cdf.push_back(sum);
+        }
+        for (size_t r = 0; r < vocab; ++r) cdf[r] /= sum;
+    }
+
+    size_t zipf_rank(BenchRng& rng) const {
+        return (size_t)(std::lower_bound(cdf.begin(), cdf.end(), rng.unit()) - cdf.begin());
+    }
+
+    const std::string& word(size_t rank) const { return words[rank < words.size() ? rank : words.size() - 1]; }
+
+    // Document `id` depends only on the seed and the id, so any slice of a
+    // large corpus can be regenerated without the rest.
+    std::string document(size_t id) const {
+        BenchRng rng(seed ^ hash_int(id + 1));
+        size_t length = 40 + rng.below(220);
+        std::string text;
+        for (size_t i = 0; i < length; ++i) {
+            if (i) text += (i % 13 == 0) ? ". " : " ";
+            text += words[zipf_rank(rng)];
+        }
+        return text + ".";
+    }
+
+    // Query mix: single terms, implicit AND of two or three, OR, and
+    // phrases of two words. Very frequent words are skipped as users
+    // rarely search for them alone.
+    Vector<std::string> queries(size_t n) const {
+        BenchRng rng(seed * 31 + 7);
+        Vector<std::string> out;
+        for (size_t i = 0; i < n; ++i) {
+            auto pick = [&]() { return word(10 + zipf_rank(rng)); };
+            uint64_t kind = rng.below(10);
+            if (kind < 4) out.push_back(pick());
+            else if (kind < 7) out.push_back(pick() + " " + pick());
+            else if (kind < 8) out.push_back(pick() + " | " + pick());
+            else if (kind < 9) out.push_back("\"" + pick() + " " + pick() + "\"");
+            else out.push_back(pick() + " " + pick() + " " + pick());
+        }
+        return out;
+    }
+};
+
+// Named groups of numbers, printed as they come and saved as JSON.
+class BenchReport {
+    struct Entry {
+        std::string name;
+        Vector<Pair<std::string, double>> metrics;
+    };
+    Vector<Entry> entries;
+    Vector<Pair<std::string, double>> config;
+
+public:
+    void setting(const std::string& key, double value) { config.push_back(Pair<std::string, double>(key, value)); }
+
+    void add(const std::string& name, const Vector<Pair<std::string, double>>& metrics) {
+        Entry e;
+        e.name = name;
+        e.metrics = metrics;
+        entries.push_back(e);
+        std::cout << name;
+        for (size_t i = 0; i < metrics.size(); ++i) std::cout << "  " << metrics[i].first << "=" << metrics[i].second;
+        std::cout << std::endl;
+    }
+
+    bool write_json(const std::string& filename) const {
+        std::ofstream out(filename);
+        if (!out.is_open()) return false;
+        out << "{\n  \"config\": {";
+        for (size_t i = 0; i < config.size(); ++i) {
+            out << (i ? ", " : "") << "\"" << config[i].first << "\": " << config[i].second;
+        }
+        out << "},\n  \"results\": [\n";
+        for (size_t i = 0; i < entries.size(); ++i) {
+            out << "    {\"name\": \"" << entries[i].name << "\"";
+            for (size_t m = 0; m < entries[i].metrics.size(); ++m) {
+                out << ", \"" << entries[i].metrics[m].first << "\": " << entries[i].metrics[m].second;
+            }
+            out << "}" << (i + 1 < entries.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+        return true;
+    }
+};
+
+typedef Vector<Pair<std::string, double>> Metrics;
+
+Metrics metrics(std::initializer_list<Pair<std::string, double>> list) {
+    Metrics m;
+    for (const Pair<std::string, double>& p : list) m.push_back(p);
+    return m;
+}
+
+double seconds_since(std::chrono::high_resolution_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    return elapsed.count();
+}
+
+double percentile(Vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t rank = (size_t)std::ceil(p * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void bench_tokenize(const ZipfCorpus& corpus, size_t docs, BenchReport& report) {
+    Vector<std::string> texts;
+    size_t bytes = 0;
+    for (size_t d = 0; d < docs; ++d) {
+        texts.push_back(corpus.document(d));
+        bytes += texts[d].size();
+    }
+    // The first pass fills the stem cache, the second one mostly hits it.
+    const char* names[] = {"tokenize_cold", "tokenize_warm"};
+    Tokenizer tokenizer;
+    for (int pass = 0; pass < 2; ++pass) {
+        size_t tokens = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t d = 0; d < texts.size(); ++d) {
+            tokenizer.tokenize(texts[d], [&tokens](const Token&) { tokens++; });
+        }
+        double sec = seconds_since(start);
+        report.add(names[pass], metrics({{"docs", (double)docs}, {"tokens", (double)tokens}, {"sec", sec},
+                                         {"mb_per_sec", bytes / 1e6 / sec}, {"tokens_per_sec", tokens / sec}}));
+    }
+}
+
+bool write_corpus(const ZipfCorpus& corpus, size_t docs, const std::string& filename, size_t& bytes) {
+    std::ofstream out(filename);
+    if (!out.is_open()) return false;
+    bytes = 0;
+    for (size_t d = 0; d < docs; ++d) {
+        std::string text = corpus.document(d);
+        bytes += text.size() + 1;
+        out << text << '\n';
+    }
+    return true;
+}
+
+// Runs the real indexer in `work`, which gets its own data/ directory.
+bool bench_build(const std::string& indexer, const std::string& work, const std::string& corpus_file, size_t docs,
+                 size_t bytes, int threads, BenchReport& report) {
+    std::string cmd = "cd '" + work + "' && mkdir -p data && '" + indexer + "' --threads " + std::to_string(threads) +
+                      " --output index.bin '" + corpus_file + "' > /dev/null";
+    auto start = std::chrono::high_resolution_clock::now();
+    int ret = std::system(cmd.c_str());
+    double sec = seconds_since(start);
+    if (ret != 0) {
+        std::cerr << "Indexer failed: " << cmd << std::endl;
+        return false;
+    }
+    std::error_code ec;
+    double size = (double)std::filesystem::file_size(work + "/index.bin", ec);
+    report.add("index_build_t" + std::to_string(threads),
+               metrics({{"docs", (double)docs}, {"threads", (double)threads}, {"sec", sec}, {"docs_per_sec", docs / sec},
+                        {"mb_per_sec", bytes / 1e6 / sec}, {"index_bytes", size}}));
+    return true;
+}
+
+void bench_load(const std::string& index_file, int repeat, BenchReport& report) {
+    for (int verify = 0; verify < 2; ++verify) {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < repeat; ++r) {
+            IndexReader index;
+            std::string error;
+            if (!index.open(index_file, verify != 0, error)) {
+                std::cerr << "Cannot load " << index_file << ": " << error << std::endl;
+                return;
+            }
+        }
+        report.add(verify ? "index_load_verify" : "index_load",
+                   metrics({{"runs", (double)repeat}, {"ms", seconds_since(start) * 1e3 / repeat}}));
+    }
+}
+
+struct EncodedList {
+    std::string bytes;
+    uint32_t df;
+
+    PostingCursor cursor() const { return PostingCursor(bytes.data(), df); }
+};
+
+EncodedList make_list(std::mt19937& rng, size_t universe, size_t n, const Vector<uint32_t>& doc_lengths) {
+    Vector<char> taken(universe);
+    size_t picked = 0;
+    while (picked < n) {
+        size_t d = rng() % universe;
+        if (!taken[d]) {
+            taken[d] = 1;
+            picked++;
+        }
+    }
+    Vector<Pair<int, int>> postings;
+    postings.reserve(n);
+    for (size_t d = 0; d < universe; ++d) {
+        if (taken[d]) postings.push_back(Pair<int, int>((int)d, 1 + (int)(rng() % 4)));
+    }
+    EncodedList list;
+    list.df = (uint32_t)postings.size();
+    encode_postings(postings.begin(), postings.size(), doc_lengths.begin(), nullptr, list.bytes);
+    return list;
+}
+
+template<typename F>
+double time_us(int repeat, size_t& result_size, F f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < repeat; ++r) result_size = f().size();
+    return seconds_since(start) * 1e6 / repeat;
+}
+
+// Synthetic postings lists: a long list of fixed size against shorter
+// lists at increasing size ratios, for the old decode-and-merge path, the
+// cursor-based kernels in query.hpp and the AND iterator the query compiler
+// builds ("auto").
+bool bench_intersect(size_t universe, size_t long_size, int repeat, BenchReport& report) {
+    if (long_size > universe / 2) long_size = universe / 2;
+    std::mt19937 rng(42);
+    Vector<uint32_t> doc_lengths(universe);
+    EncodedList long_list = make_list(rng, universe, long_size, doc_lengths);
+
+    const size_t ratios[] = {1, 4, 16, 64, 256, 1024, 4096};
+    for (size_t r = 0; r < sizeof(ratios) / sizeof(ratios[0]); ++r) {
+        size_t short_size = long_size / ratios[r];
+        if (short_size == 0) break;
+        EncodedList short_list = make_list(rng, universe, short_size, doc_lengths);
+
+        size_t merged = 0, galloped = 0, blocked = 0, automatic = 0;
+        double merge_us = time_us(repeat, merged, [&]() {
+            PostingCursor a = short_list.cursor(), b = long_list.cursor();
+            return intersect_lists(collect_docs(a), collect_docs(b));
+        });
+        double gallop_us = time_us(repeat, galloped, [&]() {
+            PostingCursor a = short_list.cursor(), b = long_list.cursor();
+            return intersect_gallop(a, b);
+        });
+        double blocks_us = time_us(repeat, blocked, [&]() {
+            PostingCursor a = short_list.cursor(), b = long_list.cursor();
+            return intersect_blocks(a, b);
+        });
+        double auto_us = time_us(repeat, automatic, [&]() {
+            Vector<DocIterator*> terms;
+            terms.push_back(new TermIterator(long_list.cursor()));
+            terms.push_back(new TermIterator(short_list.cursor()));
+            DocIterator* matches = make_and(std::move(terms), Vector<DocIterator*>());
+            Vector<int> result;
+            for (; matches->doc() != DOC_END; matches->next()) result.push_back(matches->doc());
+            delete matches;
+            return result;
+        });
+
+        if (galloped != merged || blocked != merged || automatic != merged) {
+            std::cerr << "Result mismatch at ratio " << ratios[r] << ": " << merged << " " << galloped << " "
+                      << blocked << " " << automatic << std::endl;
+            return false;
+        }
+        report.add("intersect_r" + std::to_string(ratios[r]),
+                   metrics({{"long", (double)long_size}, {"short", (double)short_size}, {"result", (double)merged},
+                            {"merge_us", merge_us}, {"gallop_us", gallop_us}, {"blocks_us", blocks_us},
+                            {"auto_us", auto_us}}));
+    }
+    return true;
+}
+
+// Ranking alone, on queries parsed up front, for both scoring modes.
+void bench_rank(const IndexReader& index, const Vector<std::string>& queries, size_t k, BenchReport& report) {
+    Vector<QueryNode*> trees;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        std::string error;
+        QueryNode* tree = parse_query(queries[i], error);
+        if (tree) trees.push_back(tree);
+    }
+    for (int bm25 = 0; bm25 < 2; ++bm25) {
+        size_t matched = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < trees.size(); ++i) {
+            DocIterator* matches = compile_query(trees[i], index);
+            size_t total = 0;
+            if (bm25) {
+                search_bm25(*trees[i], *matches, index, k, total);
+            } else {
+                Vector<std::string> terms;
+                scoring_terms(trees[i], terms);
+                rank_results(*matches, terms, index, (int)index.num_docs(), k, total);
+            }
+            matched += total;
+            delete matches;
+        }
+        double sec = seconds_since(start);
+        report.add(bm25 ? "rank_bm25" : "rank_tfidf",
+                   metrics({{"queries", (double)trees.size()}, {"us_per_query", sec * 1e6 / trees.size()},
+                            {"scored", (double)matched}}));
+    }
+    for (size_t i = 0; i < trees.size(); ++i) delete trees[i];
+}
+
+// What the searcher does per query: parse, compile, rank.
+void bench_queries(const IndexReader& index, const Vector<std::string>& queries, size_t k, BenchReport& report) {
+    Vector<double> latencies;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < queries.size(); ++i) {
+        auto q_start = std::chrono::high_resolution_clock::now();
+        std::string error;
+        QueryNode* tree = parse_query(queries[i], error);
+        if (tree) {
+            DocIterator* matches = compile_query(tree, index);
+            Vector<std::string> terms;
+            scoring_terms(tree, terms);
+            size_t total = 0;
+            rank_results(*matches, terms, index, (int)index.num_docs(), k, total);
+            delete matches;
+            delete tree;
+        }
+        latencies.push_back(seconds_since(q_start) * 1e6);
+    }
+    double sec = seconds_since(start);
+    std::sort(latencies.begin(), latencies.end());
+    report.add("query_e2e", metrics({{"queries", (double)queries.size()}, {"qps", queries.size() / sec},
+                                     {"p50_us", percentile(latencies, 0.50)}, {"p95_us", percentile(latencies, 0.95)},
+                                     {"p99_us", percentile(latencies, 0.99)}}));
+}
+
+// Snippets for the top k of each query: the forward store reads and the
+// highlighting the searcher adds after ranking.
+void bench_snippets(const IndexReader& index, const ForwardStore& texts, const Vector<std::string>& queries, size_t k,
+                    BenchReport& report) {
+    Vector<double> latencies;
+    std::string block;
+    size_t results = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        std::string error;
+        QueryNode* tree = parse_query(queries[i], error);
+        if (!tree) continue;
+        DocIterator* matches = compile_query(tree, index);
+        Vector<std::string> terms;
+        scoring_terms(tree, terms);
+        size_t total = 0;
+        Vector<SearchResult> top = rank_results(*matches, terms, index, (int)index.num_docs(), k, total);
+        delete matches;
+        delete tree;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t r = 0; r < top.size(); ++r) {
+            std::string_view text = texts.text(top[r].doc_id, block, SNIPPET_SCAN_BYTES);
+            make_snippet(text, terms, "<b>", "</b>");
+        }
+        latencies.push_back(seconds_since(start) * 1e6);
+        results += top.size();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    report.add("snippets_top" + std::to_string(k),
+               metrics({{"queries", (double)latencies.size()}, {"results", (double)results},
+                        {"p50_us", percentile(latencies, 0.50)}, {"p95_us", percentile(latencies, 0.95)},
+                        {"p99_us", percentile(latencies, 0.99)}}));
+}
+
+int main(int argc, char* argv[]) {
+    size_t docs = 20000;
+    size_t vocab = 50000;
+    double exponent = 1.0;
+    uint64_t seed = 42;
+    size_t num_queries = 2000;
+    size_t universe = 1 << 22;
+    size_t long_size = 1 << 20;
+    int repeat = 20;
+    int threads = 4;
+    std::string json_file = "bench_results.json";
+    std::string corpus_out;
+    std::string work = (std::filesystem::temp_directory_path() / "inf-search-bench").string();
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--docs" && i + 1 < argc) docs = (size_t)std::atoll(argv[++i]);
+        else if (arg == "--vocab" && i + 1 < argc) vocab = (size_t)std::atoll(argv[++i]);
+        else if (arg == "--zipf" && i + 1 < argc) exponent = std::atof(argv[++i]);
+        else if (arg == "--seed" && i + 1 < argc) seed = (uint64_t)std::atoll(argv[++i]);
+        else if (arg == "--queries" && i + 1 < argc) num_queries = (size_t)std::atoll(argv[++i]);
+        else if (arg == "--universe" && i + 1 < argc) universe = (size_t)std::atoll(argv[++i]);
+        else if (arg == "--long" && i + 1 < argc) long_size = (size_t)std::atoll(argv[++i]);
+        else if (arg == "--repeat" && i + 1 < argc) repeat = std::atoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc) threads = std::atoi(argv[++i]);
+        else if (arg == "--json" && i + 1 < argc) json_file = argv[++i];
+        else if (arg == "--work" && i + 1 < argc) work = argv[++i];
+        else if (arg == "--corpus-out" && i + 1 < argc) corpus_out = argv[++i];
+    }
+    if (docs == 0 || vocab == 0) {
+        std::cerr << "--docs and --vocab must be positive" << std::endl;
+        return 1;
+    }
+
+    ZipfCorpus corpus(vocab, exponent, seed);
+    Vector<std::string> queries = corpus.queries(num_queries);
+
+    // Generation only: corpus.txt in indexer format plus queries.txt.
+    if (!corpus_out.empty()) {
+        size_t bytes = 0;
+        if (!write_corpus(corpus, docs, corpus_out, bytes)) {
+            std::cerr << "Cannot write " << corpus_out << std::endl;
+            return 1;
+        }
+        std::ofstream q_out(corpus_out + ".queries");
+        for (size_t i = 0; i < queries.size(); ++i) q_out << queries[i] << '\n';
+        std::cout << "Wrote " << docs << " docs (" << bytes << " bytes) to " << corpus_out << " and "
+                  << queries.size() << " queries to " << corpus_out << ".queries" << std::endl;
+        return 0;
+    }
+
+    BenchReport report;
+    report.setting("docs", (double)docs);
+    report.setting("vocab", (double)vocab);
+    report.setting("zipf", exponent);
+    report.setting("seed", (double)seed);
+    report.setting("queries", (double)num_queries);
+
+    bench_tokenize(corpus, docs < 5000 ? docs : 5000, report);
+
+    std::filesystem::create_directories(work);
+    std::string corpus_file = work + "/corpus.txt";
+    std::string indexer = (std::filesystem::absolute(argv[0]).parent_path() / "indexer").string();
+    size_t bytes = 0;
+    if (!write_corpus(corpus, docs, corpus_file, bytes)) {
+        std::cerr << "Cannot write " << corpus_file << std::endl;
+        return 1;
+    }
+    if (!bench_build(indexer, work, corpus_file, docs, bytes, 1, report)) return 1;
+    if (threads > 1 && !bench_build(indexer, work, corpus_file, docs, bytes, threads, report)) return 1;
+    std::string index_file = work + "/index.bin";
+    bench_load(index_file, 10, report);
+
+    if (!bench_intersect(universe, long_size, repeat, report)) return 1;
+
+    IndexReader index;
+    std::string error;
+    if (!index.open(index_file, false, error)) {
+        std::cerr << "Cannot load " << index_file << ": " << error << std::endl;
+        return 1;
+    }
+    bench_rank(index, queries, 10, report);
+    bench_queries(index, queries, 10, report);
+    ForwardStore texts;
+    if (!texts.open(forward_store_path(index_file), error)) {
+        std::cerr << "Cannot load forward store: " << error << std::endl;
+        return 1;
+    }
+    bench_snippets(index, texts, queries, 10, report);
+
+    if (!report.write_json(json_file)) {
+        std::cerr << "Cannot write " << json_file << std::endl;
+        return 1;
+    }
+    std::cout << "Results written to " << json_file << std::endl;
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include "../include/custom_stl.hpp"
+#include "../include/tokenizer.hpp"
+#include "../include/corpus.hpp"
+
+// Regression check for the Russian stemmer. The table-driven RussianStemmer
+// and the Tokenizer with its StemCache are compared against the original
+// list-scanning stemmer, kept below as the reference, on
+//   - every term of a vocabulary file (index_data.txt: "term:postings"),
+//   - every term followed by every suffix the stemmer knows, and by the
+//     verb suffixes plus a reflexive ending,
+//   - every distinct word of the corpora given, text or binary.
+// Exits non-zero and lists the first differences if any word stems
+// differently.
+
+class ReferenceStemmer {
+    const std::wstring vowels = L"аеиоуыэюяё";
+
+    bool isVowel(wchar_t c) const { return vowels.find(c) != std::wstring::npos; }
+
+    size_t findRV(const std::wstring& word) const {
+        for (size_t i = 0; i < word.length(); ++i) {
+            if (isVowel(word[i])) return i + 1;
+        }
+        return std::wstring::npos;
+    }
+
+    static bool endsWith(const std::wstring& word, const std::wstring& suffix) {
+        if (word.length() < suffix.length()) return false;
+        return word.compare(word.length() - suffix.length(), suffix.length(), suffix) == 0;
+    }
+
+    static bool removeEnd(std::wstring& word, const std::wstring& suffix, size_t rv) {
+        if (endsWith(word, suffix) && word.length() - suffix.length() >= rv) {
+            word.resize(word.length() - suffix.length());
+            return true;
+        }
+        return false;
+    }
+
+    static bool removeAny(std::wstring& word, const std::vector<std::wstring>& suffixes, size_t rv) {
+        for (const auto& suffix : suffixes) {
+            if (removeEnd(word, suffix, rv)) return true;
+        }
+        return false;
+    }
+
+    // Suffixes that must follow а or я, which stays in the stem.
+    static bool removeAfterA(std::wstring& word, const std::vector<std::wstring>& suffixes, size_t rv) {
+        for (const auto& suffix : suffixes) {
+            if (!endsWith(word, suffix)) continue;
+            size_t len = word.length() - suffix.length();
+            if (len >= rv && len > 0 && (word[len - 1] == L'а' || word[len - 1] == L'я')) {
+                word.resize(len);
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    const std::vector<std::wstring> perfGerund1 = {L"вши", L"вшись", L"в"};
+    const std::vector<std::wstring> perfGerund2 = {L"ив", L"ивши", L"ившись", L"ыв", L"ывши", L"ывшись"};
+    const std::vector<std::wstring> reflexive = {L"ся", L"сь"};
+    const std::vector<std::wstring> adjective = {
+        L"ее", L"ие", L"ые", L"ое", L"ими", L"ыми", L"ей", L"ий", L"ый", L"ой",
+        L"ем", L"им", L"ым", L"ом", L"его", L"ого", L"ему", L"ому", L"их", L"ых",
+        L"ую", L"юю", L"ая", L"яя", L"ою", L"ею"};
+    const std::vector<std::wstring> verb1 = {
+        L"ла", L"на", L"ете", L"йте", L"ли", L"й", L"л", L"ем", L"н", L"ло", L"но",
+        L"ет", L"ют", L"ны", L"ть", L"ешь", L"нно"};
+    const std::vector<std::wstring> verb2 = {
+        L"ила", L"ыла", L"ена", L"ейте", L"уйте", L"ите", L"или", L"ыли", L"ей",
+        L"уй", L"ил", L"ыл", L"им", L"ым", L"ен", L"ило", L"ыло", L"ено", L"ят",
+        L"ует", L"уют", L"ит", L"ыт", L"ены", L"ить", L"ыть", L"ишь", L"ую", L"ю"};
+    const std::vector<std::wstring> noun = {
+        L"а", L"ев", L"ов", L"ие", L"ье", L"е", L"иями", L"ями", L"ами", L"еи",
+        L"ии", L"и", L"ией", L"ей", L"ой", L"ий", L"й", L"иям", L"ям", L"ием",
+        L"ем", L"ам", L"ом", L"о", L"у", L"ах", L"иях", L"ях", L"ы", L"ь", L"ию",
+        L"ью", L"ю", L"ия", L"ья", L"я"};
+    const std::vector<std::wstring> derivational = {L"ост", L"ость"};
+    const std::vector<std::wstring> superlative = {L"ейше", L"ейш"};
+
+    void stem(std::wstring& word) const {
+        size_t rv = findRV(word);
+        if (rv == std::wstring::npos) return;
+
+        bool step1Success = removeAfterA(word, perfGerund1, rv) || removeAny(word, perfGerund2, rv);
+        if (!step1Success) {
+            removeAny(word, reflexive, rv);
+            if (!removeAny(word, adjective, rv)) {
+                if (!removeAfterA(word, verb1, rv) && !removeAny(word, verb2, rv)) removeAny(word, noun, rv);
+            }
+        }
+
+        removeEnd(word, L"и", rv);
+        removeAny(word, derivational, rv);
+        removeAny(word, superlative, rv);
+        if (endsWith(word, L"нн") && word.length() - 2 >= rv) word.pop_back();
+        if (endsWith(word, L"ь") && word.length() - 1 >= rv) word.pop_back();
+    }
+};
+
+class StemmerCheck {
+    ReferenceStemmer reference;
+    RussianStemmer stemmer;
+    Tokenizer tokenizer;
+    std::wstring expected, direct;
+    std::string text, cached;
+
+    static std::string utf8(const std::wstring& word) {
+        std::string out;
+        for (wchar_t c : word) append_utf8(out, (uint32_t)c);
+        return out;
+    }
+
+    void report(const std::wstring& word, const std::string& got, const char* path) {
+        if (mismatches++ < 20) {
+            std::cerr << utf8(word) << ": expected " << utf8(expected) << ", " << path << " gave " << got << std::endl;
+        }
+    }
+
+public:
+    size_t words;
+    size_t mismatches;
+
+    StemmerCheck() : words(0), mismatches(0) {}
+
+    // `word` is folded: lower-case letters only.
+    void check(const std::wstring& word) {
+        words++;
+        expected = word;
+        reference.stem(expected);
+        direct = word;
+        stemmer.stem(direct);
+        if (direct != expected) report(word, utf8(direct), "RussianStemmer");
+        // Twice, so the second answer comes from the cache.
+        text = utf8(word);
+        for (int pass = 0; pass < 2; ++pass) {
+            size_t tokens = 0;
+            tokenizer.tokenize(text, [&](const Token& token) {
+                tokens++;
+                cached.assign(token.term.data(), token.term.size());
+            });
+            if (tokens != 1 || cached != utf8(expected)) report(word, cached, pass ? "cached Tokenizer" : "Tokenizer");
+        }
+    }
+
+    // Each term, alone and with every suffix of the reference lists.
+    bool check_vocabulary(const std::string& path) {
+        std::ifstream in(path);
+        if (!in.is_open()) {
+            std::cerr << "Cannot open " << path << std::endl;
+            return false;
+        }
+        std::set<std::wstring> suffixes;
+        const std::vector<std::wstring>* groups[] = {&reference.perfGerund1, &reference.perfGerund2,
+                                                     &reference.reflexive, &reference.adjective, &reference.verb1,
+                                                     &reference.verb2, &reference.noun, &reference.derivational,
+                                                     &reference.superlative};
+        for (const auto* group : groups) suffixes.insert(group->begin(), group->end());
+        for (const auto* group : {&reference.verb1, &reference.verb2}) {
+            for (const auto& verb : *group) {
+                for (const auto& ending : reference.reflexive) suffixes.insert(verb + ending);
+            }
+        }
+
+        std::string line;
+        std::wstring term;
+        while (std::getline(in, line)) {
+            std::string_view name(line.data(), line.find(':') == std::string::npos ? line.size() : line.find(':'));
+            term.clear();
+            for (size_t i = 0; i < name.size();) term.push_back((wchar_t)letter_table().fold(decode_utf8(name, i)));
+            if (term.empty() || term.find(L'\0') != std::wstring::npos) continue;
+            check(term);
+            for (const auto& suffix : suffixes) check(term + suffix);
+        }
+        return true;
+    }
+
+    // Every distinct folded word of a text or binary corpus.
+    bool check_corpus(const std::string& path) {
+        const LetterTable& letters = letter_table();
+        std::set<std::wstring> seen;
+        std::wstring word;
+        auto flush = [&]() {
+            if (!word.empty() && seen.insert(word).second) check(word);
+            word.clear();
+        };
+        auto scan = [&](std::string_view text) {
+            for (size_t i = 0; i < text.size();) {
+                uint32_t lower = letters.fold(decode_utf8(text, i));
+                if (lower) word.push_back((wchar_t)lower);
+                else flush();
+            }
+            flush();
+        };
+        if (is_binary_corpus(path)) {
+            CorpusReader reader;
+            CorpusRecord record;
+            std::string error;
+            if (!reader.open(path, error)) {
+                std::cerr << error << std::endl;
+                return false;
+            }
+            while (reader.next(record)) scan(record.text);
+            if (!reader.error().empty()) {
+                std::cerr << reader.error() << std::endl;
+                return false;
+            }
+            return true;
+        }
+        std::ifstream in(path);
+        if (!in.is_open()) {
+            std::cerr << "Cannot open " << path << std::endl;
+            return false;
+        }
+        std::string line;
+        while (std::getline(in, line)) scan(line);
+        return true;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    StemmerCheck check;
+    bool inputs = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool ok;
+        if (arg == "--vocab" && i + 1 < argc) ok = check.check_vocabulary(argv[++i]);
+        else ok = check.check_corpus(arg);
+        if (!ok) return 1;
+        inputs = true;
+    }
+    if (!inputs) {
+        std::cerr << "Usage: check_stemmer [--vocab index_data.txt] [corpus...]" << std::endl;
+        return 1;
+    }
+    std::cout << check.words << " words checked, " << check.mismatches << " stemmed differently" << std::endl;
+    return check.mismatches == 0 ? 0 : 1;
+}
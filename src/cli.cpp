@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <fstream>
 #include <filesystem>
+#include "../include/corpus.hpp"
 
 int run_command(const std::string& cmd) {
     std::cout << "[CMD] " << cmd << std::endl;
@@ -16,10 +17,9 @@ void do_dump() {
     query_file << "россия & сша" << std::endl;
     query_file << "путин | медведев" << std::endl;
     query_file << "экономика" << std::endl;
-    query_file << "exit" << std::endl;
     query_file.close();
 
-    std::string cmd = "./bin/searcher < dump_queries.txt > dump_output.txt";
+    std::string cmd = "./bin/searcher --batch dump_queries.txt --output dump_output.txt";
     int ret = run_command(cmd);
     
     if (ret == 0) {
@@ -51,12 +51,54 @@ void do_send() {
     std::cout << "--------------------------" << std::endl;
 }
 
+// Same classification as the crawler's get_source().
+std::string source_of(const std::string& url) {
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    std::string host = url.substr(start, url.find('/', start) - start);
+    if (host.find("ria.ru") != std::string::npos) return "ria";
+    if (host.find("rbc.ru") != std::string::npos) return "rbc";
+    return "other";
+}
+
+// Converts a corpus.txt/urls.txt pair, matched line by line, to the binary
+// corpus format. Crawl times are not in the text pair and are left 0.
+int do_convert(const std::string& corpus_file, const std::string& urls_file, const std::string& output_file) {
+    std::ifstream corpus(corpus_file);
+    if (!corpus.is_open()) {
+        std::cerr << "Cannot open " << corpus_file << std::endl;
+        return 1;
+    }
+    std::ifstream urls(urls_file);
+    if (!urls.is_open()) std::cerr << "Cannot open " << urls_file << ", documents get no URLs." << std::endl;
+    CorpusWriter writer;
+    if (!writer.open(output_file)) {
+        std::cerr << "Cannot write " << output_file << std::endl;
+        return 1;
+    }
+    std::string text, url;
+    while (std::getline(corpus, text)) {
+        if (!urls.is_open() || !std::getline(urls, url)) url.clear();
+        writer.add(0, url, url.empty() ? std::string() : source_of(url), text);
+    }
+    if (urls.is_open() && std::getline(urls, url)) {
+        std::cerr << "Warning: " << urls_file << " has more lines than " << corpus_file << std::endl;
+    }
+    if (!writer.close()) {
+        std::cerr << "Error writing " << output_file << std::endl;
+        return 1;
+    }
+    std::cout << "Converted " << writer.size() << " documents to '" << output_file << "'" << std::endl;
+    return 0;
+}
+
 void print_usage() {
     std::cout << "Usage: ./cli <command>" << std::endl;
     std::cout << "Commands:" << std::endl;
     std::cout << "  dump    Run search engine and save output" << std::endl;
     std::cout << "  pack    Zip the project files" << std::endl;
     std::cout << "  send    Show sending instructions" << std::endl;
+    std::cout << "  convert [corpus.txt urls.txt corpus.bin]  Convert a text corpus to the binary format" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
@@ -73,6 +115,9 @@ int main(int argc, char* argv[]) {
         do_pack();
     } else if (command == "send") {
         do_send();
+    } else if (command == "convert") {
+        return do_convert(argc > 2 ? argv[2] : "data/corpus.txt", argc > 3 ? argv[3] : "data/urls.txt",
+                          argc > 4 ? argv[4] : "data/corpus.bin");
     } else {
         std::cerr << "Unknown command: " << command << std::endl;
         print_usage();
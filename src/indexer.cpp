@@ -2,121 +2,1436 @@
 #include <fstream>
 #include <string>
 #include <chrono>
-#include <clocale>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <queue>
+#include <cstdlib>
 #include "../include/tokenizer.hpp"
 #include "../include/custom_stl.hpp"
+#include "../include/index_format.hpp"
+#include "../include/corpus.hpp"
+#include "../include/doc_store.hpp"
+#include "../include/forward_store.hpp"
+#include "../include/query.hpp"
+#include "../include/segments.hpp"
 
-using InvertedIndex = HashMap<std::string, Vector<Pair<int, int>>>;
-using DocMap = HashMap<int, std::string>;
+// Postings of one term and, if positions are indexed, its positions
+// stream in the on-disk format (see postings.hpp).
+struct TermPostings {
+    Vector<Pair<int, int>> postings;
+    std::string positions;
+};
 
-void save_index(const InvertedIndex& index, const std::string& filename) {
+using InvertedIndex = HashMap<std::string, TermPostings>;
+
+// Documents of a corpus in order: records of a binary corpus, whose texts
+// point straight into the mapping, or the lines of a text corpus paired
+// with the lines of a URL file. A text record is valid until the next call.
+class CorpusInput {
+    CorpusReader reader;
+    bool is_binary;
+    bool bad;
+    std::ifstream text;
+    std::ifstream urls;
+    std::string line;
+    std::string url;
+    uint32_t count;
+
+public:
+    CorpusInput() : is_binary(false), bad(false), count(0) {}
+
+    // `urls_file` is only read for a text corpus and may be empty.
+    bool open(const std::string& corpus_file, const std::string& urls_file, std::string& error) {
+        is_binary = is_binary_corpus(corpus_file);
+        if (is_binary) return reader.open(corpus_file, error);
+        text.open(corpus_file);
+        if (!text.is_open()) {
+            error = "cannot open " + corpus_file;
+            return false;
+        }
+        if (!urls_file.empty()) urls.open(urls_file);
+        return true;
+    }
+
+    bool binary() const { return is_binary; }
+
+    bool next(CorpusRecord& record) {
+        if (is_binary) {
+            if (reader.next(record)) return true;
+            if (!reader.error().empty()) {
+                std::cerr << "Error reading corpus: " << reader.error() << std::endl;
+                bad = true;
+            }
+            return false;
+        }
+        if (!std::getline(text, line)) return false;
+        record.id = count++;
+        record.crawled = 0;
+        record.text = line;
+        record.source = std::string_view();
+        record.url = urls.is_open() && std::getline(urls, url) ? std::string_view(url) : std::string_view();
+        return true;
+    }
+
+    // Whether reading stopped at a malformed record.
+    bool failed() const { return bad; }
+};
+
+struct TermRef {
+    std::string_view term;
+    const TermPostings* postings;
+};
+
+void sorted_terms(const InvertedIndex& index, Vector<TermRef>& terms) {
+    index.forEach([&terms](std::string_view term, const TermPostings& postings) {
+        TermRef ref;
+        ref.term = term;
+        ref.postings = &postings;
+        terms.push_back(ref);
+    });
+    std::sort(terms.begin(), terms.end(), [](const TermRef& a, const TermRef& b) {
+        return a.term < b.term;
+    });
+}
+
+// Adds one document and returns its length in tokens. `memory` grows by an
+// estimate of the bytes the new postings and terms occupy.
+int add_document(InvertedIndex& index, int doc_id, std::string_view text, bool with_positions, size_t& memory) {
+    // Terms get a slot in order of first occurrence; occurrences are then
+    // bucketed by slot so each term's positions come out in order.
+    HashMap<std::string, int> slots;
+    Vector<int> counts;
+    Vector<int> occurrences;
+    int length = 0;
+    thread_tokenizer().tokenize(text, [&](const Token& token) {
+        int& slot = slots[token.term];
+        if (slot == 0) {
+            counts.push_back(0);
+            slot = (int)counts.size();
+        }
+        counts[slot - 1]++;
+        if (with_positions) occurrences.push_back(slot - 1);
+        length++;
+    });
+
+    Vector<int> starts(counts.size() + 1);
+    Vector<uint32_t> positions;
+    if (with_positions) {
+        for (size_t i = 0; i < counts.size(); ++i) starts[i + 1] = starts[i] + counts[i];
+        Vector<int> fill(starts);
+        positions = Vector<uint32_t>(occurrences.size());
+        for (size_t p = 0; p < occurrences.size(); ++p) positions[fill[occurrences[p]]++] = (uint32_t)p;
+    }
+
+    size_t terms_before = index.size();
+    slots.forEach([&](std::string_view term, int slot) {
+        TermPostings& entry = index[term];
+        if (entry.postings.empty()) memory += term.size();
+        entry.postings.push_back(Pair<int, int>(doc_id, counts[slot - 1]));
+        if (with_positions) {
+            size_t before = entry.positions.size();
+            uint32_t prev = 0;
+            for (int i = starts[slot - 1]; i < starts[slot]; ++i) {
+                append_varint(entry.positions, positions[i] - prev);
+                prev = positions[i];
+            }
+            memory += entry.positions.size() - before;
+        }
+    });
+    memory += slots.size() * 2 * sizeof(Pair<int, int>);
+    memory += (index.size() - terms_before) * 96;
+    return length;
+}
+
+bool save_index(const InvertedIndex& index, const Vector<uint32_t>& doc_lengths, bool with_positions,
+                const std::string& filename) {
+    Vector<TermRef> terms;
+    sorted_terms(index, terms);
+
+    IndexWriter writer;
+    if (!writer.open(filename, doc_lengths, with_positions)) {
+        std::cerr << "Error opening output file: " << filename << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < terms.size(); ++i) {
+        const TermPostings& entry = *terms[i].postings;
+        writer.add_term(terms[i].term, entry.postings.begin(), entry.postings.size(), entry.positions.data(),
+                        entry.positions.size());
+    }
+    if (!writer.finish()) {
+        std::cerr << "Error writing index file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Index built by one worker over a contiguous range of doc ids.
+struct PartialIndex {
+    InvertedIndex index;
+    Vector<TermRef> terms;
+};
+
+// A term of the merged vocabulary: its postings are the concatenation of
+// sources[first .. first + count), which are ordered by worker and hence
+// by doc id.
+struct MergedTerm {
+    std::string_view term;
+    size_t first;
+    size_t count;
+    size_t df;
+};
+
+struct EncodedChunk {
+    size_t begin;
+    size_t end;
+    std::string bytes;
+    Vector<size_t> sizes;
+    std::string positions;
+    Vector<size_t> positions_sizes;
+};
+
+void encode_chunk(const Vector<MergedTerm>& merged, const Vector<const TermPostings*>& sources,
+                  const Vector<uint32_t>& doc_lengths, bool with_positions, EncodedChunk& chunk) {
+    Vector<Pair<int, int>> postings;
+    for (size_t t = chunk.begin; t < chunk.end; ++t) {
+        const MergedTerm& m = merged[t];
+        postings.clear();
+        size_t positions_before = chunk.positions.size();
+        for (size_t s = m.first; s < m.first + m.count; ++s) {
+            const Vector<Pair<int, int>>& part = sources[s]->postings;
+            for (size_t k = 0; k < part.size(); ++k) postings.push_back(part[k]);
+            chunk.positions += sources[s]->positions;
+        }
+        size_t before = chunk.bytes.size();
+        const char* positions = with_positions ? chunk.positions.data() + positions_before : nullptr;
+        encode_postings(postings.begin(), postings.size(), doc_lengths.begin(), positions, chunk.bytes);
+        chunk.sizes.push_back(chunk.bytes.size() - before);
+        chunk.positions_sizes.push_back(chunk.positions.size() - positions_before);
+    }
+}
+
+bool save_merged_index(Vector<PartialIndex*>& parts, int num_threads, const Vector<uint32_t>& doc_lengths,
+                       bool with_positions, const std::string& filename, size_t& num_terms) {
+    Vector<MergedTerm> merged;
+    Vector<const TermPostings*> sources;
+    Vector<size_t> heads(parts.size());
+    size_t total_postings = 0;
+    while (true) {
+        bool found = false;
+        std::string_view smallest;
+        for (size_t p = 0; p < parts.size(); ++p) {
+            if (heads[p] < parts[p]->terms.size()) {
+                std::string_view t = parts[p]->terms[heads[p]].term;
+                if (!found || t < smallest) smallest = t;
+                found = true;
+            }
+        }
+        if (!found) break;
+
+        MergedTerm m;
+        m.term = smallest;
+        m.first = sources.size();
+        m.count = 0;
+        m.df = 0;
+        for (size_t p = 0; p < parts.size(); ++p) {
+            if (heads[p] < parts[p]->terms.size() && parts[p]->terms[heads[p]].term == smallest) {
+                const TermPostings* postings = parts[p]->terms[heads[p]].postings;
+                sources.push_back(postings);
+                m.count++;
+                m.df += postings->postings.size();
+                heads[p]++;
+            }
+        }
+        total_postings += m.df;
+        merged.push_back(m);
+    }
+    num_terms = merged.size();
+
+    Vector<EncodedChunk> chunks(num_threads);
+    size_t t = 0, seen = 0;
+    for (int c = 0; c < num_threads; ++c) {
+        chunks[c].begin = t;
+        size_t target = total_postings * (c + 1) / num_threads;
+        while (t < merged.size() && (seen < target || c == num_threads - 1)) seen += merged[t++].df;
+        chunks[c].end = t;
+    }
+
+    std::vector<std::thread> workers;
+    for (int c = 0; c < num_threads; ++c) {
+        workers.emplace_back([&merged, &sources, &doc_lengths, with_positions, &chunks, c]() {
+            encode_chunk(merged, sources, doc_lengths, with_positions, chunks[c]);
+        });
+    }
+    for (size_t w = 0; w < workers.size(); ++w) workers[w].join();
+
+    IndexWriter writer;
+    if (!writer.open(filename, doc_lengths, with_positions)) {
+        std::cerr << "Error opening output file: " << filename << std::endl;
+        return false;
+    }
+    for (int c = 0; c < num_threads; ++c) {
+        const EncodedChunk& chunk = chunks[c];
+        size_t offset = 0, positions_offset = 0;
+        for (size_t i = chunk.begin; i < chunk.end; ++i) {
+            size_t n = chunk.sizes[i - chunk.begin];
+            size_t positions_n = chunk.positions_sizes[i - chunk.begin];
+            writer.add_encoded(merged[i].term, (uint32_t)merged[i].df, chunk.bytes.data() + offset, n,
+                               chunk.positions.data() + positions_offset, positions_n);
+            offset += n;
+            positions_offset += positions_n;
+        }
+    }
+    if (!writer.finish()) {
+        std::cerr << "Error writing index file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Sorted run of (term, df, encoded postings, positions) records flushed by
+// the memory-bounded build once the in-memory index reaches its budget.
+// Runs are never scored, so their blocks carry no bounds and the build
+// needs no document lengths until the merge.
+bool write_run(const InvertedIndex& index, const std::string& filename) {
+    Vector<TermRef> terms;
+    sorted_terms(index, terms);
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "Error opening run file: " << filename << std::endl;
+        return false;
+    }
+    std::string buffer;
+    for (size_t i = 0; i < terms.size(); ++i) {
+        std::string_view term = terms[i].term;
+        const Vector<Pair<int, int>>& postings = terms[i].postings->postings;
+        const std::string& positions = terms[i].postings->positions;
+        buffer.clear();
+        append_u32(buffer, (uint32_t)term.size());
+        buffer += term;
+        append_u32(buffer, (uint32_t)postings.size());
+        size_t size_pos = buffer.size();
+        append_u32(buffer, 0);
+        encode_postings(postings.begin(), postings.size(), nullptr, nullptr, buffer);
+        uint32_t encoded = (uint32_t)(buffer.size() - size_pos - 4);
+        std::memcpy(&buffer[size_pos], &encoded, 4);
+        append_u32(buffer, (uint32_t)positions.size());
+        buffer += positions;
+        out.write(buffer.data(), buffer.size());
+    }
+    out.close();
+    return !out.fail();
+}
+
+class RunReader {
+    std::ifstream in;
+
+    bool read_u32(uint32_t& v) {
+        in.read((char*)&v, sizeof(v));
+        return in.gcount() == sizeof(v);
+    }
+
+public:
+    std::string term;
+    uint32_t df;
+    std::string postings;
+    std::string positions;
+    bool done;
+    // Set if the run ended in the middle of a record.
+    bool failed;
+
+    RunReader() : df(0), done(true), failed(false) {}
+
+    bool open(const std::string& filename) {
+        in.open(filename, std::ios::binary);
+        done = !in.is_open();
+        failed = false;
+        return !done;
+    }
+
+    void next() {
+        uint32_t len, size;
+        if (!read_u32(len)) {
+            failed = in.gcount() != 0;
+            done = true;
+            return;
+        }
+        term.resize(len);
+        in.read(&term[0], len);
+        read_u32(df);
+        read_u32(size);
+        postings.resize(size);
+        in.read(&postings[0], size);
+        read_u32(size);
+        positions.resize(size);
+        in.read(&positions[0], size);
+        if (!in) failed = done = true;
+    }
+};
+
+struct RunOrder {
+    const Vector<RunReader*>* runs;
+    bool operator()(size_t a, size_t b) const {
+        const std::string& ta = (*runs)[a]->term;
+        const std::string& tb = (*runs)[b]->term;
+        if (ta != tb) return ta > tb;
+        return a > b;
+    }
+};
+
+// k-way merge of sorted runs into the final index. Runs hold increasing
+// doc id ranges, so a term's postings are the concatenation of its runs'
+// lists in run order; they are streamed into the writer posting by posting.
+// A run that cannot be read fails the whole merge.
+bool merge_runs(const Vector<std::string>& run_files, const uint32_t* doc_lengths, size_t num_docs,
+                bool with_positions, const std::string& filename, size_t& num_terms) {
+    Vector<RunReader*> runs;
+    bool ok = true;
+    for (size_t i = 0; i < run_files.size(); ++i) {
+        RunReader* run = new RunReader();
+        if (ok && !run->open(run_files[i])) {
+            std::cerr << "Error opening run file: " << run_files[i] << std::endl;
+            ok = false;
+        }
+        run->next();
+        runs.push_back(run);
+    }
+
+    IndexWriter writer;
+    if (ok && !writer.open(filename, doc_lengths, num_docs, with_positions)) {
+        std::cerr << "Error opening output file: " << filename << std::endl;
+        ok = false;
+    }
+
+    RunOrder order;
+    order.runs = &runs;
+    std::priority_queue<size_t, std::vector<size_t>, RunOrder> heap(order);
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (!runs[i]->done) heap.push(i);
+    }
+
+    num_terms = 0;
+    Vector<size_t> current;
+    while (ok && !heap.empty()) {
+        current.clear();
+        current.push_back(heap.top());
+        heap.pop();
+        std::string term = runs[current[0]]->term;
+        while (!heap.empty() && runs[heap.top()]->term == term) {
+            current.push_back(heap.top());
+            heap.pop();
+        }
+
+        uint32_t df = 0;
+        for (size_t i = 0; i < current.size(); ++i) df += runs[current[i]]->df;
+        writer.begin_term(term, df);
+        for (size_t i = 0; i < current.size(); ++i) {
+            RunReader* run = runs[current[i]];
+            const char* positions = run->positions.data();
+            for (PostingCursor c(run->postings.data(), run->df); !c.at_end(); c.next()) {
+                const char* end = with_positions ? skip_varints(positions, (uint32_t)c.tf()) : positions;
+                writer.add_posting(c.doc(), c.tf(), positions, end - positions);
+                positions = end;
+            }
+            run->next();
+            if (run->failed) ok = false;
+            if (!run->done) heap.push(current[i]);
+        }
+        writer.end_term();
+        num_terms++;
+    }
+
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (runs[i]->failed) {
+            std::cerr << "Error reading run file: " << run_files[i] << std::endl;
+            ok = false;
+        }
+        delete runs[i];
+        std::remove(run_files[i].c_str());
+    }
+    if (ok && !writer.finish()) {
+        std::cerr << "Error writing index file: " << filename << std::endl;
+        return false;
+    }
+    return ok;
+}
+
+size_t parse_size(const std::string& s) {
+    size_t value = (size_t)std::atoll(s.c_str());
+    char unit = s.empty() ? 0 : s[s.size() - 1];
+    if (unit == 'K' || unit == 'k') value <<= 10;
+    else if (unit == 'M' || unit == 'm') value <<= 20;
+    else if (unit == 'G' || unit == 'g') value <<= 30;
+    return value;
+}
+
+bool export_text(const std::string& index_file, const std::string& filename) {
+    IndexReader reader;
+    std::string error;
+    if (!reader.open(index_file, false, error)) {
+        std::cerr << "Cannot read index: " << error << std::endl;
+        return false;
+    }
     std::ofstream outfile(filename);
     if (!outfile.is_open()) {
         std::cerr << "Error opening output file: " << filename << std::endl;
-        return;
+        return false;
     }
-    
-    index.forEach([&outfile](const std::string& term, const Vector<Pair<int, int>>& postings) {
-        outfile << term << ":";
-        for(size_t i=0; i<postings.size(); ++i) {
-            outfile << postings[i].first << "," << postings[i].second << ";";
+    for (TermCursor t = reader.terms(); !t.at_end(); t.next()) {
+        outfile << t.term() << ":";
+        for (PostingCursor c = reader.cursor(t.index()); !c.at_end(); c.next()) {
+            outfile << c.doc() << "," << c.tf() << ";";
         }
         outfile << "\n";
-    });
-    outfile.close();
+    }
+    return true;
 }
 
-void save_docs(const DocMap& docs, const std::string& filename) {
-    std::ofstream outfile(filename);
-    if (!outfile.is_open()) return;
-    
-    docs.forEach([&outfile](const int& id, const std::string& url) {
-        outfile << id << "|" << url << "\n";
-    });
-    outfile.close();
+// Tiered merging of delta segments: a segment's tier is the number of
+// decimal digits in its document count, and MERGE_FACTOR adjacent segments
+// of one tier are merged into one segment of the next. Only adjacent
+// segments are merged, so global doc ids never change. The segments written
+// by a full build (the index file and its shards) are never merged; they
+// are replaced by the next full build.
+const size_t MERGE_FACTOR = 10;
+// A segment is compacted once this fraction of its documents are deleted
+// but still have postings in it.
+const double COMPACT_RATIO = 0.2;
+
+// File of shard `s` of a split build of `index_file`; shard 0 is the index
+// file itself.
+std::string shard_file(const std::string& index_file, size_t s) {
+    return s == 0 ? index_file : index_file + ".shard" + std::to_string(s);
 }
 
-int main(int argc, char* argv[]) {
-    std::setlocale(LC_ALL, "");
-    std::string corpus_file = "data/corpus.txt";
-    if (argc > 1) corpus_file = argv[1];
+bool full_build_segment(const std::string& file, const std::string& main_file) {
+    return file == main_file || file.compare(0, main_file.size() + 6, main_file + ".shard") == 0;
+}
 
-    InvertedIndex index;
-    DocMap doc_map;
-    HashMap<int, int> doc_lengths;
+int segment_tier(uint64_t docs) {
+    int tier = 0;
+    for (; docs >= 10; docs /= 10) tier++;
+    return tier;
+}
+
+// Picks the next maintenance job: the first run of MERGE_FACTOR adjacent
+// delta segments of one tier, or else the first segment with too many dead
+// postings, which is rewritten in place (`count` 1).
+bool plan_merge(const Manifest& manifest, const std::string& main_file, size_t& first, size_t& count) {
+    size_t run = 0;
+    for (size_t i = 0; i < manifest.segments.size(); ++i) {
+        const SegmentInfo& s = manifest.segments[i];
+        if (full_build_segment(s.file, main_file)) {
+            run = 0;
+            continue;
+        }
+        if (run > 0 && segment_tier(manifest.segments[i - 1].docs) == segment_tier(s.docs)) run++;
+        else run = 1;
+        if (run == MERGE_FACTOR) {
+            first = i + 1 - MERGE_FACTOR;
+            count = MERGE_FACTOR;
+            return true;
+        }
+    }
+    for (size_t i = 0; i < manifest.segments.size(); ++i) {
+        const SegmentInfo& s = manifest.segments[i];
+        if (s.dead > 0 && s.dead >= s.docs * COMPACT_RATIO) {
+            first = i;
+            count = 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Appends the positions of the posting at `c` to `out` as a positions
+// stream (see postings.hpp).
+void copy_positions(PostingCursor& c, Vector<uint32_t>& decoded, std::string& out) {
+    c.positions(decoded);
+    uint32_t prev = 0;
+    for (size_t p = 0; p < decoded.size(); ++p) {
+        append_varint(out, decoded[p] - prev);
+        prev = decoded[p];
+    }
+}
+
+// Writes adjacent segments, in doc id order, as one segment without the
+// postings of deleted documents (`deleted` holds a bitmap or null per
+// input); deleted documents keep their ids and lengths. Positions are kept
+// only if every input has them.
+bool merge_segments(const Vector<IndexReader*>& inputs, const Vector<const uint64_t*>& deleted,
+                    const std::string& filename, size_t& num_terms) {
+    Vector<uint32_t> doc_lengths;
+    Vector<int> offsets;
+    bool with_positions = true;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        offsets.push_back((int)doc_lengths.size());
+        for (size_t d = 0; d < inputs[i]->num_docs(); ++d) doc_lengths.push_back(inputs[i]->doc_length((int)d));
+        with_positions = with_positions && inputs[i]->has_positions();
+    }
+
+    IndexWriter writer;
+    if (!writer.open(filename, doc_lengths, with_positions)) {
+        std::cerr << "Error opening output file: " << filename << std::endl;
+        return false;
+    }
+
+    Vector<TermCursor> next;
+    for (size_t i = 0; i < inputs.size(); ++i) next.push_back(inputs[i]->terms());
+    Vector<uint32_t> decoded;
+    std::string positions;
+    std::string term;
+    auto has_term = [&](size_t i) { return !next[i].at_end() && next[i].term() == term; };
+    num_terms = 0;
+    while (true) {
+        bool any = false;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (next[i].at_end()) continue;
+            if (!any || next[i].term() < term) term = next[i].term();
+            any = true;
+        }
+        if (!any) break;
+
+        uint32_t df = 0;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (!has_term(i)) continue;
+            if (!deleted[i]) {
+                df += inputs[i]->df(next[i].index());
+                continue;
+            }
+            for (PostingCursor c = inputs[i]->cursor(next[i].index()); !c.at_end(); c.next()) {
+                if (!doc_deleted(deleted[i], c.doc())) df++;
+            }
+        }
+        if (df > 0) {
+            writer.begin_term(term, df);
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                if (!has_term(i)) continue;
+                for (PostingCursor c = inputs[i]->cursor(next[i].index()); !c.at_end(); c.next()) {
+                    if (deleted[i] && doc_deleted(deleted[i], c.doc())) continue;
+                    positions.clear();
+                    if (with_positions) copy_positions(c, decoded, positions);
+                    writer.add_posting(c.doc() + offsets[i], c.tf(), positions.data(), positions.size());
+                }
+            }
+            writer.end_term();
+            num_terms++;
+        }
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (has_term(i)) next[i].next();
+        }
+    }
+    if (!writer.finish()) {
+        std::cerr << "Error writing index file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Removes a segment file together with its doc and forward stores.
+void remove_segment(const std::string& file) {
+    std::remove(file.c_str());
+    std::remove(doc_store_path(file).c_str());
+    std::remove(forward_store_path(file).c_str());
+}
+
+// Renames a segment file together with its doc and forward stores.
+bool rename_segment(const std::string& from, const std::string& to) {
+    return std::rename(from.c_str(), to.c_str()) == 0 &&
+           std::rename(doc_store_path(from).c_str(), doc_store_path(to).c_str()) == 0 &&
+           std::rename(forward_store_path(from).c_str(), forward_store_path(to).c_str()) == 0;
+}
+
+// Concatenates the doc and forward stores of the segments in `files` (read
+// by `inputs`) into the stores of `output`. Deleted documents keep their
+// doc store entries, as they keep their ids, but lose their texts;
+// segments without stores contribute empty entries.
+bool merge_doc_stores(const Vector<IndexReader*>& inputs, const Vector<const uint64_t*>& deleted,
+                      const Vector<std::string>& files, const std::string& output) {
+    DocStoreWriter writer;
+    ForwardStoreWriter text_writer;
+    if (!writer.open(doc_store_path(output)) || !text_writer.open(forward_store_path(output))) return false;
+    Vector<uint32_t> lengths;
+    std::string block;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        DocStore store;
+        ForwardStore texts;
+        std::string error;
+        if ((file_exists(doc_store_path(files[i])) && !store.open(doc_store_path(files[i]), error)) ||
+            (file_exists(forward_store_path(files[i])) && !texts.open(forward_store_path(files[i]), error))) {
+            std::cerr << error << std::endl;
+            return false;
+        }
+        for (uint64_t d = 0; d < inputs[i]->num_docs(); ++d) {
+            writer.add(store, (int)d);
+            lengths.push_back(inputs[i]->doc_length((int)d));
+            bool dropped = deleted[i] && doc_deleted(deleted[i], (int)d);
+            text_writer.add(dropped ? std::string_view() : texts.text((int)d, block));
+        }
+    }
+    return writer.finish(lengths) && text_writer.finish();
+}
+
+// Splits the index `input` and its doc and forward stores into shards
+// `files` covering consecutive doc ranges with about the same number of
+// tokens each, at least one document per shard. Each shard lists its own
+// documents from 0; `docs` receives how many each holds.
+bool split_index(const std::string& input, const Vector<std::string>& files, Vector<uint64_t>& docs) {
+    IndexReader reader;
+    std::string error;
+    if (!reader.open(input, false, error)) {
+        std::cerr << "Cannot read index: " << error << std::endl;
+        return false;
+    }
+    size_t n = files.size();
+    uint64_t num_docs = reader.num_docs();
+    // Shard s holds documents bounds[s] to bounds[s + 1] - 1.
+    Vector<int> bounds;
+    bounds.push_back(0);
+    int d = 0;
+    uint64_t seen = 0;
+    for (size_t s = 1; s < n; ++s) {
+        uint64_t target = reader.total_length() * s / n;
+        while ((uint64_t)d < num_docs && seen < target) seen += reader.doc_length(d++);
+        int lo = bounds[s - 1] + 1, hi = (int)(num_docs - (n - s));
+        bounds.push_back(d < lo ? lo : d > hi ? hi : d);
+    }
+    bounds.push_back((int)num_docs);
+
+    bool with_positions = reader.has_positions();
+    Vector<Vector<uint32_t>> lengths(n);
+    Vector<IndexWriter*> writers;
+    bool ok = true;
+    for (size_t s = 0; s < n; ++s) {
+        for (int doc = bounds[s]; doc < bounds[s + 1]; ++doc) lengths[s].push_back(reader.doc_length(doc));
+        docs.push_back(lengths[s].size());
+        writers.push_back(new IndexWriter);
+        if (ok && !writers[s]->open(files[s], lengths[s], with_positions)) {
+            std::cerr << "Error opening output file: " << files[s] << std::endl;
+            ok = false;
+        }
+    }
+
+    Vector<uint32_t> dfs(n), decoded;
+    std::string positions;
+    for (TermCursor t = reader.terms(); ok && !t.at_end(); t.next()) {
+        for (size_t s = 0; s < n; ++s) dfs[s] = 0;
+        size_t s = 0;
+        for (PostingCursor c = reader.cursor(t.index()); !c.at_end(); c.next()) {
+            while (c.doc() >= bounds[s + 1]) s++;
+            dfs[s]++;
+        }
+        PostingCursor c = reader.cursor(t.index());
+        for (s = 0; s < n; ++s) {
+            if (dfs[s] == 0) continue;
+            writers[s]->begin_term(t.term(), dfs[s]);
+            for (c.advance(bounds[s]); c.doc() < bounds[s + 1]; c.next()) {
+                positions.clear();
+                if (with_positions) copy_positions(c, decoded, positions);
+                writers[s]->add_posting(c.doc() - bounds[s], c.tf(), positions.data(), positions.size());
+            }
+            writers[s]->end_term();
+        }
+    }
+    for (size_t s = 0; s < n; ++s) {
+        if (ok && !writers[s]->finish()) {
+            std::cerr << "Error writing index file: " << files[s] << std::endl;
+            ok = false;
+        }
+        delete writers[s];
+    }
+    if (!ok) return false;
+
+    DocStore store;
+    ForwardStore texts;
+    if ((file_exists(doc_store_path(input)) && !store.open(doc_store_path(input), error)) ||
+        (file_exists(forward_store_path(input)) && !texts.open(forward_store_path(input), error))) {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    std::string block;
+    for (size_t s = 0; s < n; ++s) {
+        DocStoreWriter store_writer;
+        ForwardStoreWriter text_writer;
+        if (!store_writer.open(doc_store_path(files[s])) || !text_writer.open(forward_store_path(files[s]))) {
+            std::cerr << "Error opening doc stores for " << files[s] << std::endl;
+            return false;
+        }
+        for (int doc = bounds[s]; doc < bounds[s + 1]; ++doc) {
+            store_writer.add(store, doc);
+            text_writer.add(texts.text(doc, block));
+        }
+        if (!store_writer.finish(lengths[s]) || !text_writer.finish()) {
+            std::cerr << "Error writing doc stores for " << files[s] << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Applies the merge policy until nothing is due. The manifest lock is held
+// only to pick a job and to publish it, so appends and deletes go on while
+// segments are rewritten; a second lock keeps merges one at a time and away
+// from full builds.
+int run_merges(const std::string& index_file) {
+    FileLock merging(index_file + ".merge.lock", false);
+    if (!merging.locked()) return 0;
 
-    std::ifstream file(corpus_file);
-    if (!file.is_open()) {
-        std::cerr << "Error opening corpus file: " << corpus_file << std::endl;
+    std::string dir = dir_of(index_file);
+    std::string main_file = base_name(index_file);
+    std::string path = manifest_path(index_file);
+    std::string error;
+    while (true) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+        Manifest manifest;
+        size_t first = 0, count = 0;
+        std::string output;
+        // Bitmaps as of planning: their documents are left out of the
+        // output, later deletes carry over to its bitmap as dead documents.
+        Vector<Vector<uint64_t>> planned;
+        {
+            FileLock lock(path + ".lock");
+            if (!file_exists(path)) return 0;
+            if (!read_manifest(path, manifest, error)) {
+                std::cerr << "Cannot read manifest: " << error << std::endl;
+                return 1;
+            }
+            if (!plan_merge(manifest, main_file, first, count)) return 0;
+            for (size_t i = first; i < first + count; ++i) {
+                const SegmentInfo& s = manifest.segments[i];
+                planned.push_back(Vector<uint64_t>());
+                if (!s.deletes.empty() && !read_bitmap(dir + s.deletes, s.docs, planned[i - first], error)) {
+                    std::cerr << error << std::endl;
+                    return 1;
+                }
+            }
+            if (count == 1) {
+                output = manifest.segments[first].file + ".compact";
+            } else {
+                output = "seg_" + std::to_string(manifest.next_segment++) + ".bin";
+                if (!write_manifest(path, manifest)) {
+                    std::cerr << "Error writing manifest: " << path << std::endl;
+                    return 1;
+                }
+            }
+        }
+
+        Vector<IndexReader*> inputs;
+        Vector<const uint64_t*> deleted;
+        bool ok = true;
+        uint64_t docs = 0, dropped = 0;
+        for (size_t i = 0; ok && i < count; ++i) {
+            IndexReader* reader = new IndexReader;
+            inputs.push_back(reader);
+            deleted.push_back(planned[i].empty() ? nullptr : planned[i].begin());
+            ok = reader->open(dir + manifest.segments[first + i].file, false, error);
+            docs += manifest.segments[first + i].docs;
+            dropped += manifest.segments[first + i].dead;
+        }
+        size_t num_terms = 0;
+        if (!ok) std::cerr << "Cannot read segment: " << error << std::endl;
+        else ok = merge_segments(inputs, deleted, dir + output, num_terms);
+        // Compaction keeps every doc id, so only a merge needs a new store.
+        if (ok && count > 1) {
+            Vector<std::string> files;
+            for (size_t i = 0; i < count; ++i) files.push_back(dir + manifest.segments[first + i].file);
+            ok = merge_doc_stores(inputs, deleted, files, dir + output);
+            if (!ok) std::cerr << "Error writing doc stores of " << dir + output << std::endl;
+        }
+        for (size_t i = 0; i < inputs.size(); ++i) delete inputs[i];
+        if (!ok) {
+            remove_segment(dir + output);
+            return 1;
+        }
+
+        // The manifest may have changed (or been reset by a full build) in
+        // the meantime; the rewritten segments are located again by name.
+        Vector<std::string> obsolete;
+        {
+            FileLock lock(path + ".lock");
+            Manifest current;
+            size_t at = 0;
+            bool found = read_manifest(path, current, error);
+            while (found && at < current.segments.size() && current.segments[at].file != manifest.segments[first].file) at++;
+            found = found && at + count <= current.segments.size();
+            for (size_t i = 0; found && i < count; ++i) {
+                found = current.segments[at + i].file == manifest.segments[first + i].file;
+            }
+            if (!found) {
+                remove_segment(dir + output);
+                return 0;
+            }
+
+            Manifest merged;
+            merged.generation = current.generation + 1;
+            merged.next_segment = current.next_segment;
+            SegmentInfo info;
+            info.file = count == 1 ? current.segments[at].file : output;
+            info.base = current.segments[at].base;
+            info.docs = docs;
+            Vector<uint64_t> bits((size_t)((docs + 63) / 64));
+            for (size_t w = 0; w < bits.size(); ++w) bits[w] = 0;
+            uint64_t offset = 0, total = 0;
+            for (size_t i = 0; i < count; ++i) {
+                const SegmentInfo& s = current.segments[at + i];
+                if (!s.deletes.empty()) {
+                    Vector<uint64_t> now;
+                    if (!read_bitmap(dir + s.deletes, s.docs, now, error)) {
+                        std::cerr << error << std::endl;
+                        remove_segment(dir + output);
+                        return 1;
+                    }
+                    for (uint64_t d = 0; d < s.docs; ++d) {
+                        if (!doc_deleted(now.begin(), (int)d)) continue;
+                        bits[(offset + d) >> 6] |= 1ULL << ((offset + d) & 63);
+                        total++;
+                        if (planned[i].empty() || !doc_deleted(planned[i].begin(), (int)d)) info.dead++;
+                    }
+                    obsolete.push_back(s.deletes);
+                }
+                if (count > 1) {
+                    obsolete.push_back(s.file);
+                    obsolete.push_back(doc_store_path(s.file));
+                    obsolete.push_back(forward_store_path(s.file));
+                }
+                offset += s.docs;
+            }
+            if (total > 0) {
+                info.deletes = info.file + "." + std::to_string(merged.generation) + ".del";
+                if (!write_bitmap(dir + info.deletes, bits)) {
+                    std::cerr << "Error writing " << dir + info.deletes << std::endl;
+                    remove_segment(dir + output);
+                    return 1;
+                }
+            }
+            // A compacted segment keeps its documents and ids, so readers
+            // of the old manifest may see the new file as well.
+            if (count == 1 && std::rename((dir + output).c_str(), (dir + info.file).c_str()) != 0) {
+                std::cerr << "Error replacing " << dir + info.file << std::endl;
+                remove_segment(dir + output);
+                return 1;
+            }
+            for (size_t i = 0; i < current.segments.size(); ++i) {
+                if (i == at) merged.segments.push_back(info);
+                else if (i < at || i >= at + count) merged.segments.push_back(current.segments[i]);
+            }
+            if (!write_manifest(path, merged)) {
+                std::cerr << "Error writing manifest: " << path << std::endl;
+                if (count > 1) remove_segment(dir + output);
+                return 1;
+            }
+        }
+        for (size_t i = 0; i < obsolete.size(); ++i) std::remove((dir + obsolete[i]).c_str());
+
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+        if (count == 1) {
+            std::cout << "Compacted " << manifest.segments[first].file << " (" << dropped << " deleted documents dropped, "
+                      << num_terms << " terms) in " << elapsed.count() << " seconds." << std::endl;
+        } else {
+            std::cout << "Merged " << count << " segments (" << docs << " documents, " << num_terms << " terms) into "
+                      << output << " in " << elapsed.count() << " seconds." << std::endl;
+        }
+    }
+}
+
+// Starts run_merges() in a background process if a merge is due for
+// `manifest`. Its output goes to a log next to the index.
+void start_background_merge(const std::string& index_file, const Manifest& manifest) {
+    size_t first, count;
+    if (!plan_merge(manifest, base_name(index_file), first, count)) return;
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        std::string log = index_file + ".merge.log";
+        if (!std::freopen(log.c_str(), "a", stdout)) std::freopen("/dev/null", "w", stdout);
+        int status = run_merges(index_file);
+        std::cout.flush();
+        std::_Exit(status);
+    }
+    if (pid > 0) std::cout << "Merging segments in the background (pid " << pid << ")." << std::endl;
+    else std::cerr << "Cannot start background merge; run with --merge later." << std::endl;
+}
+
+// Marks every live document with one of `urls` deleted. Segments that
+// change get new bitmaps named after the manifest's next generation; the
+// bitmaps they replace are added to `obsolete`. Returns the number of
+// documents deleted, or -1 on error.
+long delete_urls(Manifest& manifest, const std::string& dir, const HashMap<std::string, int>& urls,
+                 Vector<std::string>& obsolete, std::string& error) {
+    Vector<int> ids;
+    for (size_t i = 0; i < manifest.segments.size(); ++i) {
+        const SegmentInfo& s = manifest.segments[i];
+        std::string store_file = doc_store_path(dir + s.file);
+        if (!file_exists(store_file)) continue;
+        DocStore store;
+        if (!store.open(store_file, error)) return -1;
+        for (uint64_t d = 0; d < store.size() && d < s.docs; ++d) {
+            std::string_view url = store.url((int)d);
+            if (!url.empty() && urls.find(url)) ids.push_back((int)(s.base + d));
+        }
+    }
+
+    long total = 0;
+    size_t next = 0;
+    std::string generation = std::to_string(manifest.generation + 1);
+    for (size_t i = 0; i < manifest.segments.size() && next < ids.size(); ++i) {
+        SegmentInfo& s = manifest.segments[i];
+        if ((uint64_t)ids[next] >= s.base + s.docs) continue;
+        Vector<uint64_t> bits;
+        if (!s.deletes.empty()) {
+            if (!read_bitmap(dir + s.deletes, s.docs, bits, error)) return -1;
+        } else {
+            bits = Vector<uint64_t>((size_t)((s.docs + 63) / 64));
+            for (size_t w = 0; w < bits.size(); ++w) bits[w] = 0;
+        }
+        uint64_t added = 0;
+        for (; next < ids.size() && (uint64_t)ids[next] < s.base + s.docs; ++next) {
+            uint64_t d = ids[next] - s.base;
+            uint64_t bit = 1ULL << (d & 63);
+            if (bits[d >> 6] & bit) continue;
+            bits[d >> 6] |= bit;
+            added++;
+        }
+        if (added == 0) continue;
+        std::string name = s.file + "." + generation + ".del";
+        if (!write_bitmap(dir + name, bits)) {
+            error = "cannot write " + dir + name;
+            return -1;
+        }
+        if (!s.deletes.empty()) obsolete.push_back(s.deletes);
+        s.deletes = name;
+        s.dead += added;
+        total += (long)added;
+    }
+    return total;
+}
+
+// Deletes the documents with the URLs listed in `urls_file`.
+int delete_documents(const std::string& urls_file, const std::string& index_file, bool merge) {
+    std::ifstream urls_in(urls_file);
+    if (!urls_in.is_open()) {
+        std::cerr << "Error opening URL file: " << urls_file << std::endl;
         return 1;
     }
+    HashMap<std::string, int> urls;
+    std::string url;
+    while (std::getline(urls_in, url)) {
+        if (!url.empty()) urls[url] = 1;
+    }
 
+    std::string dir = dir_of(index_file);
+    std::string path = manifest_path(index_file);
+    std::string error;
+    Manifest manifest;
+    Vector<std::string> obsolete;
+    long deleted;
+    {
+        FileLock lock(path + ".lock");
+        if (!load_manifest(index_file, manifest, error)) {
+            std::cerr << "Cannot read index: " << error << std::endl;
+            return 1;
+        }
+        deleted = delete_urls(manifest, dir, urls, obsolete, error);
+        if (deleted < 0) {
+            std::cerr << "Cannot delete documents: " << error << std::endl;
+            return 1;
+        }
+        if (deleted > 0) {
+            manifest.generation++;
+            if (!write_manifest(path, manifest)) {
+                std::cerr << "Error writing manifest: " << path << std::endl;
+                return 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < obsolete.size(); ++i) std::remove((dir + obsolete[i]).c_str());
+    std::cout << "Deleted " << deleted << " documents." << std::endl;
+    if (merge) start_background_merge(index_file, manifest);
+    return 0;
+}
+
+// Indexes the documents of `corpus_file` as a new delta segment with fresh
+// doc ids after the current last one. With `replace`, older documents with
+// the same URLs are deleted in the same step, which makes it an update.
+int append_documents(const std::string& corpus_file, const std::string& urls_file, const std::string& index_file,
+                     bool with_positions, bool replace, bool merge) {
+    CorpusInput input;
+    std::string error;
+    if (!input.open(corpus_file, urls_file, error)) {
+        std::cerr << "Error opening corpus file: " << error << std::endl;
+        return 1;
+    }
+    if (replace && !input.binary() && urls_file.empty()) {
+        std::cerr << "Updating needs the documents' URLs (--urls)." << std::endl;
+        return 1;
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::string dir = dir_of(index_file);
+    std::string path = manifest_path(index_file);
+    std::string segment_file;
+    Manifest manifest;
+    Vector<std::string> obsolete;
+    size_t num_terms = 0;
+    long deleted = 0;
+    int count = 0;
+    {
+        FileLock lock(path + ".lock");
+        if (!load_manifest(index_file, manifest, error)) {
+            std::cerr << "Cannot read index (build it before appending): " << error << std::endl;
+            return 1;
+        }
+        uint64_t base = manifest.num_docs();
+
+        InvertedIndex index;
+        Vector<uint32_t> doc_lengths;
+        HashMap<std::string, int> urls;
+        segment_file = "seg_" + std::to_string(manifest.next_segment++) + ".bin";
+        DocStoreWriter docs;
+        ForwardStoreWriter forward;
+        if (!docs.open(doc_store_path(dir + segment_file)) || !forward.open(forward_store_path(dir + segment_file))) {
+            std::cerr << "Error opening doc stores for " << segment_file << std::endl;
+            return 1;
+        }
+        CorpusRecord record;
+        size_t memory = 0;
+        while (input.next(record)) {
+            docs.add(record.url, record.source, record.crawled);
+            forward.add(record.text);
+            if (replace && !record.url.empty()) urls[record.url] = 1;
+            doc_lengths.push_back((uint32_t)add_document(index, count, record.text, with_positions, memory));
+            count++;
+        }
+        if (input.failed()) return 1;
+        if (count == 0) {
+            std::cout << "Nothing to append." << std::endl;
+            return 0;
+        }
+        num_terms = index.size();
+
+        if (!save_index(index, doc_lengths, with_positions, dir + segment_file)) return 1;
+        if (!docs.finish(doc_lengths) || !forward.finish()) {
+            std::cerr << "Error writing doc stores for " << segment_file << std::endl;
+            remove_segment(dir + segment_file);
+            return 1;
+        }
+        if (replace) {
+            deleted = delete_urls(manifest, dir, urls, obsolete, error);
+            if (deleted < 0) {
+                std::cerr << "Cannot delete documents: " << error << std::endl;
+                remove_segment(dir + segment_file);
+                return 1;
+            }
+        }
+
+        SegmentInfo info;
+        info.file = segment_file;
+        info.base = base;
+        info.docs = (uint64_t)count;
+        manifest.segments.push_back(info);
+        manifest.generation++;
+        if (!write_manifest(path, manifest)) {
+            std::cerr << "Error writing manifest: " << path << std::endl;
+            remove_segment(dir + segment_file);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < obsolete.size(); ++i) std::remove((dir + obsolete[i]).c_str());
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "Appended " << count << " documents (" << num_terms << " terms) as " << segment_file << " in "
+              << elapsed.count() * 1000 << " ms";
+    if (replace) std::cout << ", replacing " << deleted << " older versions";
+    std::cout << "; index has " << manifest.segments.size() << " segments, " << manifest.num_docs() << " documents."
+              << std::endl;
+    if (merge) start_background_merge(index_file, manifest);
+    return 0;
+}
+
+// A full build replaces all segments: an existing manifest is reset to the
+// new index alone, or to its shards (`shard_docs` documents each), and the
+// other segments and bitmaps it listed are removed. A split index always
+// gets a manifest.
+bool reset_segments(const std::string& index_file, const Vector<uint64_t>& shard_docs) {
+    std::string path = manifest_path(index_file);
+    if (shard_docs.size() == 1 && !file_exists(path)) return true;
+    FileLock lock(path + ".lock");
+    Manifest old, manifest;
+    std::string error;
+    if (file_exists(path) && !read_manifest(path, old, error)) {
+        std::cerr << "Replacing unreadable manifest: " << error << std::endl;
+    }
+    manifest.generation = old.generation + 1;
+    manifest.next_segment = old.next_segment;
+    for (size_t s = 0; s < shard_docs.size(); ++s) {
+        SegmentInfo info;
+        info.file = base_name(shard_file(index_file, s));
+        info.base = manifest.num_docs();
+        info.docs = shard_docs[s];
+        manifest.segments.push_back(info);
+    }
+    if (!write_manifest(path, manifest)) {
+        std::cerr << "Error writing manifest: " << path << std::endl;
+        return false;
+    }
+    std::string dir = dir_of(index_file);
+    for (size_t i = 0; i < old.segments.size(); ++i) {
+        bool kept = false;
+        for (size_t s = 0; s < manifest.segments.size() && !kept; ++s) {
+            kept = old.segments[i].file == manifest.segments[s].file;
+        }
+        if (!kept) remove_segment(dir + old.segments[i].file);
+        if (!old.segments[i].deletes.empty()) std::remove((dir + old.segments[i].deletes).c_str());
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::string corpus_file = file_exists("data/corpus.bin") ? "data/corpus.bin" : "data/corpus.txt";
+    std::string index_file = "data/index.bin";
+    std::string text_file;
+    int num_threads = 1;
+    int num_shards = 1;
+    size_t mem_limit = 0;
+    bool with_positions = true;
     std::string urls_file = "data/urls.txt";
-    std::ifstream ufile(urls_file);
-    Vector<std::string> urls;
-    if (ufile.is_open()) {
-        std::string url;
-        while (std::getline(ufile, url)) {
-            urls.push_back(url);
+    bool urls_given = false;
+    std::string delete_file;
+    bool append = false, update = false, merge = false, background_merge = true;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--append") {
+            append = true;
+        } else if (arg == "--update") {
+            update = true;
+        } else if (arg == "--delete" && i + 1 < argc) {
+            delete_file = argv[++i];
+        } else if (arg == "--merge") {
+            merge = true;
+        } else if (arg == "--no-merge") {
+            background_merge = false;
+        } else if (arg == "--urls" && i + 1 < argc) {
+            urls_file = argv[++i];
+            urls_given = true;
+        } else if (arg == "--export-text") {
+            text_file = "data/index_data.txt";
+        } else if (arg == "--no-positions") {
+            with_positions = false;
+        } else if (arg == "--output" && i + 1 < argc) {
+            index_file = argv[++i];
+        } else if (arg == "--mem-limit" && i + 1 < argc) {
+            mem_limit = parse_size(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            num_threads = std::atoi(argv[++i]);
+            if (num_threads <= 0) num_threads = (int)std::thread::hardware_concurrency();
+            if (num_threads <= 0) num_threads = 1;
+        } else if (arg == "--shards" && i + 1 < argc) {
+            num_shards = std::atoi(argv[++i]);
+            if (num_shards <= 0) num_shards = 1;
+        } else {
+            corpus_file = arg;
         }
     }
 
-    std::string line;
+    if (merge) return run_merges(index_file);
+    if (!delete_file.empty()) return delete_documents(delete_file, index_file, background_merge);
+    if (append || update) {
+        return append_documents(corpus_file, urls_given ? urls_file : "", index_file, with_positions, update,
+                                background_merge);
+    }
+    // Merges read the segments being replaced; wait for a running one.
+    FileLock merging(index_file + ".merge.lock");
+
+    CorpusInput input;
+    std::string error;
+    if (!input.open(corpus_file, urls_file, error)) {
+        std::cerr << "Error opening corpus file: " << error << std::endl;
+        return 1;
+    }
+
+    DocStoreWriter docs;
+    ForwardStoreWriter forward;
+    if (!docs.open(doc_store_path(index_file)) || !forward.open(forward_store_path(index_file))) {
+        std::cerr << "Error opening doc stores for " << index_file << std::endl;
+        return 1;
+    }
+
+    CorpusRecord record;
+    Vector<uint32_t> doc_lengths;
+    // Holds the lengths instead of `doc_lengths` in a memory-bounded build.
+    MappedFile spilled_lengths;
     int doc_id = 0;
+    size_t num_terms = 0;
+    size_t corpus_bytes = 0;
     
     std::cout << "Building index..." << std::endl;
     auto start_time = std::chrono::high_resolution_clock::now();
 
-    while (std::getline(file, line)) {
-        if (doc_id < urls.size()) {
-            doc_map[doc_id] = urls[doc_id];
-        } else {
-            doc_map[doc_id] = "Doc #" + std::to_string(doc_id);
-        }
-
-        Vector<std::string> tokens;
-        tokenize_to_container(line, tokens);
-        
-        doc_lengths[doc_id] = tokens.size(); 
-        
-        HashMap<std::string, int> term_counts;
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            term_counts[tokens[i]]++;
-        }
-
-        Vector<std::string> unique_tokens;
-        for(size_t i=0; i<tokens.size(); ++i) {
-            bool found = false;
-            for(size_t j=0; j<unique_tokens.size(); ++j) {
-                if(unique_tokens[j] == tokens[i]) {
-                    found = true;
-                    break;
-                }
+    if (mem_limit > 0) {
+        // Memory-bounded build: only the index being filled grows until the
+        // next run is flushed. Per-document state costs no memory: the
+        // lengths (4 bytes a document) are spilled to a side file that is
+        // mapped back for the merge, the doc store spools its 17 bytes a
+        // document and the URLs, and the forward store keeps 16 bytes per
+        // compressed block of text.
+        InvertedIndex index;
+        Vector<std::string> run_files;
+        size_t memory = 0;
+        std::string lengths_file = index_file + ".lengths.tmp";
+        std::ofstream lengths_out(lengths_file, std::ios::binary | std::ios::trunc);
+        if (!lengths_out.is_open()) {
+            std::cerr << "Error opening " << lengths_file << std::endl;
+            return 1;
+        }
+        auto fail = [&]() {
+            lengths_out.close();
+            std::remove(lengths_file.c_str());
+            return 1;
+        };
+
+        while (input.next(record)) {
+            docs.add(record.url, record.source, record.crawled);
+            forward.add(record.text);
+            corpus_bytes += record.text.size() + 1;
+            uint32_t length = (uint32_t)add_document(index, doc_id, record.text, with_positions, memory);
+            lengths_out.write((const char*)&length, sizeof(length));
+            doc_id++;
+
+            if (memory >= mem_limit) {
+                std::string run_file = index_file + ".run" + std::to_string(run_files.size());
+                std::cout << "Flushing run " << run_files.size() << " at document " << doc_id << std::endl;
+                if (!write_run(index, run_file)) return fail();
+                run_files.push_back(run_file);
+                index.clear();
+                memory = 0;
             }
-            if(!found) unique_tokens.push_back(tokens[i]);
+        }
+        if (input.failed()) return fail();
+        if (index.size() > 0 || run_files.empty()) {
+            std::string run_file = index_file + ".run" + std::to_string(run_files.size());
+            if (!write_run(index, run_file)) return fail();
+            run_files.push_back(run_file);
+            index.clear();
         }
 
-        for(size_t i=0; i<unique_tokens.size(); ++i) {
-            std::string term = unique_tokens[i];
-            int count = term_counts[term];
-            index[term].push_back(Pair<int, int>(doc_id, count));
+        // The mapping outlives the file, which is gone before the merge.
+        lengths_out.close();
+        bool mapped = !lengths_out.fail() && spilled_lengths.open(lengths_file) &&
+                      spilled_lengths.size() == (size_t)doc_id * sizeof(uint32_t);
+        std::remove(lengths_file.c_str());
+        if (!mapped) {
+            std::cerr << "Error reading back " << lengths_file << std::endl;
+            return 1;
         }
+        std::cout << "Merging " << run_files.size() << " runs into '" << index_file << "'..." << std::endl;
+        if (!merge_runs(run_files, (const uint32_t*)spilled_lengths.data(), (size_t)doc_id, with_positions,
+                        index_file, num_terms)) {
+            return 1;
+        }
+    } else if (num_threads == 1) {
+        InvertedIndex index;
+        size_t memory = 0;
+
+        while (input.next(record)) {
+            docs.add(record.url, record.source, record.crawled);
+            forward.add(record.text);
+            corpus_bytes += record.text.size() + 1;
+
+            doc_lengths.push_back((uint32_t)add_document(index, doc_id, record.text, with_positions, memory));
 
-        doc_id++;
-        if (doc_id % 1000 == 0) {
-            std::cout << "Processed " << doc_id << " documents\r" << std::flush;
+            doc_id++;
+            if (doc_id % 1000 == 0) {
+                std::cout << "Processed " << doc_id << " documents\r" << std::flush;
+            }
         }
+        if (input.failed()) return 1;
+        num_terms = index.size();
+
+        std::cout << "\nSaving index to '" << index_file << "'..." << std::endl;
+        if (!save_index(index, doc_lengths, with_positions, index_file)) return 1;
+    } else {
+        // Texts of a binary corpus stay in the mapping; lines of a text
+        // corpus are kept in `lines`.
+        Vector<std::string_view> texts;
+        Vector<std::string> lines;
+        while (input.next(record)) {
+            docs.add(record.url, record.source, record.crawled);
+            forward.add(record.text);
+            corpus_bytes += record.text.size() + 1;
+            if (input.binary()) texts.push_back(record.text);
+            else lines.push_back(std::string(record.text));
+            doc_id++;
+        }
+        if (input.failed()) return 1;
+        for (size_t d = 0; d < lines.size(); ++d) texts.push_back(lines[d]);
+
+        doc_lengths = Vector<uint32_t>(texts.size());
+        Vector<PartialIndex*> parts;
+        std::vector<std::thread> workers;
+        size_t next_doc = 0, seen_bytes = 0;
+        for (int w = 0; w < num_threads; ++w) {
+            size_t begin = next_doc;
+            size_t target = corpus_bytes * (w + 1) / num_threads;
+            while (next_doc < texts.size() && (seen_bytes < target || w == num_threads - 1)) {
+                seen_bytes += texts[next_doc++].size() + 1;
+            }
+            size_t end = next_doc;
+            PartialIndex* part = new PartialIndex();
+            parts.push_back(part);
+            workers.emplace_back([part, begin, end, &texts, &doc_lengths, with_positions]() {
+                size_t memory = 0;
+                for (size_t d = begin; d < end; ++d) {
+                    doc_lengths[d] = add_document(part->index, (int)d, texts[d], with_positions, memory);
+                }
+                sorted_terms(part->index, part->terms);
+            });
+        }
+        for (size_t w = 0; w < workers.size(); ++w) workers[w].join();
+        std::cout << "Processed " << doc_id << " documents on " << num_threads << " threads" << std::endl;
+
+        std::cout << "Saving index to '" << index_file << "'..." << std::endl;
+        bool ok = save_merged_index(parts, num_threads, doc_lengths, with_positions, index_file, num_terms);
+        for (size_t p = 0; p < parts.size(); ++p) delete parts[p];
+        if (!ok) return 1;
+    }
+    const uint32_t* lengths = mem_limit > 0 ? (const uint32_t*)spilled_lengths.data() : doc_lengths.begin();
+    if (!docs.finish(lengths, (uint64_t)doc_id) || !forward.finish()) {
+        std::cerr << "Error writing doc stores for " << index_file << std::endl;
+        return 1;
     }
+    spilled_lengths.close();
     
     auto end_time = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end_time - start_time;
-    std::cout << "\nIndex built in " << elapsed.count() << " seconds." << std::endl;
+    std::cout << "Index built in " << elapsed.count() << " seconds ("
+              << corpus_bytes / 1048576.0 / elapsed.count() << " MB/s)." << std::endl;
     std::cout << "Total documents: " << doc_id << std::endl;
-    std::cout << "Total unique terms: " << index.size() << std::endl;
+    std::cout << "Total unique terms: " << num_terms << std::endl;
 
-    std::cout << "Saving index to 'data/index_data.txt'..." << std::endl;
-    save_index(index, "data/index_data.txt");
-    save_docs(doc_map, "data/docs_map.txt");
+    if (!text_file.empty()) {
+        std::cout << "Exporting text index to '" << text_file << "'..." << std::endl;
+        if (!export_text(index_file, text_file)) return 1;
+    }
+
+    // Shard 0 is written aside and then takes the place of the whole index.
+    Vector<uint64_t> shard_docs;
+    size_t shards = (size_t)num_shards < (size_t)doc_id ? (size_t)num_shards : (size_t)doc_id;
+    if (shards > 1) {
+        std::cout << "Splitting into " << shards << " shards..." << std::endl;
+        Vector<std::string> files;
+        files.push_back(index_file + ".split");
+        for (size_t s = 1; s < shards; ++s) files.push_back(shard_file(index_file, s));
+        bool ok = split_index(index_file, files, shard_docs) && rename_segment(files[0], index_file);
+        if (!ok) {
+            std::cerr << "Error splitting " << index_file << std::endl;
+            for (size_t s = 0; s < files.size(); ++s) remove_segment(files[s]);
+            return 1;
+        }
+    } else {
+        shard_docs.push_back((uint64_t)doc_id);
+    }
+    if (!reset_segments(index_file, shard_docs)) return 1;
     std::cout << "Done." << std::endl;
 
     return 0;
@@ -14,7 +14,8 @@ void print_usage() {
     std::cout << "Modes:" << std::endl;
     std::cout << "  index    Run the indexer to build the index" << std::endl;
     std::cout << "  search   Run the search engine (interactive)" << std::endl;
-    std::cout << "  cli      Run CLI tools (dump, pack, send)" << std::endl;
+    std::cout << "  serve    Run the search server (--port N | --socket PATH, --threads N)" << std::endl;
+    std::cout << "  cli      Run CLI tools (dump, pack, send, convert)" << std::endl;
     std::cout << "  help     Show this help" << std::endl;
 }
 
@@ -42,6 +43,14 @@ int main(int argc, char* argv[]) {
         }
         return std::system(cmd.c_str());
 
+    } else if (mode == "serve") {
+        std::string cmd = "./bin/searcher --serve";
+        for(int i = 2; i < argc; ++i) {
+            cmd += " ";
+            cmd += argv[i];
+        }
+        return std::system(cmd.c_str());
+
     } else if (mode == "index") {
         std::string cmd = "./bin/indexer";
         for(int i = 2; i < argc; ++i) {
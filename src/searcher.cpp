@@ -5,228 +5,880 @@
 #include <cmath>
 #include <chrono>
 #include <algorithm>
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <queue>
+#include <vector>
+#include <functional>
+#include <map>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 #include "../include/tokenizer.hpp"
 #include "../include/custom_stl.hpp"
+#include "../include/index_format.hpp"
+#include "../include/segments.hpp"
+#include "../include/query.hpp"
+#include "../include/ranking.hpp"
+#include "../include/query_cache.hpp"
+#include "../include/metrics.hpp"
+#include "../include/snippets.hpp"
 
-using InvertedIndex = HashMap<std::string, Vector<Pair<int, int>>>;
-using DocMap = HashMap<int, std::string>;
+struct CachedResult {
+    Vector<SearchResult> results;
+    // Matching documents; with BM25, the documents scored before Block-Max
+    // WAND pruned the rest, which depends on how the index is split.
+    size_t total;
+    // Scoring terms of the expanded query, which snippets highlight; a hit
+    // skips the expansion of prefix and fuzzy words.
+    Vector<std::string> terms;
 
-struct SearchResult {
-    int doc_id;
-    double score;
+    CachedResult() : total(0) {}
 };
 
-Vector<std::string> split(const std::string& s, char delimiter) {
-    return split_string(s, delimiter);
-}
+// A loaded index (all its segments and doc stores). Queries hold a
+// reference while they run, so a reload never unmaps an index under a
+// running query.
+struct Snapshot {
+    SegmentedIndex index;
+};
 
-void load_index(const std::string& filename, InvertedIndex& index) {
-    std::ifstream infile(filename);
-    if (!infile.is_open()) return;
-    
-    std::string line;
-    while (std::getline(infile, line)) {
-        size_t colon_pos = line.find(':');
-        if (colon_pos == std::string::npos) continue;
-        
-        std::string term = line.substr(0, colon_pos);
-        std::string postings_str = line.substr(colon_pos + 1);
-        
-        Vector<std::string> pairs = split(postings_str, ';');
-        for(size_t i=0; i<pairs.size(); ++i) {
-            Vector<std::string> kv = split(pairs[i], ',');
-            if(kv.size() == 2) {
-                int doc_id = std::stoi(kv[0]);
-                int count = std::stoi(kv[1]);
-                index[term].push_back(Pair<int, int>(doc_id, count));
-            }
-        }
+// Opens the index; returns null on failure. Progress goes to `log`.
+std::shared_ptr<Snapshot> load_snapshot(const std::string& index_file, bool verify, std::ostream& log = std::cout) {
+    std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+    std::string error;
+    if (!snapshot->index.open(index_file, verify, error)) {
+        std::cerr << "Cannot load index: " << error << ". Run the indexer first." << std::endl;
+        return nullptr;
     }
+    if (snapshot->index.size() == 0) {
+        std::cerr << "Index is empty. Run the indexer first." << std::endl;
+        return nullptr;
+    }
+    log << "Index loaded. " << snapshot->index.size() << " terms, " << snapshot->index.num_docs() << " docs";
+    if (snapshot->index.num_segments() > 1) log << " in " << snapshot->index.num_segments() << " segments";
+    if (snapshot->index.num_deleted() > 0) log << ", " << snapshot->index.num_deleted() << " deleted";
+    log << "." << std::endl;
+    if (!snapshot->index.has_positions()) {
+        log << "Index has no positions: phrases and NEAR match as plain AND." << std::endl;
+    }
+    return snapshot;
 }
 
-void load_docs(const std::string& filename, DocMap& docs) {
-    std::ifstream infile(filename);
-    if (!infile.is_open()) return;
-    
-    std::string line;
-    while (std::getline(infile, line)) {
-        size_t pipe_pos = line.find('|');
-        if (pipe_pos == std::string::npos) continue;
-        
-        int id = std::stoi(line.substr(0, pipe_pos));
-        std::string url = line.substr(pipe_pos + 1);
-        docs[id] = url;
+// Documents without a URL are shown by id.
+std::string doc_url(const SegmentedIndex& index, int doc_id) {
+    size_t s = index.segment_of(doc_id);
+    std::string_view url = index.doc_store(s).url(doc_id - index.base(s));
+    return url.empty() ? "Doc #" + std::to_string(doc_id) : std::string(url);
+}
+
+// One snippet per result, empty for documents without a stored text. Only
+// the forward store blocks holding the results are decompressed, and of a
+// long document only its first SNIPPET_SCAN_BYTES.
+Vector<std::string> result_snippets(const SegmentedIndex& index, const Vector<SearchResult>& results,
+                                    const Vector<std::string>& terms, const char* open, const char* close) {
+    StageTimer timer(STAGE_SNIPPETS);
+    Vector<std::string> snippets;
+    std::string block;
+    for (size_t i = 0; i < results.size(); ++i) {
+        size_t s = index.segment_of(results[i].doc_id);
+        std::string_view text = index.forward_store(s).text(results[i].doc_id - index.base(s), block, SNIPPET_SCAN_BYTES);
+        // A cut text ends at a space, never inside a character.
+        if (text.size() == SNIPPET_SCAN_BYTES) text = text.substr(0, text.rfind(' '));
+        snippets.push_back(text.empty() ? std::string() : make_snippet(text, terms, open, close));
     }
+    return snippets;
 }
 
-void my_quicksort(Vector<SearchResult>& arr, int low, int high) {
-    if (low < high) {
-        double pivot = arr[high].score;
-        int i = (low - 1);
-        for (int j = low; j <= high - 1; j++) {
-            if (arr[j].score > pivot) {
-                i++;
-                SearchResult temp = arr[i];
-                arr[i] = arr[j];
-                arr[j] = temp;
+// Threads that search the segments (shards) of one query in parallel. The
+// query's own thread takes part, so a query never waits for busy workers,
+// and queries running at the same time share them. Cursor counters of the
+// work done on a worker are handed back to the query's thread.
+class ShardPool {
+    struct Job {
+        const std::function<void(size_t)>* work;
+        size_t size;
+        std::atomic<size_t> next;
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t done;
+        CursorStats cursor;
+
+        Job() : work(nullptr), size(0), next(0), done(0) {}
+    };
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::queue<std::shared_ptr<Job>> jobs;
+    std::vector<std::thread> workers;
+    bool stopping;
+
+    // Runs parts of `job` until none are left.
+    static void help(Job& job, bool on_worker) {
+        size_t ran = 0;
+        for (size_t i = job.next++; i < job.size; i = job.next++) {
+            (*job.work)(i);
+            ran++;
+        }
+        if (ran == 0) return;
+        std::lock_guard<std::mutex> lock(job.mutex);
+        if (on_worker) {
+            CursorStats& mine = cursor_stats();
+            job.cursor.blocks += mine.blocks;
+            job.cursor.postings += mine.postings;
+            job.cursor.bytes += mine.bytes;
+            mine = CursorStats();
+        }
+        job.done += ran;
+        if (job.done == job.size) job.finished.notify_all();
+    }
+
+    void worker() {
+        while (true) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = jobs.front();
+                jobs.pop();
             }
+            help(*job, true);
         }
-        SearchResult temp = arr[i + 1];
-        arr[i + 1] = arr[high];
-        arr[high] = temp;
-        int pi = i + 1;
+    }
 
-        my_quicksort(arr, low, pi - 1);
-        my_quicksort(arr, pi + 1, high);
+public:
+    // `threads` counts the query's own thread: 1 searches segments in turn.
+    ShardPool(int threads) : stopping(false) {
+        for (int i = 1; i < threads; ++i) workers.emplace_back([this]() { worker(); });
     }
+    ShardPool(const ShardPool&) = delete;
+    ShardPool& operator=(const ShardPool&) = delete;
+    ~ShardPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+    }
+
+    size_t threads() const { return workers.size() + 1; }
+
+    // Calls work(i) for every i below n, spread over the workers and the
+    // calling thread; returns when all calls are done.
+    void run(size_t n, const std::function<void(size_t)>& work) {
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        job->work = &work;
+        job->size = n;
+        size_t helpers = n - 1 < workers.size() ? n - 1 : workers.size();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < helpers; ++i) jobs.push(job);
+        }
+        for (size_t i = 0; i < helpers; ++i) ready.notify_one();
+        help(*job, false);
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&]() { return job->done == job->size; });
+        CursorStats& mine = cursor_stats();
+        mine.blocks += job->cursor.blocks;
+        mine.postings += job->cursor.postings;
+        mine.bytes += job->cursor.bytes;
+    }
+};
+
+// Expands the prefix and fuzzy terms of a parsed query over all segments,
+// so every segment sees the same terms. Fuzzy words are looked up in the
+// segments in parallel on `pool`.
+void expand_query(QueryNode* tree, const SegmentedIndex& index, ShardPool& pool) {
+    StageTimer timer(STAGE_LOOKUP);
+    Vector<const IndexReader*> segments;
+    for (size_t s = 0; s < index.num_segments(); ++s) segments.push_back(&index.segment(s));
+    SegmentRunner run = [&pool](size_t n, const std::function<void(size_t)>& work) { pool.run(n, work); };
+    expand_terms(tree, segments, MAX_EXPANSIONS, pool.threads() > 1 ? &run : nullptr);
 }
 
-Vector<int> intersect_lists(const Vector<int>& list1, const Vector<int>& list2) {
-    Vector<int> result;
-    size_t i = 0, j = 0;
-    while(i < list1.size() && j < list2.size()) {
-        if(list1[i] < list2[j]) i++;
-        else if(list2[j] < list1[i]) j++;
-        else {
-            result.push_back(list1[i]);
-            i++; j++;
+// Evaluates the query on every segment into one top k, with document
+// frequencies summed over the segments, so a document scores the same
+// however the index is split. With more than one thread in `pool` each
+// segment gets its own top k, searched in parallel and merged at the end;
+// otherwise one top k collects the segments in turn. Deleted documents are
+// only filtered out of the matches: their postings count in document
+// frequencies until their segment is compacted.
+CachedResult execute_query(const QueryNode* tree, const Snapshot& snapshot, bool bm25, size_t k, ShardPool& pool) {
+    const SegmentedIndex& index = snapshot.index;
+    CachedResult result;
+    StageTimer lookup(STAGE_LOOKUP);
+    Vector<std::string>& terms = result.terms;
+    scoring_terms(tree, terms);
+    CollectionStats stats;
+    stats.num_docs = index.num_docs();
+    stats.avg_doc_length = index.avg_doc_length();
+    Vector<DocIterator*> matches;
+    for (size_t s = 0; s < index.num_segments(); ++s) {
+        stats.add_dfs(index.segment(s), terms);
+        DocIterator* segment_matches = compile_query(tree, index.segment(s));
+        if (const uint64_t* deleted = index.deleted_docs(s)) segment_matches = new LiveIterator(segment_matches, deleted);
+        matches.push_back(segment_matches);
+    }
+    lookup.stop();
+    StageTimer evaluate(STAGE_EVALUATE);
+    auto search_segment = [&](size_t s, TopK& into) {
+        size_t total;
+        if (bm25) total = search_bm25_segment(*tree, *matches[s], index.segment(s), stats, index.base(s), into);
+        else total = rank_segment(*matches[s], terms, index.segment(s), stats, index.base(s), into);
+        delete matches[s];
+        return total;
+    };
+    TopK top(k);
+    if (pool.threads() > 1 && index.num_segments() > 1) {
+        Vector<TopK*> tops;
+        Vector<size_t> totals(index.num_segments());
+        for (size_t s = 0; s < index.num_segments(); ++s) tops.push_back(new TopK(k));
+        pool.run(index.num_segments(), [&](size_t s) { totals[s] = search_segment(s, *tops[s]); });
+        for (size_t s = 0; s < index.num_segments(); ++s) {
+            result.total += totals[s];
+            top.merge(*tops[s]);
+            delete tops[s];
         }
+    } else {
+        for (size_t s = 0; s < index.num_segments(); ++s) result.total += search_segment(s, top);
     }
+    result.results = top.sorted();
     return result;
 }
 
-Vector<int> union_lists(const Vector<int>& list1, const Vector<int>& list2) {
-    Vector<int> result;
-    size_t i = 0, j = 0;
-    while(i < list1.size() && j < list2.size()) {
-        if(list1[i] < list2[j]) {
-            result.push_back(list1[i]);
-            i++;
-        } else if(list2[j] < list1[i]) {
-            result.push_back(list2[j]);
-            j++;
+// Name under which CachedResult::total is reported: BM25 does not count
+// every match.
+const char* total_field(bool bm25) { return bm25 ? "scored" : "total"; }
+
+std::string json_escape(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
         } else {
-            result.push_back(list1[i]);
-            i++; j++;
+            out += (char)c;
         }
     }
-    while(i < list1.size()) result.push_back(list1[i++]);
-    while(j < list2.size()) result.push_back(list2[j++]);
-    return result;
+    return out;
 }
 
-Vector<int> execute_query(const std::string& query, InvertedIndex& index, int total_docs) {
-    Vector<std::string> or_groups = split(query, '|');
-    Vector<int> final_result;
-
-    for(size_t i=0; i<or_groups.size(); ++i) {
-        Vector<std::string> and_terms = split(or_groups[i], '&');
-        Vector<int> group_result;
-        bool first = true;
-
-        for(size_t j=0; j<and_terms.size(); ++j) {
-            std::string term = and_terms[j];
-            size_t first_not_space = term.find_first_not_of(" \t");
-            if (std::string::npos == first_not_space) continue;
-            size_t last_not_space = term.find_last_not_of(" \t");
-            term = term.substr(first_not_space, (last_not_space - first_not_space + 1));
-            
-            Vector<std::string> tokens;
-            tokenize_to_container(term, tokens);
-            if(tokens.empty()) continue;
-            term = tokens[0]; 
-
-            Vector<Pair<int, int>>* postings = index.find(term);
-            Vector<int> term_docs;
-            if(postings) {
-                for(size_t k=0; k<postings->size(); ++k) {
-                    term_docs.push_back((*postings)[k].first);
-                }
-            }
+// Parses all of `text` as a decimal number within [min, max].
+bool parse_number(const std::string& text, long min, long max, long& value) {
+    char* end = nullptr;
+    long n = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || n < min || n > max) return false;
+    value = n;
+    return true;
+}
 
-            if (first) {
-                group_result = term_docs;
-                first = false;
+// Reads the string or number value of `field` from a flat JSON object.
+bool json_field(const std::string& json, const std::string& field, std::string& value) {
+    size_t p = json.find("\"" + field + "\"");
+    if (p == std::string::npos) return false;
+    p = json.find(':', p + field.size() + 2);
+    if (p == std::string::npos) return false;
+    p = json.find_first_not_of(" \t", p + 1);
+    if (p == std::string::npos) return false;
+    value.clear();
+    if (json[p] != '"') {
+        size_t end = json.find_first_of(",} \t", p);
+        value = json.substr(p, end == std::string::npos ? std::string::npos : end - p);
+        return !value.empty();
+    }
+    for (++p; p < json.size() && json[p] != '"'; ++p) {
+        if (json[p] != '\\' || p + 1 == json.size()) {
+            value += json[p];
+            continue;
+        }
+        char c = json[++p];
+        if (c == 'n') value += '\n';
+        else if (c == 't') value += '\t';
+        else if (c == 'u' && p + 4 < json.size()) {
+            unsigned code = (unsigned)std::strtoul(json.substr(p + 1, 4).c_str(), nullptr, 16);
+            p += 4;
+            if (code < 0x80) value += (char)code;
+            else if (code < 0x800) {
+                value += (char)(0xC0 | (code >> 6));
+                value += (char)(0x80 | (code & 0x3F));
             } else {
-                group_result = intersect_lists(group_result, term_docs);
+                value += (char)(0xE0 | (code >> 12));
+                value += (char)(0x80 | ((code >> 6) & 0x3F));
+                value += (char)(0x80 | (code & 0x3F));
+            }
+        } else value += c;
+    }
+    return p < json.size();
+}
+
+const size_t MAX_REQUEST_LINE = 64 * 1024;
+const int IDLE_TIMEOUT_SEC = 60;
+
+// Query server. Each request is one line: either plain query text or a JSON
+// object {"q": "...", "k": 10}, where k is capped at --topk; the commands
+// 'reload', 'stats' and 'quit' are also accepted. Every reply is one line of
+// JSON carrying the request latency; replies to queries count the matches
+// as "total", or with BM25 the documents scored as "scored". One thread
+// polls every connection and hands each complete request line to a fixed
+// pool of workers, so idle clients hold no worker; lines longer than
+// MAX_REQUEST_LINE and connections idle for IDLE_TIMEOUT_SEC are dropped.
+// All workers share the read-only index and one cache.
+class SearchServer {
+    std::string index_file;
+    bool verify;
+    bool bm25;
+    size_t limit;
+    bool snippets;
+    ShardPool& pool;
+
+    std::mutex snapshot_mutex;
+    std::shared_ptr<Snapshot> snapshot;
+    std::mutex cache_mutex;
+    QueryCache<CachedResult> cache;
+
+    // A client connection, owned by the polling thread.
+    struct Connection {
+        std::string buffer;    // received bytes not yet dispatched
+        bool busy;             // a worker is answering one of its lines
+        bool done;             // EOF, 'quit' or an error: no more reads
+        uint64_t last_active;  // now_ns() of the last read or reply
+    };
+    struct Request {
+        int fd;
+        std::string line;
+    };
+    struct Answered {
+        int fd;
+        bool sent;
+    };
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::queue<Request> requests;
+    std::vector<Answered> answered;
+    // Workers write a byte here to wake the polling thread.
+    int wake[2];
+
+    std::shared_ptr<Snapshot> current() {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        return snapshot;
+    }
+
+    std::string reload() {
+        std::shared_ptr<Snapshot> fresh = load_snapshot(index_file, verify);
+        if (!fresh) return "{\"error\":\"reload failed, keeping the loaded index\"}";
+        std::string reply = "{\"reloaded\":true,\"segments\":" + std::to_string(fresh->index.num_segments()) +
+                            ",\"terms\":" + std::to_string(fresh->index.size()) +
+                            ",\"docs\":" + std::to_string(fresh->index.num_docs()) + "}";
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot = fresh;
+        return reply;
+    }
+
+    std::string answer(const std::string& request) {
+        std::string query = request;
+        size_t k = limit;
+        if (!request.empty() && request[0] == '{') {
+            std::string value;
+            if (!json_field(request, "q", query)) return "{\"error\":\"missing \\\"q\\\"\"}";
+            if (json_field(request, "k", value)) {
+                long n;
+                if (!parse_number(value, 1, LONG_MAX, n)) {
+                    return "{\"error\":\"\\\"k\\\" must be a positive integer\"}";
+                }
+                if ((size_t)n < k) k = (size_t)n;
             }
         }
+        uint64_t start = now_ns();
+        std::string error;
+        StageTimer parse(STAGE_PARSE);
+        QueryNode* tree = parse_query(query, error);
+        std::string key = tree ? query_key(tree) + "#" + std::to_string(k) : std::string();
+        parse.stop();
+        if (!tree) {
+            if (!error.empty()) query_stats().add(COUNT_QUERY_ERRORS);
+            query_stats().finish_query(now_ns() - start, 0);
+            if (!error.empty()) return "{\"error\":\"" + json_escape(error) + "\"}";
+            return "{\"" + std::string(total_field(bm25)) + "\":0,\"results\":[]";
+        }
+        std::shared_ptr<Snapshot> s = current();
+        CachedResult result;
+        bool cached = false;
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            const CachedResult* hit = cache.find(key, s->index.generation());
+            if (hit) {
+                result = *hit;
+                cached = true;
+            }
+        }
+        query_stats().add(cached ? COUNT_CACHE_HITS : COUNT_CACHE_MISSES);
+        if (!cached) {
+            expand_query(tree, s->index, pool);
+            result = execute_query(tree, *s, bm25, k, pool);
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            cache.insert(key, s->index.generation(), result);
+        }
+        delete tree;
+        Vector<std::string> fragments;
+        if (snippets) fragments = result_snippets(s->index, result.results, result.terms, "<b>", "</b>");
+        query_stats().finish_query(now_ns() - start, cached ? 0 : result.total);
 
-        if (first) continue; 
+        std::string reply = "{\"" + std::string(total_field(bm25)) + "\":" + std::to_string(result.total) +
+                            ",\"cached\":" + (cached ? "true" : "false") + ",\"results\":[";
+        for (size_t i = 0; i < result.results.size(); ++i) {
+            const SearchResult& r = result.results[i];
+            if (i) reply += ',';
+            reply += "{\"doc\":" + std::to_string(r.doc_id) + ",\"score\":" + std::to_string(r.score) +
+                     ",\"url\":\"" + json_escape(doc_url(s->index, r.doc_id)) + "\"";
+            if (snippets) reply += ",\"snippet\":\"" + json_escape(fragments[i]) + "\"";
+            reply += '}';
+        }
+        return reply + "]";
+    }
 
-        if (final_result.empty() && or_groups.size() == 1) {
-             final_result = group_result;
-        } else {
-             final_result = union_lists(final_result, group_result);
+    static bool send_all(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            sent += (size_t)n;
         }
+        return true;
     }
-    
-    return final_result;
-}
 
-Vector<SearchResult> rank_results(const Vector<int>& docs, const std::string& query, InvertedIndex& index, int total_docs) {
-    Vector<SearchResult> results;
-    
-    Vector<std::string> terms;
-    Vector<std::string> raw_tokens;
-    tokenize_to_container(query, raw_tokens);
-    for(size_t i=0; i<raw_tokens.size(); ++i) terms.push_back(raw_tokens[i]);
+    std::string reply_to(const std::string& request) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::string reply = request == "reload" ? reload() : request == "stats" ? query_stats().json() : answer(request);
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::high_resolution_clock::now() - start;
+        // Error and reload replies are complete objects; query replies
+        // are closed here once the latency is known.
+        if (reply.back() == '}') reply.pop_back();
+        return reply + ",\"latency_us\":" + std::to_string((long long)elapsed.count()) + "}\n";
+    }
 
-    for(size_t i=0; i<docs.size(); ++i) {
-        int doc_id = docs[i];
-        double score = 0.0;
-        
-        for(size_t j=0; j<terms.size(); ++j) {
-            std::string term = terms[j];
-            Vector<Pair<int, int>>* postings = index.find(term);
-            if(postings) {
-                int tf = 0;
-                for(size_t k=0; k<postings->size(); ++k) {
-                    if((*postings)[k].first == doc_id) {
-                        tf = (*postings)[k].second;
-                        break;
+    // Answers one request line and reports back to the polling thread,
+    // which owns the connection and closes it.
+    void worker() {
+        while (true) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this]() { return !requests.empty(); });
+                request = std::move(requests.front());
+                requests.pop();
+            }
+            bool sent = send_all(request.fd, reply_to(request.line));
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                answered.push_back(Answered{request.fd, sent});
+            }
+            char byte = 0;
+            ssize_t woken = ::write(wake[1], &byte, 1);
+            (void)woken;
+        }
+    }
+
+    // Hands the next complete line of an idle connection to the workers.
+    // Lines are answered one at a time, so replies keep the request order.
+    void dispatch(int fd, Connection& c) {
+        size_t newline;
+        while ((newline = c.buffer.find('\n')) != std::string::npos) {
+            std::string line = c.buffer.substr(0, newline);
+            c.buffer.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) continue;
+            if (line == "quit") {
+                c.buffer.clear();
+                c.done = true;
+                return;
+            }
+            c.busy = true;
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            requests.push(Request{fd, std::move(line)});
+            queue_ready.notify_one();
+            return;
+        }
+        if (c.buffer.size() > MAX_REQUEST_LINE) {
+            send_all(fd, "{\"error\":\"request line longer than " + std::to_string(MAX_REQUEST_LINE) + " bytes\"}\n");
+            c.buffer.clear();
+            c.done = true;
+        }
+    }
+
+    // Polls the listening socket and every connection without a request in
+    // flight; reads whatever arrived, dispatches complete lines and closes
+    // connections that ended, failed or sat idle for IDLE_TIMEOUT_SEC.
+    void poll_connections(int listener) {
+        std::map<int, Connection> clients;
+        std::vector<pollfd> fds;
+        char chunk[4096];
+        timeval send_timeout;
+        send_timeout.tv_sec = IDLE_TIMEOUT_SEC;
+        send_timeout.tv_usec = 0;
+        while (true) {
+            fds.clear();
+            fds.push_back(pollfd{listener, POLLIN, 0});
+            fds.push_back(pollfd{wake[0], POLLIN, 0});
+            for (auto it = clients.begin(); it != clients.end(); ++it) {
+                if (!it->second.busy && !it->second.done) fds.push_back(pollfd{it->first, POLLIN, 0});
+            }
+            if (::poll(fds.data(), fds.size(), 1000) < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "poll failed: " << std::strerror(errno) << std::endl;
+                break;
+            }
+            uint64_t now = now_ns();
+
+            if (fds[1].revents) {
+                char drain[64];
+                ssize_t woken = ::read(wake[0], drain, sizeof(drain));
+                (void)woken;
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                for (size_t i = 0; i < answered.size(); ++i) {
+                    Connection& c = clients[answered[i].fd];
+                    c.busy = false;
+                    c.last_active = now;
+                    if (!answered[i].sent) {
+                        c.buffer.clear();
+                        c.done = true;
                     }
                 }
-                if(tf > 0) {
-                    double df = (double)postings->size();
-                    double idf = std::log10((double)total_docs / (df + 1.0));
-                    score += (double)tf * idf;
+                answered.clear();
+            }
+            for (size_t i = 2; i < fds.size(); ++i) {
+                if (!fds[i].revents) continue;
+                Connection& c = clients[fds[i].fd];
+                ssize_t n = ::recv(fds[i].fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) {
+                    if (n < 0) c.buffer.clear();
+                    c.done = true;
+                    continue;
+                }
+                c.buffer.append(chunk, (size_t)n);
+                c.last_active = now;
+            }
+            if (fds[0].revents) {
+                int client = ::accept(listener, nullptr, nullptr);
+                if (client >= 0) {
+                    // A client that stops reading cannot hold a worker forever.
+                    ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+                    clients[client] = Connection{std::string(), false, false, now};
+                } else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+                    std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+                    break;
+                }
+            }
+
+            // Lines still buffered after the client closed its end are
+            // answered before the connection is.
+            for (auto it = clients.begin(); it != clients.end();) {
+                Connection& c = it->second;
+                if (!c.busy) dispatch(it->first, c);
+                bool idle = !c.busy && now - c.last_active > (uint64_t)IDLE_TIMEOUT_SEC * 1000000000ULL;
+                if (!c.busy && (idle || (c.done && c.buffer.find('\n') == std::string::npos))) {
+                    ::close(it->first);
+                    it = clients.erase(it);
+                } else {
+                    ++it;
                 }
             }
         }
-        
-        SearchResult res;
-        res.doc_id = doc_id;
-        res.score = score;
-        results.push_back(res);
     }
-    
-    if(results.size() > 0)
-        my_quicksort(results, 0, results.size() - 1);
-        
-    return results;
+
+public:
+    SearchServer(const std::string& index_file, bool verify, bool bm25, size_t limit, bool snippets, size_t cache_size,
+                 std::shared_ptr<Snapshot> loaded, ShardPool& pool)
+        : index_file(index_file), verify(verify), bm25(bm25), limit(limit), snippets(snippets), pool(pool),
+          snapshot(loaded), cache(cache_size) {}
+
+    // Listens on a Unix socket if `socket_path` is set, otherwise on
+    // 127.0.0.1:port. Only returns on error.
+    int run(const std::string& socket_path, int port, int num_threads) {
+        int fd;
+        if (!socket_path.empty()) {
+            fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (socket_path.size() >= sizeof(addr.sun_path)) {
+                std::cerr << "Socket path too long: " << socket_path << std::endl;
+                return 1;
+            }
+            std::strcpy(addr.sun_path, socket_path.c_str());
+            ::unlink(socket_path.c_str());
+            if (fd < 0 || ::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+                std::cerr << "Cannot bind " << socket_path << ": " << std::strerror(errno) << std::endl;
+                return 1;
+            }
+        } else {
+            fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            int yes = 1;
+            if (fd >= 0) ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            sockaddr_in addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons((uint16_t)port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (fd < 0 || ::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+                std::cerr << "Cannot bind port " << port << ": " << std::strerror(errno) << std::endl;
+                return 1;
+            }
+        }
+        if (::listen(fd, 128) != 0) {
+            std::cerr << "Cannot listen: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+
+        if (::pipe(wake) != 0) {
+            std::cerr << "Cannot create pipe: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < num_threads; ++i) workers.emplace_back([this]() { worker(); });
+        std::cout << "Serving on " << (socket_path.empty() ? "127.0.0.1:" + std::to_string(port) : socket_path)
+                  << " with " << num_threads << " threads." << std::endl;
+
+        poll_connections(fd);
+        ::close(fd);
+        for (size_t i = 0; i < workers.size(); ++i) workers[i].detach();
+        return 1;
+    }
+};
+
+struct BatchQuery {
+    std::string id;
+    std::string text;
+    std::string error;
+    CachedResult result;
+    double latency_us;
+};
+
+// Runs every query of `file` once, spread over `num_threads` threads, and
+// writes one TSV or JSON line per query in file order. A line may be
+// "id<TAB>query"; otherwise the line number is the id. The cache is not
+// used, so latencies reflect the index itself. The match count column is
+// "total", or "scored" with BM25 (see CachedResult).
+int run_batch(const Snapshot& snapshot, const std::string& file, const std::string& output, bool json, int num_threads,
+              bool bm25, size_t k, ShardPool& pool) {
+    std::ifstream in(file);
+    if (!in.is_open()) {
+        std::cerr << "Cannot open " << file << std::endl;
+        return 1;
+    }
+    std::vector<BatchQuery> queries;
+    std::string line;
+    for (size_t n = 1; std::getline(in, line); ++n) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        BatchQuery q;
+        size_t tab = line.find('\t');
+        q.id = tab == std::string::npos ? std::to_string(n) : line.substr(0, tab);
+        q.text = tab == std::string::npos ? line : line.substr(tab + 1);
+        q.latency_us = 0.0;
+        queries.push_back(q);
+    }
+
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < queries.size(); i = next++) {
+            BatchQuery& q = queries[i];
+            uint64_t start = now_ns();
+            StageTimer parse(STAGE_PARSE);
+            QueryNode* tree = parse_query(q.text, q.error);
+            parse.stop();
+            if (tree) {
+                expand_query(tree, snapshot.index, pool);
+                q.result = execute_query(tree, snapshot, bm25, k, pool);
+            } else if (!q.error.empty()) {
+                query_stats().add(COUNT_QUERY_ERRORS);
+            }
+            delete tree;
+            uint64_t elapsed = now_ns() - start;
+            query_stats().finish_query(elapsed, q.result.total);
+            q.latency_us = elapsed / 1e3;
+        }
+    };
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 1; t < num_threads; ++t) workers.emplace_back(work);
+    work();
+    for (size_t t = 0; t < workers.size(); ++t) workers[t].join();
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    std::ofstream file_out;
+    if (!output.empty()) {
+        file_out.open(output);
+        if (!file_out.is_open()) {
+            std::cerr << "Cannot write " << output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = output.empty() ? std::cout : file_out;
+    if (!json) out << "id\t" << total_field(bm25) << "\tlatency_us\tdocs\tscores\terror\n";
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const BatchQuery& q = queries[i];
+        const Vector<SearchResult>& results = q.result.results;
+        std::string docs, scores;
+        for (size_t r = 0; r < results.size(); ++r) {
+            if (r) {
+                docs += ',';
+                scores += ',';
+            }
+            docs += std::to_string(results[r].doc_id);
+            scores += std::to_string(results[r].score);
+        }
+        long long latency = (long long)q.latency_us;
+        if (json) {
+            out << "{\"id\":\"" << json_escape(q.id) << "\",\"" << total_field(bm25) << "\":" << q.result.total
+                << ",\"latency_us\":" << latency << ",\"docs\":[" << docs << "],\"scores\":[" << scores << "]";
+            if (!q.error.empty()) out << ",\"error\":\"" << json_escape(q.error) << "\"";
+            out << "}\n";
+        } else {
+            out << q.id << '\t' << q.result.total << '\t' << latency << '\t' << docs << '\t' << scores << '\t' << q.error
+                << '\n';
+        }
+    }
+    out.flush();
+
+    std::vector<double> latencies;
+    for (size_t i = 0; i < queries.size(); ++i) latencies.push_back(queries[i].latency_us);
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        if (latencies.empty()) return 0.0;
+        size_t rank = (size_t)std::ceil(p * latencies.size());
+        return latencies[rank > 0 ? rank - 1 : 0];
+    };
+    std::cerr << queries.size() << " queries on " << num_threads << " threads in " << elapsed.count() << " sec, "
+              << (elapsed.count() > 0 ? queries.size() / elapsed.count() : 0.0) << " queries/sec; latency us p50 "
+              << percentile(0.50) << ", p95 " << percentile(0.95) << ", p99 " << percentile(0.99) << std::endl;
+    return 0;
+}
+
+void print_usage() {
+    std::cout << "Usage: ./searcher [options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --index FILE            Index to search (data/index.bin)" << std::endl;
+    std::cout << "  --verify                Check the index checksums on load" << std::endl;
+    std::cout << "  --bm25                  Rank with BM25 instead of TF-IDF" << std::endl;
+    std::cout << "  --topk N                Results per query, 1 or more (10)" << std::endl;
+    std::cout << "  --no-snippets           Leave out result snippets" << std::endl;
+    std::cout << "  --cache N               Cached query results, 0 to disable, up to 1048576 (1024)" << std::endl;
+    std::cout << "  --serve                 Answer queries over TCP or a Unix socket" << std::endl;
+    std::cout << "  --port N                TCP port, 1-65535 (7700)" << std::endl;
+    std::cout << "  --socket PATH           Unix socket instead of TCP" << std::endl;
+    std::cout << "  --threads N             Server or batch threads (all cores)" << std::endl;
+    std::cout << "  --shard-threads N       Threads searching the segments of a query (all cores)" << std::endl;
+    std::cout << "  --batch FILE            Run the queries of FILE and exit" << std::endl;
+    std::cout << "  --output FILE           Batch results file (stdout)" << std::endl;
+    std::cout << "  --json                  Batch results as JSON lines instead of TSV" << std::endl;
+    std::cout << "  --metrics-file FILE     Write Prometheus metrics to FILE" << std::endl;
+    std::cout << "  --metrics-interval SEC  Seconds between metrics writes (10)" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
-    std::setlocale(LC_ALL, "");
-    
-    std::string index_file = "data/index_data.txt";
-    std::string docs_file = "data/docs_map.txt";
-    
-    InvertedIndex index;
-    DocMap doc_map;
-    
-    std::cout << "Loading index..." << std::endl;
-    load_index(index_file, index);
-    load_docs(docs_file, doc_map);
-    
-    if (index.size() == 0) {
-        std::cerr << "Index is empty. Run the indexer first." << std::endl;
-        return 1;
+    std::string index_file = "data/index.bin";
+    bool verify = false;
+    bool bm25 = false;
+    size_t limit = 10;
+    bool snippets = true;
+    size_t cache_size = 1024;
+    bool serve = false;
+    int port = 7700;
+    std::string socket_path;
+    int num_threads = 0;
+    int shard_threads = 0;
+    std::string batch_file;
+    std::string output_file;
+    bool json = false;
+    std::string metrics_file;
+    int metrics_interval = 10;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        // Numeric options: the value and the range it must be in.
+        long value = 0, min = 1, max = INT_MAX;
+        if (arg == "--cache") {
+            min = 0;
+            max = (long)MAX_QUERY_CACHE;
+        }
+        if (arg == "--port") max = 65535;
+        if (arg == "--threads" || arg == "--shard-threads") max = 1024;
+        if (arg == "--topk" || arg == "--cache" || arg == "--port" || arg == "--threads" ||
+            arg == "--shard-threads" || arg == "--metrics-interval") {
+            if (i + 1 >= argc || !parse_number(argv[i + 1], min, max, value)) {
+                std::cerr << arg << " needs a number from " << min << " to " << max << std::endl;
+                print_usage();
+                return 1;
+            }
+            ++i;
+        }
+        if (arg == "--index" && i + 1 < argc) index_file = argv[++i];
+        else if (arg == "--verify") verify = true;
+        else if (arg == "--bm25") bm25 = true;
+        else if (arg == "--topk") limit = (size_t)value;
+        else if (arg == "--no-snippets") snippets = false;
+        else if (arg == "--cache") cache_size = (size_t)value;
+        else if (arg == "--serve") serve = true;
+        else if (arg == "--port") port = (int)value;
+        else if (arg == "--socket" && i + 1 < argc) socket_path = argv[++i];
+        else if (arg == "--threads") num_threads = (int)value;
+        else if (arg == "--shard-threads") shard_threads = (int)value;
+        else if (arg == "--batch" && i + 1 < argc) batch_file = argv[++i];
+        else if (arg == "--output" && i + 1 < argc) output_file = argv[++i];
+        else if (arg == "--json") json = true;
+        else if (arg == "--metrics-file" && i + 1 < argc) metrics_file = argv[++i];
+        else if (arg == "--metrics-interval") metrics_interval = (int)value;
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            print_usage();
+            return 1;
+        }
     }
+    // Unless given, both default to the number of cores.
+    if (num_threads == 0) num_threads = (int)std::thread::hardware_concurrency();
+    if (num_threads <= 0) num_threads = 1;
+    if (shard_threads == 0) shard_threads = (int)std::thread::hardware_concurrency();
+    if (shard_threads <= 0) shard_threads = 1;
     
-    std::cout << "Index loaded. " << index.size() << " terms, " << doc_map.size() << " docs." << std::endl;
-    std::cout << "Enter query (or 'exit'):" << std::endl;
+    // Batch results may go to stdout, so progress goes to stderr there.
+    std::ostream& log = batch_file.empty() ? std::cout : std::cerr;
+    log << "Loading index..." << std::endl;
+    std::shared_ptr<Snapshot> snapshot = load_snapshot(index_file, verify, log);
+    if (!snapshot) return 1;
+    // Rewrites the metrics file periodically and a last time on exit.
+    std::unique_ptr<MetricsDumper> dumper;
+    if (!metrics_file.empty()) dumper.reset(new MetricsDumper(metrics_file, metrics_interval));
+    ShardPool pool(shard_threads);
+    if (!batch_file.empty()) return run_batch(*snapshot, batch_file, output_file, json, num_threads, bm25, limit, pool);
+    if (serve) {
+        SearchServer server(index_file, verify, bm25, limit, snippets, cache_size, snapshot, pool);
+        snapshot.reset();
+        return server.run(socket_path, port, num_threads);
+    }
+    QueryCache<CachedResult> cache(cache_size);
+    // Matches are shown in bold on a terminal.
+    bool tty = isatty(STDOUT_FILENO);
+    std::cout << "Enter query ('reload' to reopen the index, 'stats' for timings, 'exit' to quit):" << std::endl;
+
     
     std::string query;
     while (true) {
@@ -234,25 +886,70 @@ int main(int argc, char* argv[]) {
         std::getline(std::cin, query);
         
         if (query == "exit" || query.empty()) break;
+        if (query == "reload") {
+            std::shared_ptr<Snapshot> fresh = load_snapshot(index_file, verify);
+            if (fresh) snapshot = fresh;
+            continue;
+        }
+        if (query == "stats") {
+            std::cout << query_stats().text();
+            continue;
+        }
         
         auto start_q = std::chrono::high_resolution_clock::now();
-        Vector<int> results = execute_query(query, index, doc_map.size());
-        
-        Vector<SearchResult> ranked_results = rank_results(results, query, index, doc_map.size());
+        uint64_t start_ns = now_ns();
+        std::string error;
+        StageTimer parse(STAGE_PARSE);
+        QueryNode* tree = parse_query(query, error);
+        std::string key = tree ? query_key(tree) : std::string();
+        parse.stop();
+        if (!tree) {
+            if (!error.empty()) query_stats().add(COUNT_QUERY_ERRORS);
+            query_stats().finish_query(now_ns() - start_ns, 0);
+            if (!error.empty()) std::cerr << "Query error: " << error << std::endl;
+            else std::cout << "Found 0 documents in 0 sec:" << std::endl;
+            continue;
+        }
+        const CachedResult* cached = cache.find(key, snapshot->index.generation());
+        query_stats().add(cached ? COUNT_CACHE_HITS : COUNT_CACHE_MISSES);
+        CachedResult computed;
+        if (!cached) {
+            expand_query(tree, snapshot->index, pool);
+            computed = execute_query(tree, *snapshot, bm25, limit, pool);
+            cache.insert(key, snapshot->index.generation(), computed);
+        }
+        delete tree;
+        const CachedResult& answer = cached ? *cached : computed;
+        const Vector<SearchResult>& ranked_results = answer.results;
+        size_t total = answer.total;
+        Vector<std::string> fragments;
+        if (snippets) {
+            fragments = result_snippets(snapshot->index, ranked_results, answer.terms, tty ? "\033[1m" : "<b>",
+                                        tty ? "\033[0m" : "</b>");
+        }
         
         auto end_q = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> elapsed_q = end_q - start_q;
+        query_stats().finish_query(now_ns() - start_ns, cached ? 0 : total);
         
-        std::cout << "Found " << ranked_results.size() << " documents in " << elapsed_q.count() << " sec:" << std::endl;
+        if (bm25) {
+            std::cout << "Top " << ranked_results.size() << " of " << total << " scored documents in "
+                      << elapsed_q.count() << " sec:" << std::endl;
+        } else {
+            std::cout << "Found " << total << " documents in " << elapsed_q.count() << " sec:" << std::endl;
+        }
         
-        int limit = 10;
-        for (size_t i = 0; i < (ranked_results.size() < limit ? ranked_results.size() : limit); ++i) {
-            std::cout << "[" << ranked_results[i].doc_id << "] (score: " << ranked_results[i].score << ") " << doc_map[ranked_results[i].doc_id] << std::endl;
+        for (size_t i = 0; i < ranked_results.size(); ++i) {
+            std::cout << "[" << ranked_results[i].doc_id << "] (score: " << ranked_results[i].score << ") "
+                      << doc_url(snapshot->index, ranked_results[i].doc_id) << std::endl;
+            if (snippets && !fragments[i].empty()) std::cout << "    " << fragments[i] << std::endl;
         }
-        if (ranked_results.size() > limit) {
-            std::cout << "... and " << (ranked_results.size() - limit) << " more." << std::endl;
+        if (!bm25 && total > ranked_results.size()) {
+            std::cout << "... and " << (total - ranked_results.size()) << " more." << std::endl;
         }
     }
 
+    std::cout << "Cache: " << cache.hits() << " hits, " << cache.misses() << " misses, " << cache.invalidations()
+              << " invalidations." << std::endl;
     return 0;
 }